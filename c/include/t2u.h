@@ -62,6 +62,19 @@ typedef void *forward_rule;
 forward_context create_forward(sock_t s);
 
 
+/* create a server context on an unconnected udp socket, s is bound only.
+ * it serves any number of client sites: a session belongs to the address
+ * of its connect request and replies go there. packets of a session from
+ * another address are dropped. if they are valid for the session the
+ * server asks the new address for the random peer id the client sent in
+ * its connect requests: with the right id back the client's nat mapping
+ * changed, all its sessions move to the new address and resend what is not
+ * acknowledged. server rules only, a client rule fails with T2U_ERR_MODE.
+ * free it with free_forward.
+ */
+forward_context create_forward_server(sock_t s);
+
+
 /*
  * destroy the context, and it's rules.
  * udp socket will not be closed, you should manage it by youself.
@@ -81,22 +94,79 @@ void free_forward(forward_context c);
 // session timeout in seconds. 10 - 86400, default 900.
 #define CTX_SESSION_TIMEOUT (0x04)
 
+// memory budget for in flight and out of order message buffers, bytes. default: 0, unlimited.
+// tcp reads pause when it is full, accepts pause above 3/4 of it.
+#define CTX_MEMORY_BUDGET (0x05)
+
 
 // udp debug option: simulate a delay, ms. default: 0.
 #define CTX_UDP_DEBUG_DELAY (0xf0)
 
-// udp debug option: simulate a packet loss. 1-10000. default: 0
+// udp debug option: simulate a packet loss, in 1/10000. 1-10000. default: 0
 #define CTX_UDP_DEBUG_PACKET_LOSS (0xf1)
 
 // udp debug option: simulate bandwidth in bps. default: 0
 #define CTX_UDP_DEBUG_BANDWIDTH (0xf2)
 
+// udp debug option: seed for simulated loss and reorder. default: 1
+#define CTX_UDP_DEBUG_SEED (0xf3)
+
+// udp debug option: mean loss burst length in packets, 0-1000. default: 0, independent loss
+#define CTX_UDP_DEBUG_LOSS_BURST (0xf4)
+
+// udp debug option: simulate reorder, 1-10000. default: 0
+#define CTX_UDP_DEBUG_REORDER (0xf5)
+
+// udp debug option: extra delay for reordered packets, ms. default: 10
+#define CTX_UDP_DEBUG_REORDER_DELAY (0xf6)
+
 /*
  * forward context option
  */
 void set_context_option(forward_context c, int option, unsigned long value);
 
 
+// udp packets sent, before udp debug options
+#define CTX_STAT_UDP_SENT_PACKETS (0x01)
+
+// udp bytes sent, before udp debug options
+#define CTX_STAT_UDP_SENT_BYTES (0x02)
+
+// udp data packets sent again, for timeout or retrans request
+#define CTX_STAT_UDP_RETRANS_PACKETS (0x03)
+
+// udp packets received
+#define CTX_STAT_UDP_RECV_PACKETS (0x04)
+
+// bytes read from tcp sockets
+#define CTX_STAT_TCP_RECV_BYTES (0x05)
+
+// bytes written to tcp sockets
+#define CTX_STAT_TCP_SENT_BYTES (0x06)
+
+// bytes of message buffers in use, see CTX_MEMORY_BUDGET
+#define CTX_STAT_MEMORY_USED (0x07)
+
+// udp packets received for a session of another shard of the group, see forward_group
+#define CTX_STAT_UDP_HANDOFF_PACKETS (0x08)
+
+// loop lag of the context's runner, us, moving average. see forward_group_balance
+#define CTX_STAT_LOOP_LAG_US (0x09)
+
+// sessions moved to another shard of the group, see forward_group_balance
+#define CTX_STAT_SESSIONS_MIGRATED (0x0a)
+
+// peers of a server context seen at a new address, see create_forward_server
+#define CTX_STAT_PEER_REBINDS (0x0b)
+
+#define CTX_STAT_MAX (0x0c)
+
+/*
+ * forward context statistics
+ */
+unsigned long long get_context_stat(forward_context c, int stat);
+
+
 /*
  * This function is useful for send data with the socket.
  * as socket it managed by the forward-context, if tou need send some data,
@@ -111,6 +181,13 @@ int forward_send(sock_t s, const char *buffer, size_t length);
  */
 void set_unknown_callback(void(*unknown_cb)(forward_context c, const char *buffer, size_t length));
 
+// error codes of error callback, when a rule can't be added
+#define T2U_ERR_SOCKET (1)      // create the listen socket failed
+#define T2U_ERR_BIND (2)        // bind the listen address failed
+#define T2U_ERR_LISTEN (3)      // listen failed
+#define T2U_ERR_DUPLICATE (4)   // the service already exists in the context
+#define T2U_ERR_MODE (5)        // the mode is not supported by the context
+
 /*
  * error callback functions
  * when error ocupy, callback is called
@@ -121,6 +198,31 @@ void set_error_callback(void(*error_cb)(forward_context c, forward_rule rule, in
 /* level: 0: debug, 1: info, 2: warning, 3: error */
 void set_log_callback(void(*cb)(int level, const char *mess));
 
+/* minimum log level for callback, default 0.
+ * messages below the level are dropped before formatting.
+ * log callback is called in a log writer thread while runner is alive.
+ */
+void set_log_level(int level);
+
+// runner thread options, for runner threads started after the call.
+// cpus the runner thread may run on, bit i for cpu i. default: 0, any cpu.
+#define RUNNER_CPU_MASK (0x01)
+// scheduling priority of the runner thread, 1-99 for SCHED_FIFO (time critical
+// on windows), needs the privilege. default: 0, normal.
+#define RUNNER_PRIORITY (0x02)
+// 1 to pin runner i of the pool to one cpu of RUNNER_CPU_MASK, round robin.
+// default: 0, every runner may run on all cpus of the mask.
+#define RUNNER_CPU_SPREAD (0x03)
+
+/*
+ * runner thread options, set before the first create_forward.
+ */
+void set_runner_option(int option, unsigned long long value);
+
+/* name of runner threads, shown by profilers. 15 chars max, default: "t2u-runner".
+ * runner i of the pool gets suffix -i */
+void set_runner_name(const char *name);
+
 /* add a forward rule, return NULL if failed. */
 forward_rule add_forward_rule(forward_context c,       /* context */
     forward_mode mode,       /* mode: client or server */
@@ -132,10 +234,165 @@ forward_rule add_forward_rule(forward_context c,       /* context */
 /* remove a forward rule */
 void del_forward_rule(forward_rule r);
 
+/* one rule of add_forward_rules, same as the arguments of add_forward_rule */
+typedef struct rule_spec_
+{
+    forward_mode mode;
+    const char *service;
+    const char *addr;
+    unsigned short port;
+} rule_spec;
+
+/*
+ * add rules in one round trip to the runner.
+ * out[i] is NULL if specs[i] failed, the error callback is called for it.
+ * out may be NULL if the rules are not needed.
+ * return the count of rules added.
+ */
+size_t add_forward_rules(forward_context c, const rule_spec *specs, size_t n, forward_rule *out);
+
+/* remove rules in one round trip to the runner, NULL entries are skipped */
+void del_forward_rules(forward_rule *rules, size_t n);
+
+
+// rule options override the context's for sessions of the rule, same range.
+// default: 0, use the context's. set 0 to use the context's again.
+#define RULE_UDP_TIMEOUT CTX_UDP_TIMEOUT
+#define RULE_UDP_RETRIES CTX_UDP_RETRIES
+#define RULE_UDP_SLIDEWINDOW CTX_UDP_SLIDEWINDOW
+#define RULE_SESSION_TIMEOUT CTX_SESSION_TIMEOUT
+
+// memory budget of the rule, same as CTX_MEMORY_BUDGET. default: 0, unlimited.
+#define RULE_MEMORY_BUDGET CTX_MEMORY_BUDGET
+
+/*
+ * forward rule option.
+ * context and rule options are applied in the runner, and take effect for
+ * timers armed after it.
+ */
+void set_rule_option(forward_rule r, int option, unsigned long value);
+
+
+/**************************************************************************
+ * async api.
+ * same as the calls without _async, but the caller doesn't wait for the
+ * runner. calls run in the order they are made, also with blocking calls.
+ * done is called in the runner thread, it may use the api. NULL for none.
+ **************************************************************************
+ */
+
+/*
+ * result: the new context or rule, NULL if failed.
+ * for free and del, the handle gone, only for matching.
+ */
+typedef void (*forward_done)(void *result, void *arg);
+
+/* create a forward context, the first context still waits for the runner thread to start */
+void create_forward_async(sock_t s, forward_done done, void *arg);
+
+/* destroy the context and it's rules, the runner thread is kept for later contexts */
+void free_forward_async(forward_context c, forward_done done, void *arg);
+
+/* add a forward rule */
+void add_forward_rule_async(forward_context c, forward_mode mode, const char *service,
+    const char *addr, unsigned short port, forward_done done, void *arg);
+
+/* remove a forward rule */
+void del_forward_rule_async(forward_rule r, forward_done done, void *arg);
 
 /* debug current internal variables */
 void debug_dump(FILE *fp);
 
+
+/**************************************************************************
+ * embedded mode.
+ * contexts of an embed run in the caller's libevent loop, without runner
+ * thread and control socket, api calls on them are direct calls. create the
+ * embed and make all calls for its contexts in the thread dispatching the
+ * base. one embed for each base, as many bases as needed.
+ **************************************************************************
+ */
+typedef void *forward_embed;
+
+/* run t2u on base, a struct event_base *. the base is not owned */
+forward_embed create_forward_embed(void *base);
+
+/* create a forward context in the embed, free it with free_forward */
+forward_context create_forward_on(forward_embed e, sock_t s);
+
+/* destroy the embed and it's contexts, before the base is freed */
+void free_forward_embed(forward_embed e);
+
+/**************************************************************************
+ * group mode.
+ * one udp port served by count contexts, each with its own SO_REUSEPORT
+ * socket and runner thread of the pool. the sockets are not connected, they
+ * send to the peer and drop packets from others. client rules listen on one
+ * port in every shard, the kernel spreads tcp connections over the shards.
+ * a udp packet for a session of another shard is handed off to it, see
+ * CTX_STAT_UDP_HANDOFF_PACKETS and forward_group_steer. not on windows.
+ **************************************************************************
+ */
+typedef void *forward_group;
+
+/* count shards on addr:port for peer_addr:peer_port, port 0 for any. NULL if failed */
+forward_group create_forward_group(const char *addr, unsigned short port,
+    const char *peer_addr, unsigned short peer_port, size_t count);
+
+/* shards of the group */
+size_t forward_group_size(forward_group g);
+
+/* context of shard i, for options and stats. don't free it alone */
+forward_context forward_group_context(forward_group g, size_t i);
+
+/*
+ * add the rule to every shard, out[i] for shard i, NULL for none.
+ * listen port 0 is picked once. return the count of shards added to.
+ */
+size_t add_forward_group_rule(forward_group g, forward_mode mode, const char *service,
+    const char *addr, unsigned short port, forward_rule *out);
+
+/*
+ * steer each udp packet to the shard of its session with an ebpf reuseport
+ * program, instead of handing it off. new sessions are spread over the
+ * shards. linux only, needs CAP_BPF or CAP_SYS_ADMIN. 0 for ok, else errno.
+ */
+int forward_group_steer(forward_group g);
+
+/*
+ * move sessions between shards every ms, 0 to stop. default: 0.
+ * each shard measures its tcp bytes/s and loop lag. a shard more than 25%
+ * above the coolest one, or lagging, moves one established session there,
+ * with its socket and queues. connections are kept, a udp packet on the
+ * way may be resent.
+ */
+void forward_group_balance(forward_group g, unsigned long ms);
+
+/* destroy the group, it's contexts, rules and sockets */
+void free_forward_group(forward_group g);
+
+/**************************************************************************
+ * simulation mode.
+ * contexts in a simulator run in the caller's thread with a virtual clock,
+ * without runner thread and udp socket. udp packets are passed in memory,
+ * use CTX_UDP_DEBUG_* options to emulate the link. tcp side of rules still
+ * uses real sockets, their events are processed in run_forward_sim.
+ **************************************************************************
+ */
+typedef void *forward_sim;
+
+/* create a simulator, virtual clock starts at 0 */
+forward_sim create_forward_sim();
+
+/* create two contexts in simulator, linked to each other */
+void create_sim_context_pair(forward_sim sim, forward_context *c1, forward_context *c2);
+
+/* advance virtual clock by ms, running everything due. return virtual time in ms */
+unsigned long long run_forward_sim(forward_sim sim, unsigned long ms);
+
+/* destroy the simulator and it's contexts */
+void free_forward_sim(forward_sim sim);
+
 #ifdef __cplusplus
 };
 #endif
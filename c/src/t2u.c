@@ -1,14 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <event2/event.h>
+#ifdef __GNUC__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
 
 #include "t2u.h"
 #include "t2u_internal.h"
 
 
-/* global runner */
-static t2u_runner* g_runner = NULL;
+/* runner pool, runner 0 for create_forward, runner i for shard i of groups */
+#define T2U_RUNNERS_MAX (64)
+static t2u_runner* g_runners_[T2U_RUNNERS_MAX];
 
 /* global log callback */
 static void(*log_callback_func_)(int, const char *) = NULL;
@@ -24,6 +31,19 @@ log_callback get_log_func_()
     return log_callback_func_;
 }
 
+/* global log level, messages below it are not formatted */
+static int g_log_level_ = 0;
+
+void set_log_level(int level)
+{
+    g_log_level_ = level;
+}
+
+int get_log_level_()
+{
+    return g_log_level_;
+}
+
 
 /* error callback */
 static void (*g_error_callback_func_)(forward_context, forward_rule, int , char *) = NULL;
@@ -45,6 +65,140 @@ unknown_callback get_unknown_func_()
 static t2u_mutex_t __g_runner_mutex_;
 static int __g_runner_mutex_init_ = 0;
 
+/* thread attributes for runners started later */
+static t2u_thr_attr g_runner_attr_ = { 0, 0, "t2u-runner" };
+static int g_runner_spread_ = 0;
+
+static void runner_lock_()
+{
+    if (!__g_runner_mutex_init_)
+    {
+        t2u_mutex_init(&__g_runner_mutex_);
+        __g_runner_mutex_init_ = 1;
+    }
+    t2u_mutex_lock(&__g_runner_mutex_);
+}
+
+/* attributes of runner i of the pool, name with suffix -i */
+static void runner_attr_(size_t index, t2u_thr_attr *attr)
+{
+    *attr = g_runner_attr_;
+
+    if ((index > 0) && attr->name_[0])
+    {
+        char suffix[8];
+        size_t len = strlen(attr->name_);
+
+        snprintf(suffix, sizeof(suffix), "-%u", (unsigned)index);
+        if (len + strlen(suffix) >= sizeof(attr->name_))
+        {
+            len = sizeof(attr->name_) - 1 - strlen(suffix);
+        }
+        snprintf(attr->name_ + len, sizeof(attr->name_) - len, "%s", suffix);
+    }
+
+    if (g_runner_spread_ && attr->cpus_)
+    {
+        /* the (index % cpus)-th cpu of the mask */
+        unsigned long long mask = attr->cpus_;
+        size_t cpus = 0;
+        size_t pick;
+
+        for (; mask; mask &= mask - 1)
+        {
+            cpus++;
+        }
+
+        mask = attr->cpus_;
+        for (pick = index % cpus; pick > 0; pick--)
+        {
+            mask &= mask - 1;
+        }
+        attr->cpus_ = mask & (~mask + 1);
+    }
+}
+
+/* runner i of the pool, started if not yet. with the mutex */
+static t2u_runner *runner_get_(size_t index)
+{
+    if (!g_runners_[index])
+    {
+        t2u_thr_attr attr;
+
+        runner_attr_(index, &attr);
+        g_runners_[index] = t2u_runner_new(&attr);
+        assert(NULL != g_runners_[index]);
+    }
+    return g_runners_[index];
+}
+
+/* stop a runner of the pool without contexts */
+static void runner_release_(t2u_runner *runner)
+{
+    size_t i;
+
+    runner_lock_();
+    for (i = 0; i < T2U_RUNNERS_MAX; i++)
+    {
+        if ((g_runners_[i] == runner) && !t2u_runner_has_context(runner))
+        {
+            /* the runner is already stopped and no events bind. */
+            t2u_delete_runner(runner);
+            g_runners_[i] = NULL;
+        }
+    }
+    t2u_mutex_unlock(&__g_runner_mutex_);
+}
+
+/*
+ * runner thread options, under the runner lock since a pool runner may be
+ * started from another thread meanwhile
+ */
+void set_runner_option(int option, unsigned long long value)
+{
+    runner_lock_();
+    switch (option)
+    {
+        case RUNNER_CPU_MASK:
+            {
+                g_runner_attr_.cpus_ = value;
+            }
+            break;
+        case RUNNER_PRIORITY:
+            {
+                if (value > 99)
+                {
+                    value = 99;
+                }
+                g_runner_attr_.priority_ = (int)value;
+            }
+            break;
+        case RUNNER_CPU_SPREAD:
+            {
+                g_runner_spread_ = (value != 0);
+            }
+            break;
+        default:
+            break;
+    }
+    t2u_mutex_unlock(&__g_runner_mutex_);
+}
+
+void set_runner_name(const char *name)
+{
+    size_t len = name ? strlen(name) : 0;
+
+    if (len >= sizeof(g_runner_attr_.name_))
+    {
+        len = sizeof(g_runner_attr_.name_) - 1;
+    }
+
+    runner_lock_();
+    memcpy(g_runner_attr_.name_, name, len);
+    g_runner_attr_.name_[len] = 0;
+    t2u_mutex_unlock(&__g_runner_mutex_);
+}
+
 /* create a forward context with the udp socket pair 
  * if using this in STUN mode. you need to STUN it by yourself.
  */
@@ -57,25 +211,31 @@ forward_context create_forward(sock_t s)
 		return NULL;
 	}
 
-	if (!__g_runner_mutex_init_)
-	{
-		t2u_mutex_init(&__g_runner_mutex_);
-		__g_runner_mutex_init_ = 1;
-	}
+	runner_lock_();
+
+	/* new a runner and run it, if not yet. */
+	forward_context ret = (forward_context) t2u_add_context(runner_get_(0), s);
+	t2u_mutex_unlock(&__g_runner_mutex_);
 
-	t2u_mutex_lock(&__g_runner_mutex_);
-    if (!g_runner)
+	return ret;
+
+}
+
+
+forward_context create_forward_server(sock_t s)
+{
+    if (sizeof(t2u_message_data) != 20)
     {
-		/* new a runner and run it. */
-		g_runner = t2u_runner_new();
-		assert(NULL != g_runner);				
+        LOG_(4, "Compiler Error: sizeof(t2u_message_data) != 20");
+        return NULL;
     }
 
-	forward_context ret = (forward_context) t2u_add_context(g_runner, s);
-	t2u_mutex_unlock(&__g_runner_mutex_);
+    runner_lock_();
 
-	return ret;
+    forward_context ret = (forward_context) t2u_add_server_context(runner_get_(0), s);
+    t2u_mutex_unlock(&__g_runner_mutex_);
 
+    return ret;
 }
 
 
@@ -86,88 +246,225 @@ forward_context create_forward(sock_t s)
 void free_forward(forward_context c)
 {
     t2u_context *context = (t2u_context *)c;
+    t2u_runner *runner = context->runner_;
 
     t2u_delete_context(context);
 
     /* check runner */
-    if (g_runner && ((!g_runner->contexts_) || (!g_runner->contexts_->root)))
-    {
-		t2u_mutex_lock(&__g_runner_mutex_);
-        /* the runner is already stopped and no events bind. */
-		t2u_delete_runner(g_runner);
-		g_runner = NULL;
-		t2u_mutex_unlock(&__g_runner_mutex_);
-    }
+    runner_release_(runner);
     return;
 }
 
 
-/*
- * forward context option
- */
-void set_context_option(forward_context c, int option, unsigned long value)
+/* option change, applied in runner so nothing changes under its reads */
+typedef struct option_data_
 {
-    t2u_context *context = (t2u_context *)c;
+    t2u_context *context_;
+    t2u_rule *rule_;                /* NULL for a context option */
+    int option_;
+    unsigned long value_;
+} option_data;
+
+/* valid range of the options shared by context and rule */
+static unsigned long option_clamp_(int option, unsigned long value)
+{
+    unsigned long min = 0;
+    unsigned long max = (unsigned long)-1;
 
     switch (option)
+    {
+        case CTX_UDP_TIMEOUT:
+            min = 10;
+            max = 30000;
+            break;
+        case CTX_UDP_RETRIES:
+            min = 1;
+            max = 20;
+            break;
+        case CTX_UDP_SLIDEWINDOW:
+            min = 1;
+            max = 64;
+            break;
+        case CTX_SESSION_TIMEOUT:
+            min = 10;
+            max = 86400;
+            break;
+        default:
+            break;
+    }
+
+    if (value < min)
+    {
+        value = min;
+    }
+    else if (value > max)
+    {
+        value = max;
+    }
+    return value;
+}
+
+static void set_context_option_cb_(t2u_runner *runner, void *arg)
+{
+    option_data *od = (option_data *)arg;
+    t2u_context *context = od->context_;
+    unsigned long value = od->value_;
+    t2u_rule *rule;
+
+    (void) runner;
+
+    switch (od->option_)
     {
         case CTX_UDP_TIMEOUT:
             {
-                if (value < 10)
-                {
-                    value = 10;
-                }
-                else if (value > 30000)
+                context->utimeout_ = option_clamp_(od->option_, value);
+            }
+            break;
+        case CTX_UDP_RETRIES:
+            {
+                context->uretries_ = option_clamp_(od->option_, value);
+            }
+            break;
+        case CTX_UDP_SLIDEWINDOW:
+            {
+                context->udp_slide_window_ = option_clamp_(od->option_, value);
+            }
+            break; 
+        case CTX_SESSION_TIMEOUT:
+            {
+                context->session_timeout_ = option_clamp_(od->option_, value);
+                for (rule = t2u_rule_tree_first(&context->rules_); rule; rule = t2u_rule_tree_next(rule))
                 {
-                    value = 30000;
+                    t2u_session_idle_rearm(rule);
                 }
-                context->utimeout_ = value;
             }
             break;
-        case CTX_UDP_RETRIES:
+        case CTX_MEMORY_BUDGET:
             {
-                if (value < 1)
+                context->mem_budget_ = value;
+                t2u_budget_changed(context);
+            }
+            break;
+        case CTX_UDP_DEBUG_DELAY:
+            {
+                if (value > 60000)
                 {
-                    value = 1;
+                    value = 60000;
                 }
-                else if (value > 20)
+                context->debug_latency_ = (int)value;
+            }
+            break;
+        case CTX_UDP_DEBUG_PACKET_LOSS:
+            {
+                if (value > 10000)
                 {
-                    value = 20;
+                    value = 10000;
                 }
-                context->uretries_ = value;
+                context->debug_packet_loss_ = (int)value;
             }
             break;
-        case CTX_UDP_SLIDEWINDOW:
-        {
-            if (value < 1)
+        case CTX_UDP_DEBUG_BANDWIDTH:
             {
-                value = 1;
+                context->debug_bandwidth_ = value;
             }
-            else if (value > 64)
+            break;
+        case CTX_UDP_DEBUG_SEED:
             {
-                value = 64;
+                t2u_debug_seed(context, value);
             }
-            context->udp_slide_window_ = value;
-        }
-            break; 
-        case CTX_SESSION_TIMEOUT:
+            break;
+        case CTX_UDP_DEBUG_LOSS_BURST:
             {
-                if (value < 10)
+                if (value > 1000)
                 {
-                    value = 10;
+                    value = 1000;
                 }
-                else if (value > 86400)
+                context->debug_loss_burst_ = (int)value;
+            }
+            break;
+        case CTX_UDP_DEBUG_REORDER:
+            {
+                if (value > 10000)
                 {
-                    value = 86400;
+                    value = 10000;
                 }
-                context->session_timeout_ = value;
+                context->debug_reorder_ = (int)value;
             }
-                break;
+            break;
+        case CTX_UDP_DEBUG_REORDER_DELAY:
+            {
+                if (value > 60000)
+                {
+                    value = 60000;
+                }
+                context->debug_reorder_delay_ = (int)value;
+            }
+            break;
         default:
             break;
     }
 }
 
+/*
+ * forward context option
+ */
+void set_context_option(forward_context c, int option, unsigned long value)
+{
+    t2u_context *context = (t2u_context *)c;
+    option_data od;
+    control_data cdata;
+
+    od.context_ = context;
+    od.rule_ = NULL;
+    od.option_ = option;
+    od.value_ = value;
+
+    cdata.func_ = set_context_option_cb_;
+    cdata.arg_ = &od;
+    t2u_runner_control(context->runner_, &cdata);
+}
+
+
+typedef struct context_stat_
+{
+    t2u_context *context_;
+    int stat_;
+    unsigned long long value_;
+} context_stat;
+
+static void get_context_stat_cb_(t2u_runner *runner, void *arg)
+{
+    context_stat *cs = (context_stat *)arg;
+
+    (void) runner;
+    cs->value_ = cs->context_->stat_[cs->stat_];
+}
+
+/*
+ * forward context statistics
+ */
+unsigned long long get_context_stat(forward_context c, int stat)
+{
+    t2u_context *context = (t2u_context *)c;
+    context_stat cs;
+    control_data cdata;
+
+    if (stat <= 0 || stat >= CTX_STAT_MAX)
+    {
+        return 0;
+    }
+
+    cs.context_ = context;
+    cs.stat_ = stat;
+    cs.value_ = 0;
+
+    cdata.func_ = get_context_stat_cb_;
+    cdata.arg_ = &cs;
+    t2u_runner_control(context->runner_, &cdata);
+
+    return cs.value_;
+}
+
 
 /*
  * This function is useful for send data with the socket.
@@ -223,20 +520,284 @@ void del_forward_rule (forward_rule r)
     t2u_delete_rule(rule);
 }
 
+/* add rules in one round trip to the runner */
+size_t add_forward_rules(forward_context c, const rule_spec *specs, size_t n, forward_rule *out)
+{
+    t2u_context *context = (t2u_context *) c;
+
+    return t2u_add_rules(context, specs, n, (t2u_rule **)out);
+}
+
+/* remove rules in one round trip to the runner */
+void del_forward_rules(forward_rule *rules, size_t n)
+{
+    t2u_delete_rules((t2u_rule **)rules, n);
+}
+
+static void set_rule_option_cb_(t2u_runner *runner, void *arg)
+{
+    option_data *od = (option_data *)arg;
+    t2u_rule *rule = od->rule_;
+    /* 0 goes back to the context's value */
+    unsigned long value = od->value_ ? option_clamp_(od->option_, od->value_) : 0;
+
+    (void) runner;
+
+    switch (od->option_)
+    {
+        case RULE_UDP_TIMEOUT:
+            {
+                rule->utimeout_ = value;
+            }
+            break;
+        case RULE_UDP_RETRIES:
+            {
+                rule->uretries_ = value;
+            }
+            break;
+        case RULE_UDP_SLIDEWINDOW:
+            {
+                rule->udp_slide_window_ = value;
+            }
+            break;
+        case RULE_SESSION_TIMEOUT:
+            {
+                rule->session_timeout_ = value;
+                t2u_session_idle_rearm(rule);
+            }
+            break;
+        case RULE_MEMORY_BUDGET:
+            {
+                rule->mem_budget_ = value;
+                t2u_budget_changed(rule->context_);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * forward rule option
+ */
+void set_rule_option(forward_rule r, int option, unsigned long value)
+{
+    t2u_rule *rule = (t2u_rule *) r;
+    option_data od;
+    control_data cdata;
+
+    od.context_ = rule->context_;
+    od.rule_ = rule;
+    od.option_ = option;
+    od.value_ = value;
+
+    cdata.func_ = set_rule_option_cb_;
+    cdata.arg_ = &od;
+    t2u_runner_control(rule->context_->runner_, &cdata);
+}
+
+void create_forward_async(sock_t s, forward_done done, void *arg)
+{
+    runner_lock_();
+    t2u_add_context_async(runner_get_(0), s, done, arg);
+    t2u_mutex_unlock(&__g_runner_mutex_);
+}
+
+void free_forward_async(forward_context c, forward_done done, void *arg)
+{
+    t2u_delete_context_async((t2u_context *)c, done, arg);
+}
+
+void add_forward_rule_async(forward_context c, forward_mode mode, const char *service,
+    const char *addr, unsigned short port, forward_done done, void *arg)
+{
+    rule_spec spec;
+
+    spec.mode = mode;
+    spec.service = service;
+    spec.addr = addr;
+    spec.port = port;
+    t2u_add_rule_async((t2u_context *)c, &spec, done, arg);
+}
+
+void del_forward_rule_async(forward_rule r, forward_done done, void *arg)
+{
+    t2u_delete_rule_async((t2u_rule *)r, done, arg);
+}
+
+forward_embed create_forward_embed(void *base)
+{
+    t2u_runner *runner = t2u_runner_new_local((struct event_base *)base);
+
+    /* log callback off the caller's loop as well */
+    t2u_log_start();
+    return (forward_embed)runner;
+}
+
+forward_context create_forward_on(forward_embed e, sock_t s)
+{
+    t2u_runner *runner = (t2u_runner *)e;
+
+    if (sizeof(t2u_message_data) != 20)
+    {
+        LOG_(4, "Compiler Error: sizeof(t2u_message_data) != 20");
+        return NULL;
+    }
+
+    return (forward_context) t2u_add_context(runner, s);
+}
+
+void free_forward_embed(forward_embed e)
+{
+    t2u_delete_runner((t2u_runner *)e);
+    t2u_log_stop();
+}
+
+forward_group create_forward_group(const char *addr, unsigned short port,
+    const char *peer_addr, unsigned short peer_port, size_t count)
+{
+    t2u_runner *runners[T2U_RUNNERS_MAX];
+    struct sockaddr_in local;
+    struct sockaddr_in peer;
+    t2u_group *group;
+    size_t i;
+
+    if ((count == 0) || (count > T2U_RUNNERS_MAX) || !peer_addr)
+    {
+        return NULL;
+    }
+
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = addr ? inet_addr(addr) : htonl(INADDR_ANY);
+    local.sin_port = htons(port);
+
+    memset(&peer, 0, sizeof(peer));
+    peer.sin_family = AF_INET;
+    peer.sin_addr.s_addr = inet_addr(peer_addr);
+    peer.sin_port = htons(peer_port);
+
+    runner_lock_();
+    for (i = 0; i < count; i++)
+    {
+        runners[i] = runner_get_(i);
+    }
+    group = t2u_group_new(runners, count, &local, &peer);
+    t2u_mutex_unlock(&__g_runner_mutex_);
+
+    if (!group)
+    {
+        for (i = 0; i < count; i++)
+        {
+            runner_release_(runners[i]);
+        }
+    }
+    return (forward_group)group;
+}
+
+size_t forward_group_size(forward_group g)
+{
+    return ((t2u_group *)g)->count_;
+}
+
+forward_context forward_group_context(forward_group g, size_t i)
+{
+    t2u_group *group = (t2u_group *)g;
+
+    return (i < group->count_) ? (forward_context)group->contexts_[i] : NULL;
+}
+
+size_t add_forward_group_rule(forward_group g, forward_mode mode, const char *service,
+    const char *addr, unsigned short port, forward_rule *out)
+{
+    t2u_group *group = (t2u_group *)g;
+    rule_spec spec;
+    size_t added = 0;
+    size_t i;
+
+    spec.mode = mode;
+    spec.service = service;
+    spec.addr = addr;
+    spec.port = port;
+
+    for (i = 0; i < group->count_; i++)
+    {
+        t2u_rule *rule = NULL;
+
+        t2u_add_rules(group->contexts_[i], &spec, 1, &rule);
+        if (out)
+        {
+            out[i] = (forward_rule)rule;
+        }
+
+        if (!rule)
+        {
+            continue;
+        }
+        added++;
+
+        /* listen port 0 is picked by the first shard, the others join it */
+        if ((forward_client_mode == mode) && (0 == spec.port))
+        {
+            struct sockaddr_in listen_addr;
+            socklen_t len = sizeof(listen_addr);
+
+            getsockname(rule->listen_sock_, (struct sockaddr *)&listen_addr, &len);
+            spec.port = ntohs(listen_addr.sin_port);
+        }
+    }
+    return added;
+}
+
+int forward_group_steer(forward_group g)
+{
+    return t2u_steer_attach((t2u_group *)g);
+}
+
+void forward_group_balance(forward_group g, unsigned long ms)
+{
+    t2u_group_balance((t2u_group *)g, ms);
+}
+
+void free_forward_group(forward_group g)
+{
+    t2u_group *group = (t2u_group *)g;
+    t2u_runner *runners[T2U_RUNNERS_MAX];
+    size_t count = group->count_;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        runners[i] = group->contexts_[i]->runner_;
+    }
+
+    t2u_group_free(group);
+
+    for (i = 0; i < count; i++)
+    {
+        runner_release_(runners[i]);
+    }
+}
+
 static void debug_dump_cb_(t2u_runner *runner, void *arg)
 {
     FILE *fp = (FILE *)arg;
-    fprintf(fp, "runner: %p\n", runner);
+    t2u_runner_dump(runner, fp);
 }
 
 void debug_dump(FILE *fp)
 {
-    if (g_runner)
+    size_t i;
+
+    for (i = 0; i < T2U_RUNNERS_MAX; i++)
     {
-        control_data cdata;
-        cdata.func_ = debug_dump_cb_;
-        cdata.arg_ = fp;
+        if (g_runners_[i])
+        {
+            control_data cdata;
+            cdata.func_ = debug_dump_cb_;
+            cdata.arg_ = fp;
 
-        t2u_runner_control(g_runner, &cdata);
+            t2u_runner_control(g_runners_[i], &cdata);
+        }
     }
 }
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <event2/event.h>
+
+#include "t2u.h"
+#include "t2u_internal.h"
+
+/* budget is tight above 3/4 of it */
+static unsigned long long budget_low_(unsigned long long budget)
+{
+    return budget / 4 * 3;
+}
+
+static int budget_over_low_(unsigned long long budget, unsigned long long used)
+{
+    return budget && (used > budget_low_(budget));
+}
+
+/* one buffer is always allowed, a tiny budget must not stall the session */
+static int budget_no_room_(unsigned long long budget, unsigned long long used, size_t size)
+{
+    return budget && used && (used + size > budget);
+}
+
+/* the links are in the window, it is not parked while blocked */
+static void budget_unlink_(t2u_rule *rule, t2u_session *session)
+{
+    t2u_session_window *window = session->window_;
+
+    if (window->mem_prev_)
+    {
+        window->mem_prev_->window_->mem_next_ = window->mem_next_;
+    }
+    else
+    {
+        rule->mem_blocked_ = window->mem_next_;
+    }
+
+    if (window->mem_next_)
+    {
+        window->mem_next_->window_->mem_prev_ = window->mem_prev_;
+    }
+
+    window->mem_prev_ = NULL;
+    window->mem_next_ = NULL;
+}
+
+/* wake up the sessions and accepts of rules with room again */
+static void budget_resume_(t2u_context *context)
+{
+    t2u_rule *rule;
+
+    if (budget_over_low_(context->mem_budget_, context->stat_[CTX_STAT_MEMORY_USED]))
+    {
+        return;
+    }
+
+    for (rule = t2u_rule_tree_first(&context->rules_); rule; rule = t2u_rule_tree_next(rule))
+    {
+        if (budget_over_low_(rule->mem_budget_, rule->mem_used_))
+        {
+            continue;
+        }
+
+        while (rule->mem_blocked_)
+        {
+            t2u_session *session = rule->mem_blocked_;
+
+            budget_unlink_(rule, session);
+            t2u_session_park(session);
+            t2u_session_resume_read(session);
+        }
+
+        if (rule->accept_paused_ && rule->ev_listen_)
+        {
+            rule->accept_paused_ = 0;
+            event_add(rule->ev_listen_->event_, NULL);
+            LOG_(1, "resume accept for rule: %p", rule);
+        }
+    }
+}
+
+t2u_packet *t2u_budget_packet_alloc(t2u_session *session, size_t len)
+{
+    t2u_rule *rule = session->rule_;
+    t2u_context *context = rule->context_;
+    t2u_slab *slab = &context->runner_->packet_slab_;
+    t2u_packet *packet = t2u_packet_new(context->runner_, len);
+
+    rule->mem_used_ += slab->size_;
+    context->stat_[CTX_STAT_MEMORY_USED] += slab->size_;
+    return packet;
+}
+
+void t2u_budget_packet_free(t2u_session *session, t2u_packet *packet)
+{
+    t2u_rule *rule = session->rule_;
+    t2u_context *context = rule->context_;
+    t2u_slab *slab = &context->runner_->packet_slab_;
+    int rule_low = !budget_over_low_(rule->mem_budget_, rule->mem_used_);
+    int context_low = !budget_over_low_(context->mem_budget_, context->stat_[CTX_STAT_MEMORY_USED]);
+
+    t2u_packet_unref(packet);
+    assert(rule->mem_used_ >= slab->size_);
+    rule->mem_used_ -= slab->size_;
+    context->stat_[CTX_STAT_MEMORY_USED] -= slab->size_;
+
+    /* only when crossing the low mark, so the check is cheap */
+    if ((!rule_low && !budget_over_low_(rule->mem_budget_, rule->mem_used_)) ||
+        (!context_low && !budget_over_low_(context->mem_budget_, context->stat_[CTX_STAT_MEMORY_USED])))
+    {
+        budget_resume_(context);
+    }
+}
+
+int t2u_budget_full(t2u_session *session)
+{
+    t2u_rule *rule = session->rule_;
+    t2u_context *context = rule->context_;
+    size_t size = context->runner_->packet_slab_.size_;
+
+    return budget_no_room_(rule->mem_budget_, rule->mem_used_, size) ||
+        budget_no_room_(context->mem_budget_, context->stat_[CTX_STAT_MEMORY_USED], size);
+}
+
+void t2u_budget_block(t2u_session *session)
+{
+    t2u_rule *rule = session->rule_;
+    t2u_event *ev = session->ev_;
+
+    if (ev && ev->event_)
+    {
+        t2u_event_free(ev->runner_, ev->event_);
+        ev->event_ = NULL;
+    }
+
+    if (!t2u_budget_blocked(session))
+    {
+        t2u_session_window *window = t2u_session_window_get(session);
+
+        LOG_(1, "memory budget full, pause read for session: %p", session);
+
+        window->mem_prev_ = NULL;
+        window->mem_next_ = rule->mem_blocked_;
+        if (rule->mem_blocked_)
+        {
+            rule->mem_blocked_->window_->mem_prev_ = session;
+        }
+        rule->mem_blocked_ = session;
+    }
+}
+
+int t2u_budget_blocked(t2u_session *session)
+{
+    return (session->window_ && session->window_->mem_prev_) || (session->rule_->mem_blocked_ == session);
+}
+
+void t2u_budget_unblock(t2u_session *session)
+{
+    if (t2u_budget_blocked(session))
+    {
+        budget_unlink_(session->rule_, session);
+    }
+}
+
+void t2u_budget_changed(t2u_context *context)
+{
+    budget_resume_(context);
+}
+
+int t2u_budget_accept(t2u_rule *rule)
+{
+    t2u_context *context = rule->context_;
+
+    if (!budget_over_low_(rule->mem_budget_, rule->mem_used_) &&
+        !budget_over_low_(context->mem_budget_, context->stat_[CTX_STAT_MEMORY_USED]))
+    {
+        return 1;
+    }
+
+    if (!rule->accept_paused_)
+    {
+        LOG_(1, "memory budget tight, pause accept for rule: %p", rule);
+        rule->accept_paused_ = 1;
+        event_del(rule->ev_listen_->event_);
+    }
+    return 0;
+}
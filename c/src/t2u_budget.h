@@ -0,0 +1,36 @@
+#ifndef __t2u_budget_h__
+#define __t2u_budget_h__
+
+/*
+ * memory budget of message packets, per rule and per context. a packet is
+ * charged while the session holds it, the delay queue may keep it longer.
+ * a full budget pauses tcp reads of the session and stops buffering out of
+ * order messages, above 3/4 of it new accepts are paused. all resume when
+ * usage is back under 3/4. in runner.
+ */
+
+/* new packet of len charged to the session's rule and context, one ref */
+t2u_packet *t2u_budget_packet_alloc(t2u_session *session, size_t len);
+
+/* drop the session's ref of the packet, may resume paused reads and accepts */
+void t2u_budget_packet_free(t2u_session *session, t2u_packet *packet);
+
+/* no room for one more packet in the session's rule or context */
+int t2u_budget_full(t2u_session *session);
+
+/* stop reading tcp of the session until memory is released */
+void t2u_budget_block(t2u_session *session);
+
+/* is the session waiting for memory */
+int t2u_budget_blocked(t2u_session *session);
+
+/* forget the session if it is waiting for memory, before delete */
+void t2u_budget_unblock(t2u_session *session);
+
+/* a budget of the context or its rules changed, resume what has room now */
+void t2u_budget_changed(t2u_context *context);
+
+/* accept new connections for rule? pause the listen event if not */
+int t2u_budget_accept(t2u_rule *rule);
+
+#endif /* __t2u_budget_h__ */
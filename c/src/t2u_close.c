@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <event2/event.h>
+#include <event2/util.h>
+#ifdef __GNUC__
+#include <netinet/in.h>
+#endif
+
+#include "t2u.h"
+#include "t2u_internal.h"
+
+static void close_request_(t2u_context *context, t2u_close *closing)
+{
+    t2u_message_data md;
+
+    md.magic_ = htonl(T2U_MESS_MAGIC);
+    md.version_ = htons(1);
+    md.oper_ = htons(close_request);
+    md.handle_ = hton64(closing->handle_);
+    md.seq_ = htonl(0);
+
+    t2u_send_message_to(context, closing->peer_ ? &closing->peer_->addr_ : NULL, (char *)&md, sizeof(md));
+}
+
+static void close_free_(t2u_context *context, t2u_close *closing)
+{
+    t2u_delete_event(closing->ev_);
+    t2u_close_tree_remove(&context->closes_, closing);
+    t2u_group_disown(context, closing->handle_);
+    t2u_peer_put(context, closing->peer_);
+    free(closing);
+}
+
+static void close_timeout_cb_(evutil_socket_t sock, short events, void *arg)
+{
+    t2u_close *closing = (t2u_close *)arg;
+    t2u_context *context = closing->ev_->context_;
+
+    (void) sock;
+    (void) events;
+
+    if (closing->retries_ == 0)
+    {
+        LOG_(2, "closing of handle: %llu not answered", (unsigned long long)closing->handle_);
+        close_free_(context, closing);
+        return;
+    }
+
+    closing->retries_--;
+    context->stat_[CTX_STAT_UDP_RETRANS_PACKETS]++;
+    close_request_(context, closing);
+    t2u_timer_add(context->runner_, closing->ev_->event_, &closing->timeout_);
+}
+
+void t2u_close_send(t2u_session *session)
+{
+    t2u_rule *rule = session->rule_;
+    t2u_context *context = rule->context_;
+    t2u_runner *runner = context->runner_;
+    t2u_close *closing = t2u_close_tree_find(&context->closes_, session->handle_);
+
+    if (closing)
+    {
+        return;
+    }
+
+    closing = (t2u_close *) malloc(sizeof(t2u_close));
+    assert(NULL != closing);
+    memset(closing, 0, sizeof(t2u_close));
+
+    closing->handle_ = session->handle_;
+    closing->peer_ = t2u_peer_ref(session->peer_);
+    closing->retries_ = t2u_rule_uretries(rule);
+    closing->timeout_ = *t2u_rule_utimeout(rule);
+
+    closing->ev_ = t2u_event_new(runner);
+    closing->ev_->context_ = context;
+    closing->ev_->event_ = evtimer_new(runner->base_, close_timeout_cb_, closing);
+    assert(NULL != closing->ev_->event_);
+
+    t2u_close_tree_insert(&context->closes_, closing);
+
+    close_request_(context, closing);
+    t2u_timer_add(runner, closing->ev_->event_, &closing->timeout_);
+}
+
+void t2u_close_respond(t2u_context *context, const struct sockaddr_in *to, uint64_t handle)
+{
+    t2u_message_data md;
+
+    md.magic_ = htonl(T2U_MESS_MAGIC);
+    md.version_ = htons(1);
+    md.oper_ = htons(close_response);
+    md.handle_ = hton64(handle);
+    md.seq_ = htonl(0);
+
+    t2u_send_message_to(context, to, (char *)&md, sizeof(md));
+}
+
+int t2u_close_handle_response(t2u_context *context, uint64_t handle)
+{
+    t2u_close *closing = t2u_close_tree_find(&context->closes_, handle);
+
+    if (!closing)
+    {
+        return 0;
+    }
+
+    LOG_(1, "closing of handle: %llu answered", (unsigned long long)handle);
+    close_free_(context, closing);
+    return 1;
+}
+
+void t2u_close_cleanup(t2u_context *context)
+{
+    while (!t2u_rb_empty(&context->closes_))
+    {
+        close_free_(context, t2u_close_tree_first(&context->closes_));
+    }
+}
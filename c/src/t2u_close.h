@@ -0,0 +1,22 @@
+#ifndef __t2u_close_h__
+#define __t2u_close_h__
+
+/*
+ * close handshake. a session deleted on this side sends close_request until
+ * the peer answers close_response, or the rule's retries are used. the
+ * handle stays owned by the context meanwhile. in runner.
+ */
+
+/* send close of the session being deleted, resent until answered */
+void t2u_close_send(t2u_session *session);
+
+/* answer a close request for handle, to NULL for the context's peer */
+void t2u_close_respond(t2u_context *context, const struct sockaddr_in *to, uint64_t handle);
+
+/* close of handle is answered, 0 if not waiting for it */
+int t2u_close_handle_response(t2u_context *context, uint64_t handle);
+
+/* drop closes still waiting, before the context is freed */
+void t2u_close_cleanup(t2u_context *context);
+
+#endif /* __t2u_close_h__ */
@@ -1,29 +1,152 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <event2/event.h>
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
 
 #include "t2u.h"
 #include "t2u_internal.h"
 
 #define MAX_CONTROL_BUFF_LEN (1600)
 
-static int compare_name(void *a, void *b)
+#ifdef __linux__
+
+/* datagrams of one recvmmsg or sendmmsg */
+#define T2U_MMSG_MAX (32)
+
+typedef struct t2u_mmsg_batch_
+{
+    unsigned int count_;
+    struct mmsghdr hdr_[T2U_MMSG_MAX];
+    struct iovec iov_[T2U_MMSG_MAX];
+    struct sockaddr_in addr_[T2U_MMSG_MAX];
+    char data_[T2U_MMSG_MAX][T2U_MESS_BUFFER_MAX];
+} t2u_mmsg_batch;
+
+/*
+ * batches of a multi peer context. replies made while a received batch is
+ * processed go out with one sendmmsg after it.
+ */
+struct t2u_mmsg_
+{
+    int sending_;                   /* 1 while rx_ is processed, sends are kept in tx_ */
+    t2u_mmsg_batch rx_;
+    t2u_mmsg_batch tx_;
+};
+
+static void mmsg_flush_(t2u_context *context)
+{
+    t2u_mmsg_batch *tx = &context->mmsg_->tx_;
+    unsigned int sent = 0;
+    int r;
+
+    while (sent < tx->count_)
+    {
+        r = sendmmsg(context->sock_, tx->hdr_ + sent, tx->count_ - sent, 0);
+        if (r <= 0)
+        {
+            /* the rest is lost as a datagram may be, the messages resend */
+            LOG_(2, "sendmmsg failed, context: %p, lost: %u", context, tx->count_ - sent);
+            break;
+        }
+        sent += (unsigned int)r;
+    }
+    tx->count_ = 0;
+}
+
+/* keep a send for the flush, 0 if not in a batch */
+static int mmsg_queue_(t2u_context *context, const struct sockaddr_in *to, const char *data, size_t size)
 {
-    return strcmp((char *)a, (char *)b);
+    t2u_mmsg_batch *tx;
+    unsigned int i;
+
+    if (!context->mmsg_ || !context->mmsg_->sending_ || (size > T2U_MESS_BUFFER_MAX))
+    {
+        return 0;
+    }
+
+    tx = &context->mmsg_->tx_;
+    if (tx->count_ == T2U_MMSG_MAX)
+    {
+        mmsg_flush_(context);
+    }
+
+    i = tx->count_++;
+    memcpy(tx->data_[i], data, size);
+    tx->addr_[i] = *to;
+    tx->iov_[i].iov_base = tx->data_[i];
+    tx->iov_[i].iov_len = size;
+    memset(&tx->hdr_[i], 0, sizeof(tx->hdr_[i]));
+    tx->hdr_[i].msg_hdr.msg_name = &tx->addr_[i];
+    tx->hdr_[i].msg_hdr.msg_namelen = sizeof(tx->addr_[i]);
+    tx->hdr_[i].msg_hdr.msg_iov = &tx->iov_[i];
+    tx->hdr_[i].msg_hdr.msg_iovlen = 1;
+    return 1;
+}
+
+static void mmsg_recv_(t2u_context *context)
+{
+    t2u_mmsg_batch *rx = &context->mmsg_->rx_;
+    unsigned int i;
+    int r;
+
+    for (i = 0; i < T2U_MMSG_MAX; i++)
+    {
+        rx->iov_[i].iov_base = rx->data_[i];
+        rx->iov_[i].iov_len = T2U_MESS_BUFFER_MAX;
+        memset(&rx->hdr_[i], 0, sizeof(rx->hdr_[i]));
+        rx->hdr_[i].msg_hdr.msg_name = &rx->addr_[i];
+        rx->hdr_[i].msg_hdr.msg_namelen = sizeof(rx->addr_[i]);
+        rx->hdr_[i].msg_hdr.msg_iov = &rx->iov_[i];
+        rx->hdr_[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    r = recvmmsg(context->sock_, rx->hdr_, T2U_MMSG_MAX, MSG_DONTWAIT, NULL);
+    if (r <= 0)
+    {
+        LOG_(3, "recv from udp socket failed, context: %p", context);
+        return;
+    }
+
+    context->mmsg_->sending_ = 1;
+    for (i = 0; i < (unsigned int)r; i++)
+    {
+        t2u_context_process_udp(context, &rx->addr_[i], rx->data_[i], (int)rx->hdr_[i].msg_len);
+    }
+    context->mmsg_->sending_ = 0;
+
+    mmsg_flush_(context);
 }
 
+#endif
+
 static void process_udp_cb_(evutil_socket_t sock, short events, void *arg)
 {
     int recv_bytes;
-    char *buff = (char *) malloc(T2U_MESS_BUFFER_MAX);
-    t2u_message_data *mdata;
+    char *buff;
     t2u_event *ev = (t2u_event *)arg;
-    t2u_runner *runner = ev->runner_;
     t2u_context *context = ev->context_;
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+
+    (void) events;
+
+#ifdef __linux__
+    if (context->mmsg_)
+    {
+        mmsg_recv_(context);
+        return;
+    }
+#endif
 
-    recv_bytes = recv(sock, buff, T2U_MESS_BUFFER_MAX, 0);
+    buff = (char *) malloc(T2U_MESS_BUFFER_MAX);
+    recv_bytes = recvfrom(sock, buff, T2U_MESS_BUFFER_MAX, 0, (struct sockaddr *)&from, &from_len);
     if (recv_bytes <= 0)
     {
         /* error on context's udp socket */
@@ -32,6 +155,25 @@ static void process_udp_cb_(evutil_socket_t sock, short events, void *arg)
         return;
     }
 
+    /* an unconnected socket only takes the peer */
+    if (context->peer_.sin_family &&
+        ((from.sin_addr.s_addr != context->peer_.sin_addr.s_addr) || (from.sin_port != context->peer_.sin_port)))
+    {
+        LOG_(2, "drop udp packet not from peer, context: %p", context);
+        free(buff);
+        return;
+    }
+
+    t2u_context_process_udp(context, &from, buff, recv_bytes);
+    free(buff);
+}
+
+void t2u_context_process_udp(t2u_context *context, const struct sockaddr_in *from, char *buff, int recv_bytes)
+{
+    t2u_message_data *mdata;
+
+    context->stat_[CTX_STAT_UDP_RECV_PACKETS]++;
+
     mdata = (t2u_message_data *)(void *)buff;
     mdata->magic_ = ntohl(mdata->magic_);
     mdata->version_ = ntohs(mdata->version_);
@@ -50,64 +192,189 @@ static void process_udp_cb_(evutil_socket_t sock, short events, void *arg)
         {
             uc(context, buff, recv_bytes);
         }
-        free(buff);
         return;
     }
 
+    t2u_context_dispatch_udp(context, from, mdata, recv_bytes);
+}
+
+/* no session for key here, it may be of another shard of the group */
+static void context_miss_(t2u_context *context, uint64_t key, t2u_message_data *mdata, int len)
+{
+    if (!t2u_group_handoff(context, key, mdata, len))
+    {
+        LOG_(2, "no session match the handle: %llu -> %llu",
+            (unsigned long long)mdata->handle_, (unsigned long long)key);
+    }
+}
+
+/*
+ * is the message one the session expects from its peer: new data in the
+ * receive window, or an answer for a sent message. handles and seqs can be
+ * guessed, so it only earns a rebind request to the sender, the peer id in
+ * the answer moves the peer. data already delivered is not even that.
+ */
+static int context_valid_(t2u_session *session, t2u_message_data *mdata)
+{
+    int32_t ahead = (int32_t)(mdata->seq_ - session->recv_seq_);
+    int32_t window = (int32_t)t2u_rule_slide_window(session->rule_);
+
+    switch (mdata->oper_)
+    {
+    case data_request:
+        return (ahead >= 1) && (ahead <= window);
+    case data_response:
+    case retrans_request:
+        return session->window_ && t2u_message_tree_find(&session->window_->send_mess_, mdata->seq_);
+    default:
+        return 0;
+    }
+}
+
+/* sessions of the peer resend their backlog to its new address */
+static void context_rebind_(t2u_context *context, t2u_peer *peer)
+{
+    t2u_rule *rule;
+    t2u_session *session;
+    t2u_message *message;
+
+    for (rule = t2u_rule_tree_first(&context->rules_); rule; rule = t2u_rule_tree_next(rule))
+    {
+        for (session = t2u_session_tree_first(&rule->sessions_); session; session = t2u_session_tree_next(session))
+        {
+            if ((session->peer_ != peer) || !session->window_)
+            {
+                continue;
+            }
+
+            for (message = t2u_message_tree_first(&session->window_->send_mess_); message;
+                message = t2u_message_tree_next(message))
+            {
+                t2u_message_resend(message);
+            }
+        }
+    }
+}
+
+/* the peer id after the service name of a connect request, 0 if none */
+static uint64_t context_peer_id_(t2u_message_data *mdata, int recv_bytes)
+{
+    size_t len = recv_bytes - sizeof(t2u_message_data);
+    char *end = (char *)memchr(mdata->payload, 0, len);
+    uint64_t id;
+
+    if (!end || ((size_t)(end + 1 - mdata->payload) + sizeof(id) > len))
+    {
+        return 0;
+    }
+    memcpy(&id, end + 1, sizeof(id));
+    return ntoh64(id);
+}
+
+/* a rebind message of handle, the peer id as payload if not 0 */
+static void context_rebind_send_(t2u_context *context, const struct sockaddr_in *to,
+    uint16_t oper, uint64_t handle, uint64_t id)
+{
+    char buff[sizeof(t2u_message_data) + sizeof(uint64_t)];
+    t2u_message_data *md = (t2u_message_data *)buff;
+    size_t size = sizeof(t2u_message_data);
+
+    md->magic_ = htonl(T2U_MESS_MAGIC);
+    md->version_ = htons(1);
+    md->oper_ = htons(oper);
+    md->handle_ = hton64(handle);
+    md->seq_ = htonl(0);
+    if (id)
+    {
+        id = hton64(id);
+        memcpy(md->payload, &id, sizeof(id));
+        size += sizeof(id);
+    }
+
+    t2u_send_message_to(context, to, buff, size);
+}
+
+/* session of handle, if the message is from its peer */
+static t2u_session *context_session_(t2u_context *context, const struct sockaddr_in *from,
+    t2u_message_data *mdata, uint64_t handle, int connected)
+{
+    t2u_session *session = find_session_in_context(context, handle, connected);
+    t2u_peer *other;
+
+    if (session && session->peer_ && from && !t2u_peer_match(session->peer_, from))
+    {
+        /* closed from an address the same client proved by a later session, the peer stays */
+        other = (mdata->oper_ == close_request) ? t2u_peer_find(context, from) : NULL;
+        if (other && t2u_peer_same(session->peer_, other))
+        {
+            return session;
+        }
+
+        /* nothing goes to the new address before the rebind response proves it */
+        if (context_valid_(session, mdata))
+        {
+            context_rebind_send_(context, from, rebind_request, handle, 0);
+        }
+        LOG_(2, "drop packet of session: %p from another address", session);
+        return NULL;
+    }
+    return session;
+}
+
+void t2u_context_dispatch_udp(t2u_context *context, const struct sockaddr_in *from, t2u_message_data *mdata, int recv_bytes)
+{
     switch (mdata->oper_)
     {
     case connect_request:
         {
             char *service = mdata->payload;
-            t2u_rule *rule = rbtree_lookup(context->rules_, service);
+            t2u_rule *rule = t2u_rule_tree_find(&context->rules_, service);
             if (rule)
             {
-                t2u_rule_handle_connect_request(rule, mdata);
+                t2u_rule_handle_connect_request(rule, mdata, from, context_peer_id_(mdata, recv_bytes));
             }
             else
             {
                 LOG_(2, "no rule match the service: %s", service);
             }
-            free(buff);
         }
         break;
     case connect_response:
         {
             /* find with self handle */
             uint64_t compare_handle = mdata->handle_ & 0x00000000ffffffff;
-            t2u_session *session = find_session_in_context(context, compare_handle, 0);
+            t2u_session *session = context_session_(context, from, mdata, compare_handle, 0);
             if (session)
             {
                 t2u_session_handle_connect_response(session, mdata);
             }
             else
             {
-                LOG_(2, "no session match the handle: %llu -> %llu", mdata->handle_, compare_handle);
+                context_miss_(context, compare_handle, mdata, recv_bytes);
             }
-            free(buff);
         }
         break;
     case data_request:
         {
-            t2u_session *session = find_session_in_context(context, mdata->handle_, 1);
+            t2u_session *session = context_session_(context, from, mdata, mdata->handle_, 1);
             if (session)
             {
                 t2u_session_handle_data_request(session, mdata, recv_bytes);
             }
             else
             {
-                LOG_(2, "no session match the handle: %llu", mdata->handle_);
+                context_miss_(context, mdata->handle_, mdata, recv_bytes);
             }
-            free(buff);
         }    
         break;
     case data_response:
         {
-            t2u_session *session = find_session_in_context(context, mdata->handle_, 1);
+            t2u_session *session = context_session_(context, from, mdata, mdata->handle_, 1);
             if (session)
             {
                 /* find it in send queue */
-                t2u_message *message = rbtree_lookup(session->send_mess_, &mdata->seq_);
+                t2u_message *message = session->window_ ?
+                    t2u_message_tree_find(&session->window_->send_mess_, mdata->seq_) : NULL;
                 if (message)
                 {
                     t2u_message_handle_data_response(message, mdata);
@@ -119,18 +386,18 @@ static void process_udp_cb_(evutil_socket_t sock, short events, void *arg)
             }
             else
             {
-                LOG_(2, "no session match the handle: %llu", mdata->handle_);
+                context_miss_(context, mdata->handle_, mdata, recv_bytes);
             }
-            free(buff);
         }
         break;
     case retrans_request:
         {
-            t2u_session *session = find_session_in_context(context, mdata->handle_, 1);
+            t2u_session *session = context_session_(context, from, mdata, mdata->handle_, 1);
             if (session)
             {
                 /* find it in send queue */
-                t2u_message *message = rbtree_lookup(session->send_mess_, &mdata->seq_);
+                t2u_message *message = session->window_ ?
+                    t2u_message_tree_find(&session->window_->send_mess_, mdata->seq_) : NULL;
                 if (message)
                 {
                     t2u_message_handle_retrans_request(message, mdata);
@@ -142,27 +409,86 @@ static void process_udp_cb_(evutil_socket_t sock, short events, void *arg)
             }
             else
             {
-                LOG_(2, "no session match the handle: %llu", mdata->handle_);
+                context_miss_(context, mdata->handle_, mdata, recv_bytes);
             }
-            free(buff);
         }
         break;
     case close_request:
     {
-        t2u_session *session = find_session_in_context(context, mdata->handle_, 1);
+        /* answer to the sender, a connected socket has only its peer */
+        const struct sockaddr_in *to = context->multi_peer_ ? from : NULL;
+        t2u_session *session = context_session_(context, from, mdata, mdata->handle_, 1);
         if (session)
         {
             LOG_(1, "close session:%p, as peer already closed.", session);
             t2u_delete_connected_session(session, 1);
+            t2u_close_respond(context, to, mdata->handle_);
+        }
+        else if (!find_session_in_context(context, mdata->handle_, 1) &&
+            !t2u_group_handoff(context, mdata->handle_, mdata, recv_bytes))
+        {
+            /* closed before, the answer was lost */
+            t2u_close_respond(context, to, mdata->handle_);
+        }
+    }
+        break;
+    case close_response:
+    {
+        if (!t2u_close_handle_response(context, mdata->handle_))
+        {
+            t2u_group_handoff(context, mdata->handle_, mdata, recv_bytes);
+        }
+    }
+        break;
+    case rebind_request:
+    {
+        /* only a client has a peer id to prove, it answers through its nat */
+        if (context->multi_peer_)
+        {
+            LOG_(2, "rebind request to a server context: %p", context);
+        }
+        else if (find_session_in_context(context, mdata->handle_, 1))
+        {
+            context_rebind_send_(context, NULL, rebind_response, mdata->handle_, context->peer_id_);
+        }
+        else
+        {
+            context_miss_(context, mdata->handle_, mdata, recv_bytes);
+        }
+    }
+        break;
+    case rebind_response:
+    {
+        t2u_session *session = find_session_in_context(context, mdata->handle_, 1);
+        uint64_t id = 0;
+
+        if (!session)
+        {
+            context_miss_(context, mdata->handle_, mdata, recv_bytes);
+            break;
+        }
+
+        if (recv_bytes >= (int)(sizeof(t2u_message_data) + sizeof(id)))
+        {
+            memcpy(&id, mdata->payload, sizeof(id));
+            id = ntoh64(id);
+        }
+
+        if (!session->peer_ || !from || !session->peer_->id_ || (session->peer_->id_ != id))
+        {
+            LOG_(2, "drop rebind response of session: %p, wrong peer id", session);
+        }
+        else if (!t2u_peer_match(session->peer_, from))
+        {
+            t2u_peer_rebind(context, session->peer_, from);
+            context_rebind_(context, session->peer_);
         }
-        free(buff);
     }
         break;
     default:
         {
             /* unknown packet */
             LOG_(2, "recv unknown packet from context: %p, type: %d", context, mdata->oper_);
-            free(buff);
         }
         break;
     }
@@ -173,73 +499,149 @@ static void add_context_cb_(t2u_runner *runner, void *arg)
 {
     t2u_context *context = (t2u_context *)arg;
 
-    context->ev_udp_ = t2u_event_new();
-    context->ev_udp_->runner_ = runner;
+    context->ev_udp_ = t2u_event_new(runner);
     context->ev_udp_->context_ = context;
 
-    context->ev_udp_->event_ = event_new(runner->base_, context->sock_, 
-        EV_READ|EV_PERSIST, process_udp_cb_, context->ev_udp_);
-    assert(NULL != context->ev_udp_->event_);
+    /* no socket if the transport is in memory */
+    if (context->sock_ != (sock_t)-1)
+    {
+        context->ev_udp_->event_ = event_new(runner->base_, context->sock_,
+            EV_READ|EV_PERSIST, process_udp_cb_, context->ev_udp_);
+        assert(NULL != context->ev_udp_->event_);
 
-    event_add(context->ev_udp_->event_, NULL);
+        event_add(context->ev_udp_->event_, NULL);
+    }
     rbtree_insert(runner->contexts_, context, context);
 
 	LOG_(1, "add context:%p to runner: %p, sock: %d", context, runner, context->sock_);
 }
 
 
-/* init */
-t2u_context * t2u_add_context(t2u_runner *runner, sock_t sock)
+/* async add or delete, done is called in runner */
+typedef struct context_async_
+{
+    t2u_context *context_;
+    forward_done done_;
+    void *arg_;
+} context_async;
+
+static void add_context_async_cb_(t2u_runner *runner, void *arg)
+{
+    context_async *ca = (context_async *)arg;
+
+    add_context_cb_(runner, ca->context_);
+    if (ca->done_)
+    {
+        ca->done_(ca->context_, ca->arg_);
+    }
+    free(ca);
+}
+
+static t2u_context *context_new_(t2u_runner *runner, sock_t sock)
 {
-    control_data cdata;
     t2u_context *context = (t2u_context *) malloc(sizeof(t2u_context));
     assert(context != NULL);
     memset(context, 0, sizeof(t2u_context));
 
-    evutil_make_socket_nonblocking(sock);
+    if (sock != (sock_t)-1)
+    {
+        evutil_make_socket_nonblocking(sock);
+    }
 
-    context->rules_ = rbtree_init(compare_name);
     context->sock_ = sock;
     context->utimeout_ = 500;
     context->uretries_ = 3;
     context->udp_slide_window_ = 16;
     context->session_timeout_ = 900;
     context->runner_ = runner;
+    context->debug_reorder_delay_ = 10;
+    t2u_debug_seed(context, 1);
+
+    /* 0 is no id */
+    while (0 == context->peer_id_)
+    {
+        context->peer_id_ = t2u_random64();
+    }
+
+    LOG_(0, "create new context %p with sock %d", (void *)context, (int)sock);
+    return context;
+}
+
+/* init */
+t2u_context * t2u_add_context(t2u_runner *runner, sock_t sock)
+{
+    control_data cdata;
+    t2u_context *context = context_new_(runner, sock);
 
     cdata.func_ = add_context_cb_;
     cdata.arg_ = context;
-    
-    LOG_(0, "create new context %p with sock %d", (void *)context, (int)sock);
+    t2u_runner_control(runner, &cdata);
+
+    return context;
+}
 
+t2u_context *t2u_add_server_context(t2u_runner *runner, sock_t sock)
+{
+    control_data cdata;
+    t2u_context *context = context_new_(runner, sock);
+
+    context->multi_peer_ = 1;
+#ifdef __linux__
+    context->mmsg_ = (struct t2u_mmsg_ *) malloc(sizeof(struct t2u_mmsg_));
+    assert(NULL != context->mmsg_);
+    memset(context->mmsg_, 0, sizeof(struct t2u_mmsg_));
+#endif
+
+    cdata.func_ = add_context_cb_;
+    cdata.arg_ = context;
     t2u_runner_control(runner, &cdata);
 
     return context;
 }
 
+void t2u_add_context_async(t2u_runner *runner, sock_t sock, forward_done done, void *arg)
+{
+    control_data cdata;
+    context_async *ca = (context_async *) malloc(sizeof(context_async));
+    assert(NULL != ca);
+
+    ca->context_ = context_new_(runner, sock);
+    ca->done_ = done;
+    ca->arg_ = arg;
+
+    cdata.func_ = add_context_async_cb_;
+    cdata.arg_ = ca;
+    t2u_runner_post(runner, &cdata);
+}
+
 /* context free */
 static void delete_context_cb_(t2u_runner *runner, void *arg)
 {
     t2u_context *context = (t2u_context *)arg;
 
     /* remove rules with this context */
-    while (context->rules_->root)
+    while (!t2u_rb_empty(&context->rules_))
     {
-        rbtree_node *node = context->rules_->root;
-        void *remove = node->data;
-
-        t2u_delete_rule((t2u_rule *)remove);
+        t2u_delete_rule(t2u_rule_tree_first(&context->rules_));
     }
-    /* remove the tree */
-    free(context->rules_);
-    context->rules_ = NULL;
+
+    /* closes of the sessions are not waited for */
+    t2u_close_cleanup(context);
 
     /* remove the events */
     t2u_delete_event(context->ev_udp_);
     context->ev_udp_ = NULL;
 
+    /* drop the delayed packets */
+    t2u_debug_cleanup(context);
+
     /* remove from runner */
     rbtree_remove(runner->contexts_, context);
 
+    /* the last session of a peer freed it */
+    assert(t2u_rb_empty(&context->peers_));
+    free(context->mmsg_);
+
     LOG_(0, "delete the context %p with sock %d", (void *)context, (int)context->sock_);
     
     free(context);
@@ -258,25 +660,118 @@ void t2u_delete_context(t2u_context *context)
     return;
 }
 
-void t2u_send_message_data(t2u_context *context, char *data, size_t size, t2u_session * session)
+static void delete_context_async_cb_(t2u_runner *runner, void *arg)
+{
+    context_async *ca = (context_async *)arg;
+
+    delete_context_cb_(runner, ca->context_);
+    if (ca->done_)
+    {
+        ca->done_(ca->context_, ca->arg_);
+    }
+    free(ca);
+}
+
+void t2u_delete_context_async(t2u_context *context, forward_done done, void *arg)
+{
+    control_data cdata;
+    context_async *ca = (context_async *) malloc(sizeof(context_async));
+    assert(NULL != ca);
+
+    ca->context_ = context;
+    ca->done_ = done;
+    ca->arg_ = arg;
+
+    cdata.func_ = delete_context_async_cb_;
+    cdata.arg_ = ca;
+    t2u_runner_post(context->runner_, &cdata);
+}
+
+static void send_account_(t2u_context *context, size_t size, t2u_session *session)
 {
+    context->stat_[CTX_STAT_UDP_SENT_PACKETS]++;
+    context->stat_[CTX_STAT_UDP_SENT_BYTES] += size;
+
     if (session)
     {
-        session->last_send_ts_ = time(NULL);
+        t2u_session_touch(session);
     }
+}
 
-#if 1
-    send(context->sock_, data, size, 0);
-#else
-    int a = rand();
-    if (a % 10)
+/* send to the session's peer, NULL for the context's */
+static const struct sockaddr_in *send_to_(t2u_session *session)
+{
+    return (session && session->peer_) ? &session->peer_->addr_ : NULL;
+}
+
+static void send_packet_(t2u_context *context, const struct sockaddr_in *to, t2u_packet *packet, t2u_session *session)
+{
+    send_account_(context, packet->len_, session);
+
+    if (t2u_debug_enabled(context))
     {
-        send(context->sock_, data, size, 0);
+        /* simulate delay, loss, reorder and bandwidth */
+        t2u_debug_send(context, to, packet);
+        return;
     }
-    else
+
+    t2u_context_transmit(context, to, packet->data_, packet->len_);
+}
+
+static void send_data_(t2u_context *context, const struct sockaddr_in *to, char *data, size_t size, t2u_session *session)
+{
+    if (t2u_debug_enabled(context))
     {
-        t2u_message_data *md = data;
-        LOG_(1, "xxxxxxxxxxxxxxx drop. %d", ntohl(md->seq_));
+        /* the delay queue keeps a packet, copy once */
+        t2u_packet *packet = t2u_packet_copy(context->runner_, data, size);
+        send_packet_(context, to, packet, session);
+        t2u_packet_unref(packet);
+        return;
     }
+
+    send_account_(context, size, session);
+    t2u_context_transmit(context, to, data, size);
+}
+
+void t2u_send_message_data(t2u_context *context, char *data, size_t size, t2u_session * session)
+{
+    send_data_(context, send_to_(session), data, size, session);
+}
+
+void t2u_send_message_packet(t2u_context *context, t2u_packet *packet, t2u_session *session)
+{
+    send_packet_(context, send_to_(session), packet, session);
+}
+
+void t2u_send_message_to(t2u_context *context, const struct sockaddr_in *to, char *data, size_t size)
+{
+    send_data_(context, to, data, size, NULL);
+}
+
+void t2u_context_transmit(t2u_context *context, const struct sockaddr_in *to, const char *data, size_t size)
+{
+    if (context->transport_send_)
+    {
+        context->transport_send_(context, data, size);
+        return;
+    }
+
+    if (!to && context->peer_.sin_family)
+    {
+        to = &context->peer_;
+    }
+
+    if (to)
+    {
+#ifdef __linux__
+        if (mmsg_queue_(context, to, data, size))
+        {
+            return;
+        }
 #endif
+        sendto(context->sock_, data, size, 0, (const struct sockaddr *)to, sizeof(*to));
+        return;
+    }
+
+    send(context->sock_, data, size, 0);
 }
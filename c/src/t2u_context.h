@@ -4,10 +4,34 @@
 /* init */
 t2u_context * t2u_add_context(t2u_runner *runner, sock_t sock);
 
+/* init a context serving many peers on an unconnected socket */
+t2u_context *t2u_add_server_context(t2u_runner *runner, sock_t sock);
+
 /* context free */
 void t2u_delete_context(t2u_context *context);
 
+/* init without waiting, done gets the context in runner */
+void t2u_add_context_async(t2u_runner *runner, sock_t sock, forward_done done, void *arg);
+
+/* context free without waiting, done is called in runner after it */
+void t2u_delete_context_async(t2u_context *context, forward_done done, void *arg);
+
 /* sene message data */
 void t2u_send_message_data(t2u_context *context, char *data, size_t size, t2u_session * session);
 
+/* send a packet, shared with the delay queue instead of copied */
+void t2u_send_message_packet(t2u_context *context, t2u_packet *packet, t2u_session *session);
+
+/* send message data without a session, to NULL for the context's peer */
+void t2u_send_message_to(t2u_context *context, const struct sockaddr_in *to, char *data, size_t size);
+
+/* put udp data on the transport, after udp debug options. to NULL for the context's peer */
+void t2u_context_transmit(t2u_context *context, const struct sockaddr_in *to, const char *data, size_t size);
+
+/* process a udp message received for the context, from NULL if not known */
+void t2u_context_process_udp(t2u_context *context, const struct sockaddr_in *from, char *buff, int recv_bytes);
+
+/* run a checked udp message in host byte order */
+void t2u_context_dispatch_udp(t2u_context *context, const struct sockaddr_in *from, t2u_message_data *mdata, int recv_bytes);
+
 #endif /* __t2u_context_h__ */
\ No newline at end of file
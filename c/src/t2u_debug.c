@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <event2/event.h>
+
+#if defined __GNUC__
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+
+#include "t2u.h"
+#include "t2u_internal.h"
+
+/* max time a packet may wait for the simulated link, else tail drop */
+#define T2U_DEBUG_QUEUE_MAX_US (1000000ULL)
+
+/* delayed packet, keyed by (due_, serial_) */
+typedef struct t2u_debug_packet_
+{
+    uint64_t due_;                  /* time to send, us */
+    uint64_t serial_;               /* keep fifo for same due time */
+    t2u_packet *packet_;            /* the udp message, one ref */
+    struct sockaddr_in to_;         /* send to, sin_family 0 for the context's peer */
+} t2u_debug_packet;
+
+static int compare_packet(void *a, void *b)
+{
+    t2u_debug_packet *pa = (t2u_debug_packet *)a;
+    t2u_debug_packet *pb = (t2u_debug_packet *)b;
+
+    if (pa->due_ != pb->due_)
+    {
+        return (pa->due_ > pb->due_) ? 1 : -1;
+    }
+
+    if (pa->serial_ != pb->serial_)
+    {
+        return (pa->serial_ > pb->serial_) ? 1 : -1;
+    }
+
+    return 0;
+}
+
+static uint64_t debug_now_us_(t2u_context *context)
+{
+    return t2u_time_us(context->runner_);
+}
+
+/* xorshift64*, [0, 1) */
+static double debug_rand_(t2u_context *context)
+{
+    uint64_t x = context->debug_rand_;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    context->debug_rand_ = x;
+    return (double)((x * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+/*
+ * loss decision. independent loss if burst <= 1, else two state
+ * gilbert-elliott: all packets lost in bad state, none in good state.
+ * r = 1 / burst, p = r * loss / (1 - loss) keeps the mean loss rate.
+ */
+static int debug_lost_(t2u_context *context)
+{
+    double loss = context->debug_packet_loss_ / 10000.0;
+    double r;
+    double p;
+
+    if (context->debug_packet_loss_ <= 0)
+    {
+        return 0;
+    }
+
+    if (context->debug_packet_loss_ >= 10000)
+    {
+        return 1;
+    }
+
+    if (context->debug_loss_burst_ <= 1)
+    {
+        return debug_rand_(context) < loss;
+    }
+
+    r = 1.0 / context->debug_loss_burst_;
+    p = r * loss / (1.0 - loss);
+
+    if (context->debug_loss_state_)
+    {
+        if (debug_rand_(context) < r)
+        {
+            context->debug_loss_state_ = 0;
+        }
+    }
+    else
+    {
+        if (debug_rand_(context) < p)
+        {
+            context->debug_loss_state_ = 1;
+        }
+    }
+
+    return context->debug_loss_state_;
+}
+
+static void debug_arm_timer_(t2u_context *context, uint64_t now)
+{
+    rbtree_node *node = rbtree_min(context->debug_queue_);
+    t2u_debug_packet *packet;
+    struct timeval t;
+    uint64_t wait = 0;
+
+    if (!node)
+    {
+        return;
+    }
+
+    packet = (t2u_debug_packet *)node->data;
+    if (packet->due_ > now)
+    {
+        wait = packet->due_ - now;
+    }
+
+    t.tv_sec = (long)(wait / 1000000);
+    t.tv_usec = (long)(wait % 1000000);
+    t2u_timer_add(context->runner_, context->ev_debug_->event_, &t);
+}
+
+static void debug_timer_cb_(evutil_socket_t sock, short events, void *arg)
+{
+    t2u_event *ev = (t2u_event *)arg;
+    t2u_context *context = ev->context_;
+    uint64_t now = debug_now_us_(context);
+    rbtree_node *node;
+
+    (void) sock;
+    (void) events;
+
+    while ((node = rbtree_min(context->debug_queue_)) != NULL)
+    {
+        t2u_debug_packet *packet = (t2u_debug_packet *)node->data;
+        if (packet->due_ > now)
+        {
+            break;
+        }
+
+        rbtree_remove(context->debug_queue_, packet);
+        t2u_context_transmit(context, packet->to_.sin_family ? &packet->to_ : NULL,
+            packet->packet_->data_, packet->packet_->len_);
+        t2u_packet_unref(packet->packet_);
+        free(packet);
+    }
+
+    debug_arm_timer_(context, now);
+}
+
+int t2u_debug_enabled(t2u_context *context)
+{
+    return (context->debug_latency_ > 0) || (context->debug_packet_loss_ > 0) ||
+        (context->debug_bandwidth_ > 0) || (context->debug_reorder_ > 0);
+}
+
+void t2u_debug_seed(t2u_context *context, unsigned long seed)
+{
+    /* xorshift state must not be 0 */
+    context->debug_rand_ = (uint64_t)seed * 0x9E3779B97F4A7C15ULL + 0x2545F4914F6CDD1DULL;
+    if (context->debug_rand_ == 0)
+    {
+        context->debug_rand_ = 0x2545F4914F6CDD1DULL;
+    }
+    context->debug_loss_state_ = 0;
+}
+
+void t2u_debug_send(t2u_context *context, const struct sockaddr_in *to, t2u_packet *sent)
+{
+    uint64_t now = debug_now_us_(context);
+    uint64_t due = now;
+    size_t size = sent->len_;
+    t2u_debug_packet *packet;
+
+    if (debug_lost_(context))
+    {
+        context->debug_bytes_drop_ += size;
+        return;
+    }
+
+    /* bandwidth, packets leave one by one when the link is free */
+    if (context->debug_bandwidth_ > 0)
+    {
+        uint64_t start = context->debug_bw_link_free_ > now ? context->debug_bw_link_free_ : now;
+
+        if (start - now > T2U_DEBUG_QUEUE_MAX_US)
+        {
+            /* link queue full, tail drop */
+            context->debug_bytes_drop_ += size;
+            return;
+        }
+
+        due = start + (uint64_t)size * 8 * 1000000 / context->debug_bandwidth_;
+        context->debug_bw_link_free_ = due;
+    }
+
+    due += (uint64_t)context->debug_latency_ * 1000;
+
+    if ((context->debug_reorder_ > 0) && (debug_rand_(context) * 10000 < context->debug_reorder_))
+    {
+        due += (uint64_t)context->debug_reorder_delay_ * 1000;
+    }
+
+    context->debug_bytes_sent_ += size;
+
+    if (due <= now)
+    {
+        t2u_context_transmit(context, to, sent->data_, size);
+        return;
+    }
+
+    /* queue it */
+    if (!context->debug_queue_)
+    {
+        context->debug_queue_ = rbtree_init(compare_packet);
+        context->ev_debug_ = t2u_event_new(context->runner_);
+        context->ev_debug_->context_ = context;
+        context->ev_debug_->event_ = evtimer_new(context->runner_->base_, debug_timer_cb_, context->ev_debug_);
+        assert(NULL != context->ev_debug_->event_);
+    }
+
+    packet = (t2u_debug_packet *)malloc(sizeof(t2u_debug_packet));
+    assert(NULL != packet);
+
+    packet->due_ = due;
+    packet->serial_ = ++context->debug_serial_;
+    packet->packet_ = t2u_packet_ref(sent);
+    memset(&packet->to_, 0, sizeof(packet->to_));
+    if (to)
+    {
+        packet->to_ = *to;
+    }
+
+    rbtree_insert(context->debug_queue_, packet, packet);
+    debug_arm_timer_(context, now);
+}
+
+void t2u_debug_cleanup(t2u_context *context)
+{
+    if (context->debug_queue_)
+    {
+        while (context->debug_queue_->root)
+        {
+            t2u_debug_packet *packet = (t2u_debug_packet *)context->debug_queue_->root->data;
+            rbtree_remove(context->debug_queue_, packet);
+            t2u_packet_unref(packet->packet_);
+            free(packet);
+        }
+        free(context->debug_queue_);
+        context->debug_queue_ = NULL;
+    }
+
+    t2u_delete_event(context->ev_debug_);
+    context->ev_debug_ = NULL;
+}
@@ -0,0 +1,16 @@
+#ifndef __t2u_debug_h__
+#define __t2u_debug_h__
+
+/* is any udp impairment enabled for the context */
+int t2u_debug_enabled(t2u_context *context);
+
+/* send through the impairment layer: loss, bandwidth, delay and reorder. delayed packets are referenced, not copied */
+void t2u_debug_send(t2u_context *context, const struct sockaddr_in *to, t2u_packet *packet);
+
+/* seed the impairment prng */
+void t2u_debug_seed(t2u_context *context, unsigned long seed);
+
+/* drop delayed packets and the timer, in runner */
+void t2u_debug_cleanup(t2u_context *context);
+
+#endif /* __t2u_debug_h__ */
@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <event2/event.h>
+#include <event2/util.h>
+#ifdef __GNUC__
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include "t2u.h"
+#include "t2u_internal.h"
+
+/* a shard lagging more is not a target, and sheds at any imbalance */
+#define T2U_BALANCE_LAG_US (5000)
+
+/* a message passed to the owner shard, host byte order */
+typedef struct group_handoff_
+{
+    t2u_context *context_;
+    int len_;
+    char data_[0];
+} group_handoff;
+
+typedef struct group_join_
+{
+    t2u_context *context_;
+    t2u_group *group_;
+    uint32_t shard_;
+    uint64_t peer_id_;
+    const struct sockaddr_in *peer_;
+} group_join;
+
+static void group_join_cb_(t2u_runner *runner, void *arg)
+{
+    group_join *gj = (group_join *)arg;
+    t2u_context *context = gj->context_;
+
+    (void) runner;
+
+    context->group_ = gj->group_;
+    context->shard_ = gj->shard_;
+    context->peer_id_ = gj->peer_id_;
+    context->peer_ = *gj->peer_;
+}
+
+static void group_leave_cb_(t2u_runner *runner, void *arg)
+{
+    t2u_context *context = (t2u_context *)arg;
+
+    (void) runner;
+
+    /* no handoff from or to it after this */
+    context->group_ = NULL;
+
+    t2u_delete_event(context->ev_balance_);
+    context->ev_balance_ = NULL;
+}
+
+/* udp socket bound to local, shared by the shards */
+static sock_t group_socket_(const struct sockaddr_in *local)
+{
+    int one = 1;
+    sock_t s = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (s == (sock_t)-1)
+    {
+        return s;
+    }
+
+#ifdef SO_REUSEPORT
+    setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (void *)&one, sizeof(one));
+#else
+    (void) one;
+#endif
+
+    if (-1 == bind(s, (const struct sockaddr *)local, sizeof(*local)))
+    {
+        closesocket(s);
+        return (sock_t)-1;
+    }
+    return s;
+}
+
+t2u_group *t2u_group_new(t2u_runner **runners, size_t count,
+    const struct sockaddr_in *local, const struct sockaddr_in *peer)
+{
+#ifdef SO_REUSEPORT
+    struct sockaddr_in addr = *local;
+    socklen_t addr_len = sizeof(addr);
+    t2u_group *group = (t2u_group *) malloc(sizeof(t2u_group));
+    size_t i;
+
+    assert(NULL != group);
+    memset(group, 0, sizeof(t2u_group));
+    group->steer_map_ = -1;
+    group->steer_prog_ = -1;
+
+    group->count_ = count;
+    group->contexts_ = (t2u_context **) calloc(count, sizeof(t2u_context *));
+    group->socks_ = (sock_t *) calloc(count, sizeof(sock_t));
+    group->loads_ = (t2u_group_load *) calloc(count, sizeof(t2u_group_load));
+    assert((NULL != group->contexts_) && (NULL != group->socks_) && (NULL != group->loads_));
+    t2u_mutex_init(&group->mutex_);
+
+    for (i = 0; i < count; i++)
+    {
+        group->socks_[i] = group_socket_(&addr);
+        if (group->socks_[i] == (sock_t)-1)
+        {
+            LOG_(3, "bind udp socket %u of group failed, port: %u", (unsigned)i, ntohs(addr.sin_port));
+            while (i-- > 0)
+            {
+                closesocket(group->socks_[i]);
+            }
+            free(group->loads_);
+            free(group->socks_);
+            free(group->contexts_);
+            free(group);
+            return NULL;
+        }
+
+        /* port 0 is picked by the first socket, the others join it */
+        if (0 == i)
+        {
+            getsockname(group->socks_[0], (struct sockaddr *)&addr, &addr_len);
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        group_join gj;
+        control_data cdata;
+
+        group->contexts_[i] = t2u_add_context(runners[i], group->socks_[i]);
+
+        gj.context_ = group->contexts_[i];
+        gj.group_ = group;
+        gj.shard_ = (uint32_t)i;
+        /* the shards share a port, the server sees one client */
+        gj.peer_id_ = group->contexts_[0]->peer_id_;
+        gj.peer_ = peer;
+        cdata.func_ = group_join_cb_;
+        cdata.arg_ = &gj;
+        t2u_runner_control(runners[i], &cdata);
+    }
+
+    LOG_(1, "create group %p of %u shards, port: %u", (void *)group, (unsigned)count, ntohs(addr.sin_port));
+    return group;
+#else
+    (void) runners;
+    (void) count;
+    (void) local;
+    (void) peer;
+
+    LOG_(3, "SO_REUSEPORT is not supported, no group");
+    return NULL;
+#endif
+}
+
+void t2u_group_free(t2u_group *group)
+{
+    size_t i;
+
+    /* leave first, a handoff posted before it runs before the delete */
+    for (i = 0; i < group->count_; i++)
+    {
+        control_data cdata;
+
+        cdata.func_ = group_leave_cb_;
+        cdata.arg_ = group->contexts_[i];
+        t2u_runner_control(group->contexts_[i]->runner_, &cdata);
+    }
+
+    for (i = 0; i < group->count_; i++)
+    {
+        t2u_delete_context(group->contexts_[i]);
+        closesocket(group->socks_[i]);
+    }
+
+    t2u_steer_detach(group);
+
+    while (!t2u_rb_empty(&group->owners_))
+    {
+        t2u_group_owner *owner = t2u_owner_tree_first(&group->owners_);
+        t2u_owner_tree_remove(&group->owners_, owner);
+        free(owner);
+    }
+
+    free(group->loads_);
+    free(group->socks_);
+    free(group->contexts_);
+    free(group);
+}
+
+void t2u_group_own(t2u_context *context, uint64_t handle)
+{
+    t2u_group *group = context->group_;
+    t2u_group_owner *owner;
+
+    if (!group)
+    {
+        return;
+    }
+
+    owner = (t2u_group_owner *) malloc(sizeof(t2u_group_owner));
+    assert(NULL != owner);
+    owner->handle_ = handle;
+    owner->shard_ = context->shard_;
+
+    t2u_mutex_lock(&group->mutex_);
+    if (0 != t2u_owner_tree_insert(&group->owners_, owner))
+    {
+        /* handles are unique in the process, only a peer's replayed handle */
+        LOG_(2, "handle: %llu already owned in group: %p", (unsigned long long)handle, (void *)group);
+        free(owner);
+    }
+    else
+    {
+        t2u_steer_own(group, handle, context->shard_);
+    }
+    t2u_mutex_unlock(&group->mutex_);
+}
+
+void t2u_group_disown(t2u_context *context, uint64_t handle)
+{
+    t2u_group *group = context->group_;
+    t2u_group_owner *owner;
+
+    if (!group)
+    {
+        return;
+    }
+
+    t2u_mutex_lock(&group->mutex_);
+    owner = t2u_owner_tree_find(&group->owners_, handle);
+    if (owner && (owner->shard_ == context->shard_))
+    {
+        t2u_owner_tree_remove(&group->owners_, owner);
+        free(owner);
+        t2u_steer_disown(group, handle);
+    }
+    t2u_mutex_unlock(&group->mutex_);
+}
+
+void t2u_group_move(t2u_context *context, uint64_t handle, uint32_t shard)
+{
+    t2u_group *group = context->group_;
+    t2u_group_owner *owner;
+
+    t2u_mutex_lock(&group->mutex_);
+    owner = t2u_owner_tree_find(&group->owners_, handle);
+    if (owner)
+    {
+        owner->shard_ = shard;
+        t2u_steer_own(group, handle, shard);
+    }
+    t2u_mutex_unlock(&group->mutex_);
+}
+
+/*
+ * the largest session of the shard that fits in half of the gap to the
+ * coolest shard, so the two never swap places. NULL if none
+ */
+static t2u_session *group_balance_pick_(t2u_context *context, uint64_t gap)
+{
+    t2u_session *pick = NULL;
+    t2u_rule *rule;
+    t2u_session *session;
+
+    for (rule = t2u_rule_tree_first(&context->rules_); rule; rule = t2u_rule_tree_next(rule))
+    {
+        for (session = t2u_session_tree_first(&rule->sessions_); session; session = t2u_session_tree_next(session))
+        {
+            if ((session->status_ == 2) && !t2u_budget_blocked(session) &&
+                session->bytes_ && (session->bytes_ <= gap / 2) &&
+                (!pick || (session->bytes_ > pick->bytes_)))
+            {
+                pick = session;
+            }
+        }
+    }
+    return pick;
+}
+
+static void group_balance_arm_(t2u_context *context)
+{
+    struct timeval t;
+
+    t.tv_sec = (long)(context->balance_ms_ / 1000);
+    t.tv_usec = (long)(context->balance_ms_ % 1000) * 1000;
+    context->balance_due_us_ = t2u_time_us(context->runner_) + (uint64_t)context->balance_ms_ * 1000;
+    t2u_timer_add(context->runner_, context->ev_balance_->event_, &t);
+}
+
+static void group_balance_cb_(evutil_socket_t sock, short events, void *arg)
+{
+    t2u_event *ev = (t2u_event *)arg;
+    t2u_context *context = ev->context_;
+    t2u_group *group = context->group_;
+    uint64_t now = t2u_time_us(context->runner_);
+    uint64_t lag = (now > context->balance_due_us_) ? now - context->balance_due_us_ : 0;
+    uint64_t bytes = 0;
+    uint64_t target_bytes = 0;
+    t2u_context *target = NULL;
+    t2u_session *session;
+    t2u_rule *rule;
+    size_t i;
+
+    (void) sock;
+    (void) events;
+
+    /* ewma of the tick's lateness, 1/8 */
+    context->stat_[CTX_STAT_LOOP_LAG_US] = (context->stat_[CTX_STAT_LOOP_LAG_US] * 7 + lag) / 8;
+
+    for (rule = t2u_rule_tree_first(&context->rules_); rule; rule = t2u_rule_tree_next(rule))
+    {
+        for (session = t2u_session_tree_first(&rule->sessions_); session; session = t2u_session_tree_next(session))
+        {
+            bytes += session->bytes_;
+        }
+    }
+
+    /* publish, then the coolest shard by its last tick */
+    t2u_mutex_lock(&group->mutex_);
+    group->loads_[context->shard_].rate_ = bytes * 1000 / context->balance_ms_;
+    group->loads_[context->shard_].lag_us_ = context->stat_[CTX_STAT_LOOP_LAG_US];
+    for (i = 0; i < group->count_; i++)
+    {
+        uint64_t rate = group->loads_[i].rate_;
+
+        if ((i == context->shard_) || (group->loads_[i].lag_us_ > T2U_BALANCE_LAG_US))
+        {
+            continue;
+        }
+
+        if (!target || (rate * context->balance_ms_ / 1000 < target_bytes))
+        {
+            target = group->contexts_[i];
+            target_bytes = rate * context->balance_ms_ / 1000;
+        }
+    }
+    t2u_mutex_unlock(&group->mutex_);
+
+    /* shed one session a tick, above 25% imbalance or when lagging */
+    if (target && (bytes > target_bytes) &&
+        ((bytes - target_bytes > bytes / 4) || (context->stat_[CTX_STAT_LOOP_LAG_US] > T2U_BALANCE_LAG_US)))
+    {
+        session = group_balance_pick_(context, bytes - target_bytes);
+        if (session && (0 == t2u_session_migrate(session, target)))
+        {
+            context->stat_[CTX_STAT_SESSIONS_MIGRATED]++;
+        }
+    }
+
+    for (rule = t2u_rule_tree_first(&context->rules_); rule; rule = t2u_rule_tree_next(rule))
+    {
+        for (session = t2u_session_tree_first(&rule->sessions_); session; session = t2u_session_tree_next(session))
+        {
+            session->bytes_ = 0;
+        }
+    }
+
+    group_balance_arm_(context);
+}
+
+typedef struct group_balance_
+{
+    t2u_context *context_;
+    unsigned long ms_;
+} group_balance;
+
+static void group_balance_set_cb_(t2u_runner *runner, void *arg)
+{
+    group_balance *gb = (group_balance *)arg;
+    t2u_context *context = gb->context_;
+
+    context->balance_ms_ = gb->ms_;
+    if (!gb->ms_)
+    {
+        t2u_delete_event(context->ev_balance_);
+        context->ev_balance_ = NULL;
+        return;
+    }
+
+    if (!context->ev_balance_)
+    {
+        context->ev_balance_ = t2u_event_new(runner);
+        context->ev_balance_->context_ = context;
+        context->ev_balance_->event_ = evtimer_new(runner->base_, group_balance_cb_, context->ev_balance_);
+        assert(NULL != context->ev_balance_->event_);
+    }
+    group_balance_arm_(context);
+}
+
+void t2u_group_balance(t2u_group *group, unsigned long ms)
+{
+    size_t i;
+
+    for (i = 0; i < group->count_; i++)
+    {
+        group_balance gb;
+        control_data cdata;
+
+        gb.context_ = group->contexts_[i];
+        gb.ms_ = ms;
+        cdata.func_ = group_balance_set_cb_;
+        cdata.arg_ = &gb;
+        t2u_runner_control(group->contexts_[i]->runner_, &cdata);
+    }
+}
+
+static void group_handoff_cb_(t2u_runner *runner, void *arg)
+{
+    group_handoff *gh = (group_handoff *)arg;
+
+    /* shard is gone if it was freed alone */
+    if (rbtree_lookup(runner->contexts_, gh->context_))
+    {
+        t2u_context_dispatch_udp(gh->context_, NULL, (t2u_message_data *)(void *)gh->data_, gh->len_);
+    }
+    free(gh);
+}
+
+int t2u_group_handoff(t2u_context *context, uint64_t key, t2u_message_data *mdata, int len)
+{
+    t2u_group *group = context->group_;
+    t2u_group_owner *owner;
+    t2u_context *target = NULL;
+    group_handoff *gh;
+    control_data cdata;
+
+    if (!group)
+    {
+        return 0;
+    }
+
+    t2u_mutex_lock(&group->mutex_);
+    owner = t2u_owner_tree_find(&group->owners_, key);
+    if (owner && (owner->shard_ != context->shard_))
+    {
+        target = group->contexts_[owner->shard_];
+    }
+    t2u_mutex_unlock(&group->mutex_);
+
+    if (!target)
+    {
+        return 0;
+    }
+
+    gh = (group_handoff *) malloc(sizeof(group_handoff) + len);
+    assert(NULL != gh);
+    gh->context_ = target;
+    gh->len_ = len;
+    memcpy(gh->data_, mdata, len);
+
+    context->stat_[CTX_STAT_UDP_HANDOFF_PACKETS]++;
+
+    cdata.func_ = group_handoff_cb_;
+    cdata.arg_ = gh;
+    t2u_runner_post(target->runner_, &cdata);
+    return 1;
+}
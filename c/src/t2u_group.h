@@ -0,0 +1,37 @@
+#ifndef __t2u_group_h__
+#define __t2u_group_h__
+
+/*
+ * contexts sharing one udp port with SO_REUSEPORT, shard i on runner i.
+ * sockets are unconnected and send to the peer, the kernel picks the shard
+ * of a datagram. a message for a session of another shard is handed off to
+ * it with the handle -> shard map of the group. sessions register their
+ * handle with the map in runner, lookups are only made on a local miss.
+ */
+
+/* new group of count shards on runners, NULL if the sockets failed */
+t2u_group *t2u_group_new(t2u_runner **runners, size_t count,
+    const struct sockaddr_in *local, const struct sockaddr_in *peer);
+
+/* delete shards, their rules and the sockets */
+void t2u_group_free(t2u_group *group);
+
+/* session of the context now answers to handle, nothing if not grouped. in runner */
+void t2u_group_own(t2u_context *context, uint64_t handle);
+
+/* handle is gone from the context. in runner */
+void t2u_group_disown(t2u_context *context, uint64_t handle);
+
+/* session of handle moves from the context to shard, see t2u_session_migrate. in runner */
+void t2u_group_move(t2u_context *context, uint64_t handle, uint32_t shard);
+
+/* balance tick of every shard each ms, 0 to stop */
+void t2u_group_balance(t2u_group *group, unsigned long ms);
+
+/*
+ * message for key is not in the context, pass it to the shard owning key.
+ * 1 if handed off, mdata is copied. in runner
+ */
+int t2u_group_handoff(t2u_context *context, uint64_t key, t2u_message_data *mdata, int len);
+
+#endif /* __t2u_group_h__ */
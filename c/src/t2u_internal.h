@@ -4,6 +4,7 @@
 #include <time.h>
 #include "t2u_thread.h"
 #include "t2u_rbtree.h"
+#include "t2u_slab.h"
 
 #ifdef __GNUC__
 #include <netinet/in.h>
@@ -45,52 +46,21 @@ typedef void (*error_callback)(forward_context, forward_rule, int , char *);
 typedef void (*unknown_callback)(forward_context, const char *, size_t);
 
 log_callback get_log_func_();
+int get_log_level_();
 error_callback get_error_func_();
 unknown_callback get_unknown_func_();
 
-#if defined _MSC_VER
+/* compile time log level, LOG_ below it is removed. eg: -DT2U_LOG_LEVEL=1 */
+#ifndef T2U_LOG_LEVEL
+#define T2U_LOG_LEVEL (0)
+#endif
+
+/* level is checked before any formatting, message is queued to the log writer */
 #define LOG_(level, ...) do { \
-    if (get_log_func_()) { \
-        char mess_[1024]; \
-        time_t t; \
-        struct tm tmp; \
-        t = time(NULL); \
-        localtime_s(&tmp, &t); \
-        char ts[64]; \
-        strftime(ts, sizeof(ts), "%y-%m-%d %H:%M:%S", &tmp); \
-        int n = sprintf_s(mess_, sizeof(mess_), "[%s] [%s:%d] ", ts, __FILE__, __LINE__); \
-        n += sprintf_s(&mess_[n], sizeof(mess_)-n, ##__VA_ARGS__); \
-        if (n < (int)sizeof(mess_) - 2) { \
-            if (mess_[n-1] != '\n') {\
-                mess_[n++] = '\n'; \
-                mess_[n++] = '\0'; \
-                                    } \
-            get_log_func_() (level, mess_) ; \
-                        } \
-            } \
-} while (0)
-#else
-#define LOG_(level, fmt...) do { \
-    if (get_log_func_()) { \
-        char mess_[1024]; \
-        time_t t; \
-        struct tm tmp; \
-        t = time(NULL); \
-        localtime_r(&t, &tmp); \
-        char ts[64]; \
-        strftime(ts, sizeof(ts), "%y-%m-%d %H:%M:%S", &tmp); \
-        int n = sprintf(mess_, "[%s] [%s:%d] ", ts, __FILE__, __LINE__); \
-        n += sprintf(&mess_[n], ##fmt); \
-        if (n < (int)sizeof(mess_) - 2) { \
-            if (mess_[n-1] != '\n') {\
-                mess_[n++] = '\n'; \
-                mess_[n++] = '\0'; \
-            } \
-            get_log_func_() (level, mess_) ; \
-        } \
+    if (((level) >= T2U_LOG_LEVEL) && ((level) >= get_log_level_()) && get_log_func_()) { \
+        t2u_log_write_((level), __FILE__, __LINE__, __VA_ARGS__); \
     } \
 } while (0)
-#endif
 
 /* event with data */
 typedef struct t2u_event_
@@ -116,6 +86,8 @@ enum t2u_mess_oper
     data_request,
     data_response,
     retrans_request,
+    rebind_request,             /* server to a session's new address: prove the peer id */
+    rebind_response,            /* client: the peer id, the server moves the peer here */
 };
 
 
@@ -137,33 +109,93 @@ typedef struct t2u_message_data_ t2u_message_data;
 #define T2U_MESS_BUFFER_MAX (T2U_PAYLOAD_MAX + sizeof(t2u_message_data))
 #define T2U_MESS_MAGIC (0x5432552E) /* "T2U." */
 
+/* timer duration of an option in ms, see t2u_runner_timeout */
+typedef struct t2u_timeout_
+{
+    unsigned long ms_;              /* option value the duration is made for */
+    struct timeval tv_;             /* the duration */
+    const struct timeval *common_;  /* libevent common timeout of the duration */
+} t2u_timeout;
+
+/* refcounted udp message, see t2u_packet.h */
+typedef struct t2u_packet_
+{
+    struct t2u_runner_ *runner_;    /* pool owner */
+    uint32_t refs_;                 /* users, back to pool at 0 */
+    uint32_t len_;                  /* length of data_ */
+    char data_[0];                  /* the udp message */
+} t2u_packet;
+
 typedef struct t2u_message_
 {
     struct t2u_session_ *session_;  /* parent session */
-    t2u_message_data *data_;        /* message to send or recv */
-    size_t len_;                    /* length of message */
+    t2u_packet *packet_;            /* message to send or recv */
     uint32_t seq_;                  /* session based seq */
     unsigned long send_retries_;    /* retry send count */
     t2u_event *ev_timeout_;         /* timeout event */
+    t2u_rb_node rb_;                /* in send or recv queue of session, by seq_ */
 } t2u_message;
 
-/* session */
+/* send and recv queues of session, released while nothing is in flight */
+typedef struct t2u_session_window_
+{
+    t2u_rb_root send_mess_;                 /* send message list */
+    t2u_rb_root recv_mess_;                 /* recv message list */
+    uint32_t send_buffer_count_;
+    uint32_t recv_buffer_count_;
+    struct t2u_session_ *mem_prev_;         /* blocked list of rule, waiting for memory. kept while blocked */
+    struct t2u_session_ *mem_next_;
+} t2u_session_window;
+
+/* remote site of a server context, see t2u_peer.h */
+typedef struct t2u_peer_
+{
+    uint64_t key_;                          /* address and port, host order */
+    struct sockaddr_in addr_;               /* send to */
+    uint32_t refs_;                         /* sessions of the peer */
+    int indexed_;                           /* 1 if in peers_, a newer peer may own the address */
+    uint64_t id_;                           /* peer id of its connect requests, 0 if none */
+    t2u_rb_node rb_;                        /* in peers_ of context, by key_ */
+} t2u_peer;
+
+/* close of a deleted session waiting for its answer, see t2u_close.h */
+typedef struct t2u_close_
+{
+    uint64_t handle_;
+    t2u_peer *peer_;                        /* send to, NULL for the context's */
+    unsigned long retries_;                 /* resends left */
+    struct timeval timeout_;                /* resend interval, the rule may go first */
+    t2u_event *ev_;                         /* resend timer */
+    t2u_rb_node rb_;                        /* in closes_ of context, by handle_ */
+} t2u_close;
+
+/*
+ * half close. a data request without payload is the end of the stream, it
+ * is sent, acked and resent in order with the data before it.
+ */
+#define T2U_FIN_SENT (0x01)     /* tcp read got fin, end of stream sent */
+#define T2U_FIN_RECV (0x02)     /* end of stream delivered, tcp write shut */
+
+/* session, kept small since most sessions are idle. 128 bytes on 64 bit, a slab class */
 typedef struct t2u_session_
 {
     struct t2u_rule_ *rule_;                /* parent rule */
-    sock_t sock_;                           /* with the socket */
     uint64_t handle_;                       /* handle */
-    int status_;                            /* 0 for non, 1 for connecting, 2 for establish, 3 for closing */
-    uint32_t send_buffer_count_;
+    sock_t sock_;                           /* with the socket */
+    uint8_t status_;                        /* 0 for non, 1 for connecting, 2 for establish, 3 for closing */
+    uint8_t fin_;                           /* directions finished, T2U_FIN_* */
     uint32_t send_seq_;                     /* send seq */
-    rbtree *send_mess_;                     /* send message list */
-    uint32_t recv_buffer_count_;
     uint32_t recv_seq_;                     /* recv seq */
-    rbtree *recv_mess_;                     /* recv message list */
-    unsigned long connect_retries_;         /* retry count */
-    t2u_event *ev_;                         /* the connect,data event */
     uint32_t retry_seq_;                    /* retry seq */
-    time_t last_send_ts_;                   /* timestamp for timeout check */
+    uint32_t connect_retries_;              /* retry count */
+    t2u_session_window *window_;            /* send and recv queues, NULL if parked */
+    t2u_peer *peer_;                        /* remote site, NULL for the context's */
+    t2u_event *ev_;                         /* the connect,data event */
+    uint64_t last_send_ms_;                 /* runner clock of last send, for timeout check */
+    uint64_t bytes_;                        /* tcp bytes since the last balance tick */
+    struct t2u_session_ *idle_prev_;        /* idle list of context, newer */
+    struct t2u_session_ *idle_next_;        /* idle list of context, older */
+    t2u_rb_node rb_;                        /* in sessions_ or connecting_sessions_ of rule, by handle_ */
 } t2u_session;
 
 typedef struct t2u_rule_
@@ -173,22 +205,34 @@ typedef struct t2u_rule_
     t2u_event *ev_listen_;          /* event for listen socket */
     char *service_;                 /* service name */
     struct t2u_context_ *context_;  /* the context */
-    rbtree *sessions_;              /* sub sessions */
-    rbtree *connecting_sessions_;   /* sessions not in establish */
+    t2u_rb_root sessions_;          /* sub sessions */
+    t2u_rb_root connecting_sessions_;   /* sessions not in establish */
     struct sockaddr_in conn_addr_;  /* address for connect if server mode */
 
-    unsigned long utimeout_;        /* timeout for message */
-    unsigned long uretries_;        /* retries for message */
-    unsigned long udp_slide_window_;/* slide window for udp packets */
-    unsigned long session_timeout_; /* session timeout in seconds */
+    unsigned long utimeout_;        /* timeout for message, 0 for the context's */
+    unsigned long uretries_;        /* retries for message, 0 for the context's */
+    unsigned long udp_slide_window_;/* slide window for udp packets, 0 for the context's */
+    unsigned long session_timeout_; /* session timeout in seconds, 0 for the context's */
+    t2u_timeout utimeout_timer_;    /* timer duration of utimeout_ */
+
+    t2u_session *idle_head_;        /* connected sessions, most recently sent first */
+    t2u_session *idle_tail_;        /* the coldest session */
+    t2u_event *ev_idle_;            /* sweep timer for idle sessions */
+    int idle_armed_;                /* 1 if sweep timer is pending */
+
+    unsigned long mem_budget_;      /* bytes of message buffers, 0 for unlimited */
+    unsigned long long mem_used_;   /* bytes of message buffers in use */
+    t2u_session *mem_blocked_;      /* sessions with tcp read paused for memory */
+    int accept_paused_;             /* 1 if listen event is removed for memory */
 
+    t2u_rb_node rb_;                /* in rules_ of context, by service_ */
 } t2u_rule;
 
 typedef struct t2u_context_
 {
     sock_t sock_;
     struct t2u_runner_ *runner_;
-    rbtree *rules_;
+    t2u_rb_root rules_;
     t2u_event *ev_udp_;
 
     unsigned long utimeout_;        /* timeout for message */
@@ -196,17 +240,85 @@ typedef struct t2u_context_
     unsigned long udp_slide_window_;/* slide window for udp packets */
     unsigned long session_timeout_; /* session timeout in seconds */
 
-    int debug_bandwidth_;           /* simulate bandwidth in bit/second */
-    int debug_latency_;
-    int debug_packet_loss_;
+    t2u_timeout utimeout_timer_;    /* timer duration of utimeout_ */
+
+    unsigned long mem_budget_;      /* bytes of message buffers, 0 for unlimited */
+
+    unsigned long debug_bandwidth_; /* simulate bandwidth in bit/second */
+    int debug_latency_;             /* simulate one way delay, ms */
+    int debug_packet_loss_;         /* simulate loss rate, 1/10000 */
+    int debug_loss_burst_;          /* mean loss burst length in packets */
+    int debug_reorder_;             /* simulate reorder rate, 1/10000 */
+    int debug_reorder_delay_;       /* extra delay for reordered packets, ms */
+    int debug_loss_state_;          /* gilbert-elliott state, 0 good, 1 bad */
+    uint64_t debug_rand_;           /* prng state */
+    uint64_t debug_serial_;         /* serial for packets with same due time */
     unsigned long long 
         debug_bytes_sent_;
     unsigned long long 
         debug_bytes_drop_;
     unsigned long long 
-        debug_bw_time_start_;
+        debug_bw_link_free_;        /* time the simulated link is free, us */
+    rbtree *debug_queue_;           /* delayed packets by due time */
+    t2u_event *ev_debug_;           /* timer for delayed packets */
+
+    struct t2u_group_ *group_;      /* group of the context, NULL if alone */
+    uint32_t shard_;                /* index in group_ */
+    struct sockaddr_in peer_;       /* send to for an unconnected socket, sin_family 0 if connected */
+    t2u_event *ev_balance_;         /* balance tick of the shard, see forward_group_balance */
+    unsigned long balance_ms_;      /* period of the tick */
+    uint64_t balance_due_us_;       /* runner clock the tick is due, for loop lag */
+
+    /* udp transport, NULL to send on sock_ */
+    void (*transport_send_)(struct t2u_context_ *context, const char *data, size_t size);
+    void *transport_arg_;
+
+    int multi_peer_;                /* 1 if sock_ serves many peers, see create_forward_server */
+    t2u_rb_root peers_;             /* t2u_peer by address */
+    struct t2u_mmsg_ *mmsg_;        /* datagram batches of a multi peer context, NULL if none */
+
+    t2u_rb_root closes_;            /* t2u_close by handle */
+    uint64_t peer_id_;              /* random id of this site in connect requests, shards share it */
+
+    unsigned long long 
+        stat_[CTX_STAT_MAX];        /* statistics, see CTX_STAT_* */
 } t2u_context;
 
+/* load of a shard, published at its balance tick */
+typedef struct t2u_group_load_
+{
+    uint64_t rate_;                 /* tcp bytes/s */
+    uint64_t lag_us_;               /* loop lag */
+} t2u_group_load;
+
+/* shard answering to a handle, see t2u_group.h */
+typedef struct t2u_group_owner_
+{
+    uint64_t handle_;
+    uint32_t shard_;
+    t2u_rb_node rb_;                /* in owners_ of group, by handle_ */
+} t2u_group_owner;
+
+typedef struct t2u_group_
+{
+    size_t count_;                  /* shards */
+    t2u_context **contexts_;        /* shard i, on runner i of the pool */
+    sock_t *socks_;                 /* udp socket of shard i */
+    t2u_mutex_t mutex_;             /* guards owners_ */
+    t2u_rb_root owners_;            /* t2u_group_owner by handle */
+    t2u_group_load *loads_;         /* load of shard i, guarded by mutex_ */
+    int steer_map_;                 /* kernel copy of owners_, -1 if not steered */
+    int steer_prog_;                /* reuseport program, see t2u_steer.h */
+} t2u_group;
+
+/* typed intrusive trees */
+T2U_RB_GENERATE(t2u_message_tree, t2u_message, rb_, seq_, uint32_t, T2U_RB_CMP_NUM)
+T2U_RB_GENERATE(t2u_session_tree, t2u_session, rb_, handle_, uint64_t, T2U_RB_CMP_NUM)
+T2U_RB_GENERATE(t2u_rule_tree, t2u_rule, rb_, service_, const char *, T2U_RB_CMP_STR)
+T2U_RB_GENERATE(t2u_owner_tree, t2u_group_owner, rb_, handle_, uint64_t, T2U_RB_CMP_NUM)
+T2U_RB_GENERATE(t2u_peer_tree, t2u_peer, rb_, key_, uint64_t, T2U_RB_CMP_NUM)
+T2U_RB_GENERATE(t2u_close_tree, t2u_close, rb_, handle_, uint64_t, T2U_RB_CMP_NUM)
+
 typedef struct t2u_runner_
 {
     t2u_mutex_t mutex_;             /* mutex */
@@ -215,9 +327,23 @@ typedef struct t2u_runner_
     struct event_base *base_;       /* event base */
     int running_;                   /* 0 not running, 1 for running */
     t2u_thr_t thread_;              /* main run thread handle */
+    t2u_thr_attr attr_;             /* affinity, priority and name of thread_ */
     t2u_thr_id tid_;                /* main run thread id */
     evutil_socket_t sock_[2];       /* control socket for internal message */
     struct event* control_event_;   /* control event for internal message processing */
+    t2u_mutex_t post_mutex_;        /* guards the posted calls */
+    struct t2u_post_ *post_head_;   /* calls posted without waiting, fifo */
+    struct t2u_post_ *post_tail_;
+    int local_;                     /* 1 if driven by caller's thread, no runner thread */
+    struct t2u_sim_ *sim_;          /* virtual clock and timers, NULL for real time */
+    uint64_t now_us_;               /* monotonic clock, read once per loop iteration */
+    struct timeval now_key_;        /* libevent loop time now_us_ was read at */
+
+    t2u_slab event_slab_;           /* t2u_event */
+    t2u_slab session_slab_;         /* t2u_session */
+    t2u_slab window_slab_;          /* t2u_session_window */
+    t2u_slab message_slab_;         /* t2u_message */
+    t2u_slab packet_slab_;          /* t2u_packet of T2U_MESS_BUFFER_MAX */
 } t2u_runner;
 
 
@@ -229,13 +355,10 @@ typedef struct control_data_
     // int error_;     /* callback error code */
 } control_data;
 
-#if defined(__x86_64__) || defined(_WIN64)
-#define ntoh64(x) ntohl(x)
-#define hton64(x) htonl(x)
-#else
-#define ntoh64(x) (((uint64_t)ntohl((x)&0xffffffff) << 32) | ((uint64_t)ntohl((x)>>32)))
-#define hton64(x) (((uint64_t)htonl((x)&0xffffffff) << 32) | ((uint64_t)htonl((x)>>32)))
-#endif
+/* 64 bits byte order, swap both halves on little endian */
+#define ntoh64(x) ((1 == ntohl(1)) ? (uint64_t)(x) : \
+    (((uint64_t)ntohl((uint32_t)((x)&0xffffffff)) << 32) | ((uint64_t)ntohl((uint32_t)((uint64_t)(x)>>32)))))
+#define hton64(x) ntoh64(x)
 
 
 #include "t2u_runner.h"
@@ -243,6 +366,15 @@ typedef struct control_data_
 #include "t2u_rule.h"
 #include "t2u_session.h"
 #include "t2u_message.h"
+#include "t2u_log.h"
+#include "t2u_debug.h"
+#include "t2u_sim.h"
+#include "t2u_budget.h"
+#include "t2u_packet.h"
+#include "t2u_group.h"
+#include "t2u_steer.h"
+#include "t2u_peer.h"
+#include "t2u_close.h"
 
 
 #endif /* __t2u_internal_h__ */
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <event2/event.h>
+
+#include "t2u.h"
+#include "t2u_internal.h"
+
+#if defined _MSC_VER
+#define snprintf _snprintf
+#define vsnprintf _vsnprintf
+#endif
+
+/* slots in log ring, must be power of 2 */
+#ifndef T2U_LOG_RING_SIZE
+#define T2U_LOG_RING_SIZE (256)
+#endif
+#define T2U_LOG_RING_MASK (T2U_LOG_RING_SIZE - 1)
+
+#define T2U_LOG_MESS_MAX (1024)
+
+/* writer poll interval when ring is empty, ms */
+#define T2U_LOG_IDLE_WAIT (10)
+
+/*
+ * bounded multi-producer single-consumer ring.
+ * seq_ is stored relative to the slot index, so a zeroed ring is ready
+ * for use before the writer is started: slot i is free for position p
+ * when seq_ + i == p, and filled when seq_ + i == p + 1.
+ */
+typedef struct t2u_log_slot_
+{
+    t2u_atomic_t seq_;              /* slot sequence, relative to index */
+    int level_;                     /* log level */
+    time_t ts_;                     /* timestamp */
+    const char *file_;              /* __FILE__ */
+    int line_;                      /* __LINE__ */
+    char mess_[T2U_LOG_MESS_MAX];   /* formatted message, no prefix */
+} t2u_log_slot;
+
+static t2u_log_slot g_log_ring_[T2U_LOG_RING_SIZE];
+static t2u_atomic_t g_log_enqueue_ = 0;     /* next position for producers */
+static unsigned long g_log_dequeue_ = 0;    /* next position, writer thread only */
+static t2u_atomic_t g_log_dropped_ = 0;     /* messages dropped as ring full */
+static t2u_atomic_t g_log_running_ = 0;     /* writer thread running */
+static t2u_atomic_t g_log_refs_ = 0;        /* start/stop reference */
+static t2u_thr_t g_log_thread_;
+
+
+static void log_deliver_(t2u_log_slot *slot)
+{
+    log_callback cb = get_log_func_();
+    char mess_[T2U_LOG_MESS_MAX + 128];
+    char ts[64];
+    struct tm tmp;
+    int n;
+
+    if (!cb)
+    {
+        return;
+    }
+
+#if defined _MSC_VER
+    localtime_s(&tmp, &slot->ts_);
+#else
+    localtime_r(&slot->ts_, &tmp);
+#endif
+    strftime(ts, sizeof(ts), "%y-%m-%d %H:%M:%S", &tmp);
+
+    n = snprintf(mess_, sizeof(mess_) - 1, "[%s] [%s:%d] %s", ts, slot->file_, slot->line_, slot->mess_);
+    if (n < 0 || n > (int)sizeof(mess_) - 2)
+    {
+        n = (int)sizeof(mess_) - 2;
+    }
+
+    if (n == 0 || mess_[n-1] != '\n')
+    {
+        mess_[n++] = '\n';
+    }
+    mess_[n] = '\0';
+
+    cb(slot->level_, mess_);
+}
+
+static void log_format_(t2u_log_slot *slot, int level, const char *file, int line, const char *fmt, va_list args)
+{
+    slot->level_ = level;
+    slot->ts_ = time(NULL);
+    slot->file_ = file;
+    slot->line_ = line;
+
+    vsnprintf(slot->mess_, sizeof(slot->mess_), fmt, args);
+    slot->mess_[sizeof(slot->mess_) - 1] = '\0';
+}
+
+/* drain the ring, return message count delivered */
+static int log_drain_()
+{
+    int n = 0;
+    long dropped;
+
+    for (;;)
+    {
+        unsigned long idx = g_log_dequeue_ & T2U_LOG_RING_MASK;
+        t2u_log_slot *slot = &g_log_ring_[idx];
+        unsigned long seq = (unsigned long)t2u_atomic_load(&slot->seq_) + idx;
+
+        if (seq != g_log_dequeue_ + 1)
+        {
+            /* empty, or producer still formatting */
+            break;
+        }
+
+        log_deliver_(slot);
+
+        /* free the slot for the next round */
+        t2u_atomic_store(&slot->seq_, (long)(g_log_dequeue_ + T2U_LOG_RING_SIZE - idx));
+        g_log_dequeue_++;
+        n++;
+    }
+
+    dropped = t2u_atomic_load(&g_log_dropped_);
+    if (dropped > 0)
+    {
+        t2u_log_slot slot;
+        t2u_atomic_add(&g_log_dropped_, -dropped);
+
+        slot.level_ = 2;
+        slot.ts_ = time(NULL);
+        slot.file_ = __FILE__;
+        slot.line_ = __LINE__;
+        snprintf(slot.mess_, sizeof(slot.mess_), "%ld log messages dropped, log ring full.", dropped);
+        log_deliver_(&slot);
+    }
+
+    return n;
+}
+
+/* log writer thread proc */
+#if defined __GNUC__
+static void* t2u_log_loop_(void *arg)
+#elif defined _MSC_VER
+static DWORD __stdcall t2u_log_loop_(void * arg)
+#endif
+{
+    (void) arg;
+
+    while (t2u_atomic_load(&g_log_running_))
+    {
+        if (0 == log_drain_())
+        {
+            t2u_sleep(T2U_LOG_IDLE_WAIT);
+        }
+    }
+
+    /* flush remains */
+    log_drain_();
+
+#if defined __GNUC__
+    return NULL;
+#elif defined _MSC_VER
+    return 0;
+#endif
+}
+
+void t2u_log_write_(int level, const char *file, int line, const char *fmt, ...)
+{
+    va_list args;
+    unsigned long pos;
+    unsigned long idx;
+    t2u_log_slot *slot;
+
+    if (!t2u_atomic_load(&g_log_running_))
+    {
+        /* no writer, deliver in caller's thread */
+        t2u_log_slot sync_slot;
+
+        va_start(args, fmt);
+        log_format_(&sync_slot, level, file, line, fmt, args);
+        va_end(args);
+
+        log_deliver_(&sync_slot);
+        return;
+    }
+
+    /* claim a slot */
+    for (;;)
+    {
+        long diff;
+
+        pos = (unsigned long)t2u_atomic_load(&g_log_enqueue_);
+        idx = pos & T2U_LOG_RING_MASK;
+        slot = &g_log_ring_[idx];
+        diff = (long)((unsigned long)t2u_atomic_load(&slot->seq_) + idx - pos);
+
+        if (diff == 0)
+        {
+            if (t2u_atomic_cas(&g_log_enqueue_, (long)pos, (long)(pos + 1)))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            /* full, never block the caller */
+            t2u_atomic_add(&g_log_dropped_, 1);
+            return;
+        }
+    }
+
+    va_start(args, fmt);
+    log_format_(slot, level, file, line, fmt, args);
+    va_end(args);
+
+    /* publish */
+    t2u_atomic_store(&slot->seq_, (long)(pos + 1 - idx));
+}
+
+void t2u_log_start()
+{
+    if (t2u_atomic_add(&g_log_refs_, 1) == 1)
+    {
+        t2u_atomic_store(&g_log_running_, 1);
+        if (0 != t2u_thr_create(&g_log_thread_, t2u_log_loop_, NULL))
+        {
+            t2u_atomic_store(&g_log_running_, 0);
+        }
+    }
+}
+
+void t2u_log_stop()
+{
+    if (t2u_atomic_add(&g_log_refs_, -1) == 0)
+    {
+        if (t2u_atomic_load(&g_log_running_))
+        {
+            t2u_atomic_store(&g_log_running_, 0);
+            t2u_thr_join(g_log_thread_);
+        }
+    }
+}
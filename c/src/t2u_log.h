@@ -0,0 +1,21 @@
+#ifndef __t2u_log_h__
+#define __t2u_log_h__
+
+/*
+ * format a log message into the log ring, the writer thread deliver it
+ * to the log callback. if the writer is not running, deliver it directly.
+ */
+#if defined __GNUC__
+void t2u_log_write_(int level, const char *file, int line, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+#else
+void t2u_log_write_(int level, const char *file, int line, const char *fmt, ...);
+#endif
+
+/* start the log writer thread, reference counted */
+void t2u_log_start();
+
+/* stop the log writer thread, flush queued messages at last stop */
+void t2u_log_stop();
+
+#endif /* __t2u_log_h__ */
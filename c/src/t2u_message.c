@@ -12,105 +12,128 @@ static void process_request_timeout_cb_(evutil_socket_t sock, short events, void
     t2u_session *session = ev->session_;
     t2u_context *context = ev->context_;
 
-    if (message->send_retries_++ > context->udp_slide_window_)
+    if (message->send_retries_ >= t2u_rule_uretries(session->rule_))
     {
-        // timeout.
+        /* timeout. the peer is gone, the queue would never drain */
         LOG_(3, "timeout for message: %p, in session: %p", message, session);
-        t2u_delete_connected_session_later(session);
+        t2u_delete_connected_session(session, 0);
     }
     else
     {
         /* readd the timer */
-        struct timeval t;
-        t.tv_sec = context->utimeout_ / 1000;
-        t.tv_usec = (context->utimeout_ % 1000) * 1000;
-        event_add(message->ev_timeout_->event_, &t);
+        message->send_retries_++;
+        t2u_timer_add(ev->runner_, message->ev_timeout_->event_, t2u_rule_utimeout(session->rule_));
         
         /* send mess again */
-        t2u_send_message_data(context, (char *)message->data_, message->len_, session);
+        context->stat_[CTX_STAT_UDP_RETRANS_PACKETS]++;
+        t2u_send_message_packet(context, message->packet_, session);
     }
 }
 
-t2u_message *t2u_add_request_message(t2u_session *session, char *payload, int payload_len)
-{ 
-    t2u_message *message = (t2u_message *)malloc(sizeof(t2u_message));
+/* message of packet into the send queue, with its timeout armed */
+static t2u_message *message_queue_(t2u_session *session, t2u_packet *packet, uint32_t seq, unsigned long retries)
+{
     t2u_rule *rule = session->rule_;
-    t2u_context *context = rule->context_;
+    t2u_runner *runner = rule->context_->runner_;
+    t2u_message *message = (t2u_message *)t2u_slab_alloc(&runner->message_slab_);
 
+    t2u_session_window *window = NULL;
     t2u_event *nev = NULL;
-    struct timeval t;
-    int r = 0;
-
-    message->len_ = sizeof(t2u_message_data) + payload_len;
-    message->data_ = (t2u_message_data *)malloc(message->len_);
-    message->data_->handle_ = hton64(session->handle_);
-    message->data_->magic_ = htonl(T2U_MESS_MAGIC);
-    message->data_->oper_ = htons(data_request);
-    memcpy(message->data_->payload, payload, payload_len);
-    message->data_->seq_ = ntohl(++session->send_seq_);
-    message->data_->version_ = ntohs(1);
 
-    message->send_retries_ = 0;
-    message->seq_ = session->send_seq_;
+    message->packet_ = packet;
+    message->send_retries_ = retries;
+    message->seq_ = seq;
     message->session_ = session;
-    message->ev_timeout_ = (t2u_event *)malloc(sizeof(t2u_event));
+    message->ev_timeout_ = t2u_event_new(runner);
 
     nev = message->ev_timeout_;
-    memset(nev, 0, sizeof(t2u_event));
-
     nev->message_ = message;
     nev->session_ = session;
     nev->rule_ = rule;
-    nev->context_ = context;
-    nev->runner_ = context->runner_;
+    nev->context_ = rule->context_;
     nev->event_ = evtimer_new(nev->runner_->base_, process_request_timeout_cb_, nev);
 
-    t.tv_sec = context->utimeout_ / 1000;
-    t.tv_usec = (context->utimeout_ % 1000) * 1000;
-    r = evtimer_add(nev->event_, &t);
-    assert(r == 0);
+    t2u_timer_add(nev->runner_, nev->event_, t2u_rule_utimeout(rule));
 
-    rbtree_insert(session->send_mess_, &message->seq_, message);
-    session->send_buffer_count_++;
+    window = t2u_session_window_get(session);
+    t2u_message_tree_insert(&window->send_mess_, message);
+    window->send_buffer_count_++;
 
-    t2u_send_message_data(context, (char *)message->data_, message->len_, session);
+    return message;
+}
+
+t2u_message *t2u_add_request_message(t2u_session *session, char *payload, int payload_len)
+{ 
+    t2u_context *context = session->rule_->context_;
+    t2u_message *message = NULL;
+    t2u_packet *packet = NULL;
+    t2u_message_data *mdata = NULL;
+
+    assert(payload_len <= T2U_PAYLOAD_MAX);
+    packet = t2u_budget_packet_alloc(session, sizeof(t2u_message_data) + payload_len);
+    mdata = t2u_packet_mdata(packet);
+    mdata->handle_ = hton64(session->handle_);
+    mdata->magic_ = htonl(T2U_MESS_MAGIC);
+    mdata->oper_ = htons(data_request);
+    memcpy(mdata->payload, payload, payload_len);
+    mdata->seq_ = ntohl(++session->send_seq_);
+    mdata->version_ = ntohs(1);
+
+    message = message_queue_(session, packet, session->send_seq_, 0);
+    t2u_send_message_packet(context, message->packet_, session);
     
     return message;
 }
 
+t2u_message *t2u_restore_request_message(t2u_session *session, uint32_t seq, unsigned long retries,
+    const char *data, size_t len)
+{
+    t2u_packet *packet = t2u_budget_packet_alloc(session, len);
+
+    memcpy(packet->data_, data, len);
+    return message_queue_(session, packet, seq, retries);
+}
+
+void t2u_message_resend(t2u_message *message)
+{
+    t2u_session *session = message->session_;
+    t2u_context *context = session->rule_->context_;
+
+    /* retries so far went to an address the peer left */
+    message->send_retries_ = 0;
+    t2u_timer_add(context->runner_, message->ev_timeout_->event_, t2u_rule_utimeout(session->rule_));
+
+    context->stat_[CTX_STAT_UDP_RETRANS_PACKETS]++;
+    t2u_send_message_packet(context, message->packet_, session);
+}
+
 void t2u_delete_request_message(t2u_message *message)
 {
     t2u_session *session = message->session_;
+    t2u_session_window *window = session->window_;
+    t2u_runner *runner = session->rule_->context_->runner_;
 
     t2u_delete_event(message->ev_timeout_);
     message->ev_timeout_ = NULL;
 
-    free(message->data_);
-    message->data_ = NULL;
+    t2u_budget_packet_free(session, message->packet_);
+    message->packet_ = NULL;
 
     // remove from session
-    if (0 == rbtree_remove(session->send_mess_, &message->seq_))
+    if (window && (t2u_message_tree_find(&window->send_mess_, message->seq_) == message))
     {
-        session->send_buffer_count_--;
+        t2u_message_tree_remove(&window->send_mess_, message);
+        window->send_buffer_count_--;
+        t2u_session_park(session);
 
         // check saved event
-        if (session->ev_)
-        {
-            if (!session->ev_->event_)
-            {
-                session->ev_->event_ = event_new(session->rule_->context_->runner_->base_, session->sock_,
-                    EV_READ | EV_PERSIST, t2u_session_process_tcp, session->ev_);
-
-                event_add(session->ev_->event_, NULL);
-				LOG_(0, "readd event with session: %p, sock: %d", session, session->sock_);
-            }
-        }
-
-        free(message);
+        t2u_session_resume_read(session);
+
+        t2u_slab_free(&runner->message_slab_, message);
     }
     else
     {
-        free(message);
+        t2u_slab_free(&runner->message_slab_, message);
     }
 }
 
@@ -119,7 +142,7 @@ void t2u_message_handle_data_response(t2u_message *message, t2u_message_data *md
     t2u_session *session = message->session_;
 
     int value = ntohl(*((int *)mdata->payload));
-	int valid_length = message->len_ - sizeof(t2u_message_data);
+	int valid_length = message->packet_->len_ - sizeof(t2u_message_data);
 	if (value == valid_length)
     {
         /* success, remove same seq from send_mess_ */
@@ -128,10 +151,15 @@ void t2u_message_handle_data_response(t2u_message *message, t2u_message_data *md
     else if (value >= 0)
     {
         /* block, try later */
-		if (value > 0)
+		if (value > 0 && value < valid_length)
 		{
-			message->len_ -= value;
-			memcpy(message->data_->payload, message->data_->payload + value, sizeof(valid_length - value));
+			/* the delay queue may still hold the sent bytes */
+			t2u_message_data *data;
+
+			message->packet_ = t2u_packet_writable(message->packet_);
+			data = t2u_packet_mdata(message->packet_);
+			memmove(data->payload, data->payload + value, valid_length - value);
+			message->packet_->len_ -= value;
 		}
     }
     else
@@ -151,6 +179,11 @@ void t2u_message_handle_data_response(t2u_message *message, t2u_message_data *md
 
 void t2u_message_handle_retrans_request(t2u_message *message, t2u_message_data *mdata)
 {
-    LOG_(1, "retrans: %lu", message->data_->seq_);
-    t2u_send_message_data(message->session_->rule_->context_, (char *)message->data_, message->len_, message->session_);
+    t2u_context *context = message->session_->rule_->context_;
+
+    (void) mdata;
+
+    LOG_(1, "retrans: %lu", (unsigned long)message->seq_);
+    context->stat_[CTX_STAT_UDP_RETRANS_PACKETS]++;
+    t2u_send_message_packet(context, message->packet_, message->session_);
 }
@@ -4,6 +4,13 @@
 /* add a t2u_message to send queue and do a sent */
 t2u_message *t2u_add_request_message(t2u_session *session, char *payload, int payload_len);
 
+/* put a sent message of a moved session in the send queue, resent on timeout */
+t2u_message *t2u_restore_request_message(t2u_session *session, uint32_t seq, unsigned long retries,
+    const char *data, size_t len);
+
+/* send the message again now, with its retries and timeout reset */
+void t2u_message_resend(t2u_message *message);
+
 /* delete a t2u_message */
 void t2u_delete_request_message(t2u_message *message);
 
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <event2/event.h>
+
+#include "t2u.h"
+#include "t2u_internal.h"
+
+t2u_packet *t2u_packet_new(t2u_runner *runner, size_t len)
+{
+    t2u_packet *packet = (t2u_packet *)t2u_slab_alloc(&runner->packet_slab_);
+
+    assert(NULL != packet);
+    assert(len <= T2U_MESS_BUFFER_MAX);
+
+    packet->runner_ = runner;
+    packet->refs_ = 1;
+    packet->len_ = (uint32_t)len;
+    return packet;
+}
+
+t2u_packet *t2u_packet_copy(t2u_runner *runner, const char *data, size_t len)
+{
+    t2u_packet *packet = t2u_packet_new(runner, len);
+
+    memcpy(packet->data_, data, len);
+    return packet;
+}
+
+t2u_packet *t2u_packet_ref(t2u_packet *packet)
+{
+    assert(packet->refs_ > 0);
+    packet->refs_++;
+    return packet;
+}
+
+void t2u_packet_unref(t2u_packet *packet)
+{
+    if (!packet)
+    {
+        return;
+    }
+
+    assert(packet->refs_ > 0);
+    if (--packet->refs_ == 0)
+    {
+        t2u_slab_free(&packet->runner_->packet_slab_, packet);
+    }
+}
+
+t2u_packet *t2u_packet_writable(t2u_packet *packet)
+{
+    t2u_packet *copy;
+
+    if (packet->refs_ == 1)
+    {
+        return packet;
+    }
+
+    /* bytes already handed out must not change under their users */
+    copy = t2u_packet_copy(packet->runner_, packet->data_, packet->len_);
+    t2u_packet_unref(packet);
+    return copy;
+}
@@ -0,0 +1,28 @@
+#ifndef __t2u_packet_h__
+#define __t2u_packet_h__
+
+/*
+ * refcounted udp message from the runner pool. the send queue, retransmits
+ * and the delay queue share one packet, it goes back to the pool when the
+ * last user drops it. in runner.
+ */
+
+/* the udp message in the packet */
+#define t2u_packet_mdata(p) ((t2u_message_data *)(void *)(p)->data_)
+
+/* new packet of len bytes, not filled, one ref */
+t2u_packet *t2u_packet_new(t2u_runner *runner, size_t len);
+
+/* new packet with a copy of data, one ref */
+t2u_packet *t2u_packet_copy(t2u_runner *runner, const char *data, size_t len);
+
+/* one more user of the packet */
+t2u_packet *t2u_packet_ref(t2u_packet *packet);
+
+/* drop one user, free at the last, NULL is ok */
+void t2u_packet_unref(t2u_packet *packet);
+
+/* packet owned only by the caller, copied if shared. takes the caller's ref */
+t2u_packet *t2u_packet_writable(t2u_packet *packet);
+
+#endif /* __t2u_packet_h__ */
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <event2/event.h>
+
+#include "t2u.h"
+#include "t2u_internal.h"
+
+static uint64_t peer_key_(const struct sockaddr_in *addr)
+{
+    return ((uint64_t)ntohl(addr->sin_addr.s_addr) << 16) | ntohs(addr->sin_port);
+}
+
+t2u_peer *t2u_peer_get(t2u_context *context, const struct sockaddr_in *addr, uint64_t id)
+{
+    uint64_t key = peer_key_(addr);
+    t2u_peer *peer = t2u_peer_tree_find(&context->peers_, key);
+
+    if (peer && (peer->id_ != id))
+    {
+        /* another client has the address now, the old one's sessions keep their peer */
+        LOG_(2, "peer: %p of context: %p replaced at port %d", (void *)peer, (void *)context,
+            ntohs(addr->sin_port));
+        t2u_peer_tree_remove(&context->peers_, peer);
+        peer->indexed_ = 0;
+        if (0 == peer->refs_)
+        {
+            free(peer);
+        }
+        peer = NULL;
+    }
+
+    if (!peer)
+    {
+        peer = (t2u_peer *) malloc(sizeof(t2u_peer));
+        assert(NULL != peer);
+        memset(peer, 0, sizeof(t2u_peer));
+
+        peer->key_ = key;
+        peer->addr_ = *addr;
+        peer->id_ = id;
+        peer->indexed_ = 1;
+        t2u_peer_tree_insert(&context->peers_, peer);
+
+        LOG_(1, "new peer: %p of context: %p", (void *)peer, (void *)context);
+    }
+    return peer;
+}
+
+t2u_peer *t2u_peer_find(t2u_context *context, const struct sockaddr_in *addr)
+{
+    return t2u_peer_tree_find(&context->peers_, peer_key_(addr));
+}
+
+t2u_peer *t2u_peer_ref(t2u_peer *peer)
+{
+    if (peer)
+    {
+        peer->refs_++;
+    }
+    return peer;
+}
+
+void t2u_peer_put(t2u_context *context, t2u_peer *peer)
+{
+    if (peer && (0 == --peer->refs_))
+    {
+        if (peer->indexed_)
+        {
+            t2u_peer_tree_remove(&context->peers_, peer);
+        }
+        LOG_(1, "delete peer: %p of context: %p", (void *)peer, (void *)context);
+        free(peer);
+    }
+}
+
+int t2u_peer_match(const t2u_peer *peer, const struct sockaddr_in *addr)
+{
+    return (peer->addr_.sin_addr.s_addr == addr->sin_addr.s_addr) &&
+        (peer->addr_.sin_port == addr->sin_port);
+}
+
+int t2u_peer_same(const t2u_peer *peer, const t2u_peer *other)
+{
+    return (peer == other) || (peer->id_ && (peer->id_ == other->id_));
+}
+
+void t2u_peer_rebind(t2u_context *context, t2u_peer *peer, const struct sockaddr_in *addr)
+{
+    uint64_t key = peer_key_(addr);
+    t2u_peer *stale;
+
+    if (peer->indexed_)
+    {
+        t2u_peer_tree_remove(&context->peers_, peer);
+    }
+
+    /* the address is the peer's now, sessions left there follow on their own packets */
+    stale = t2u_peer_tree_find(&context->peers_, key);
+    if (stale)
+    {
+        t2u_peer_tree_remove(&context->peers_, stale);
+        stale->indexed_ = 0;
+    }
+
+    LOG_(2, "peer: %p of context: %p moved, port %d -> %d", (void *)peer, (void *)context,
+        ntohs(peer->addr_.sin_port), ntohs(addr->sin_port));
+
+    peer->key_ = key;
+    peer->addr_ = *addr;
+    peer->indexed_ = 1;
+    t2u_peer_tree_insert(&context->peers_, peer);
+
+    context->stat_[CTX_STAT_PEER_REBINDS]++;
+}
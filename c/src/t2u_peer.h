@@ -0,0 +1,35 @@
+#ifndef __t2u_peer_h__
+#define __t2u_peer_h__
+
+/*
+ * remote sites of a server context, see create_forward_server. sessions of
+ * one address share a peer, it is freed with the last of them. a client
+ * sends its random peer id in connect requests, only the id moves the peer
+ * to another address. in runner.
+ */
+
+/* the peer of addr with id in context, new if none or another id. not counted until a session takes it */
+t2u_peer *t2u_peer_get(t2u_context *context, const struct sockaddr_in *addr, uint64_t id);
+
+/* the peer of addr in context, NULL if none */
+t2u_peer *t2u_peer_find(t2u_context *context, const struct sockaddr_in *addr);
+
+/* one more session of the peer, NULL is ok */
+t2u_peer *t2u_peer_ref(t2u_peer *peer);
+
+/* a session of the peer is gone, free at the last. NULL is ok */
+void t2u_peer_put(t2u_context *context, t2u_peer *peer);
+
+/* is addr the address of the peer */
+int t2u_peer_match(const t2u_peer *peer, const struct sockaddr_in *addr);
+
+/* are both the same client, by peer id */
+int t2u_peer_same(const t2u_peer *peer, const t2u_peer *other);
+
+/*
+ * the peer's nat mapping changed, it is at addr now, proven by its id. a
+ * peer left at addr is stale and no longer found by address.
+ */
+void t2u_peer_rebind(t2u_context *context, t2u_peer *peer, const struct sockaddr_in *addr);
+
+#endif /* __t2u_peer_h__ */
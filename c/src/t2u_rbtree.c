@@ -517,3 +517,259 @@ int  rbtree_remove(struct rbtree* tree,void *key)
         __rbtree_remove(node,tree);
     return 0;
 }
+
+
+/******************** intrusive tree ********************/
+
+static void rb_replace_child_(t2u_rb_root *root, t2u_rb_node *parent,
+    t2u_rb_node *old, t2u_rb_node *node)
+{
+    if (!parent)
+        root->node_ = node;
+    else if (parent->left_ == old)
+        parent->left_ = node;
+    else
+        parent->right_ = node;
+}
+
+static void rb_rotate_left_(t2u_rb_root *root, t2u_rb_node *x)
+{
+    t2u_rb_node *y = x->right_;
+
+    x->right_ = y->left_;
+    if (y->left_)
+        y->left_->parent_ = x;
+    y->parent_ = x->parent_;
+    rb_replace_child_(root, x->parent_, x, y);
+    y->left_ = x;
+    x->parent_ = y;
+}
+
+static void rb_rotate_right_(t2u_rb_root *root, t2u_rb_node *x)
+{
+    t2u_rb_node *y = x->left_;
+
+    x->left_ = y->right_;
+    if (y->right_)
+        y->right_->parent_ = x;
+    y->parent_ = x->parent_;
+    rb_replace_child_(root, x->parent_, x, y);
+    y->right_ = x;
+    x->parent_ = y;
+}
+
+#define rb_is_red_(n) ((n) && (n)->red_)
+
+void t2u_rb_insert_fixup(t2u_rb_root *root, t2u_rb_node *node)
+{
+    t2u_rb_node *parent;
+
+    while ((parent = node->parent_) && parent->red_)
+    {
+        t2u_rb_node *gparent = parent->parent_;
+
+        if (parent == gparent->left_)
+        {
+            t2u_rb_node *uncle = gparent->right_;
+            if (rb_is_red_(uncle))
+            {
+                uncle->red_ = 0;
+                parent->red_ = 0;
+                gparent->red_ = 1;
+                node = gparent;
+                continue;
+            }
+            if (parent->right_ == node)
+            {
+                rb_rotate_left_(root, parent);
+                parent = node;
+            }
+            parent->red_ = 0;
+            gparent->red_ = 1;
+            rb_rotate_right_(root, gparent);
+            break;
+        }
+        else
+        {
+            t2u_rb_node *uncle = gparent->left_;
+            if (rb_is_red_(uncle))
+            {
+                uncle->red_ = 0;
+                parent->red_ = 0;
+                gparent->red_ = 1;
+                node = gparent;
+                continue;
+            }
+            if (parent->left_ == node)
+            {
+                rb_rotate_right_(root, parent);
+                parent = node;
+            }
+            parent->red_ = 0;
+            gparent->red_ = 1;
+            rb_rotate_left_(root, gparent);
+            break;
+        }
+    }
+
+    root->node_->red_ = 0;
+}
+
+/* x took the place of a removed black node, x may be NULL */
+static void rb_erase_fixup_(t2u_rb_root *root, t2u_rb_node *x, t2u_rb_node *parent)
+{
+    while (x != root->node_ && !rb_is_red_(x))
+    {
+        if (x == parent->left_)
+        {
+            t2u_rb_node *w = parent->right_;
+            if (w->red_)
+            {
+                w->red_ = 0;
+                parent->red_ = 1;
+                rb_rotate_left_(root, parent);
+                w = parent->right_;
+            }
+            if (!rb_is_red_(w->left_) && !rb_is_red_(w->right_))
+            {
+                w->red_ = 1;
+                x = parent;
+                parent = x->parent_;
+            }
+            else
+            {
+                if (!rb_is_red_(w->right_))
+                {
+                    w->left_->red_ = 0;
+                    w->red_ = 1;
+                    rb_rotate_right_(root, w);
+                    w = parent->right_;
+                }
+                w->red_ = parent->red_;
+                parent->red_ = 0;
+                w->right_->red_ = 0;
+                rb_rotate_left_(root, parent);
+                x = root->node_;
+                break;
+            }
+        }
+        else
+        {
+            t2u_rb_node *w = parent->left_;
+            if (w->red_)
+            {
+                w->red_ = 0;
+                parent->red_ = 1;
+                rb_rotate_right_(root, parent);
+                w = parent->left_;
+            }
+            if (!rb_is_red_(w->left_) && !rb_is_red_(w->right_))
+            {
+                w->red_ = 1;
+                x = parent;
+                parent = x->parent_;
+            }
+            else
+            {
+                if (!rb_is_red_(w->left_))
+                {
+                    w->right_->red_ = 0;
+                    w->red_ = 1;
+                    rb_rotate_left_(root, w);
+                    w = parent->left_;
+                }
+                w->red_ = parent->red_;
+                parent->red_ = 0;
+                w->left_->red_ = 0;
+                rb_rotate_right_(root, parent);
+                x = root->node_;
+                break;
+            }
+        }
+    }
+
+    if (x)
+        x->red_ = 0;
+}
+
+/* nodes are relinked, never copied, so owners stay where they are */
+void t2u_rb_erase(t2u_rb_root *root, t2u_rb_node *node)
+{
+    t2u_rb_node *child;
+    t2u_rb_node *parent;
+    int red;
+
+    if (node->left_ && node->right_)
+    {
+        /* the successor takes the place of node */
+        t2u_rb_node *next = node->right_;
+        while (next->left_)
+            next = next->left_;
+
+        child = next->right_;
+        parent = next->parent_;
+        red = next->red_;
+
+        if (parent == node)
+        {
+            parent = next;
+        }
+        else
+        {
+            if (child)
+                child->parent_ = parent;
+            parent->left_ = child;
+            next->right_ = node->right_;
+            node->right_->parent_ = next;
+        }
+
+        next->parent_ = node->parent_;
+        next->left_ = node->left_;
+        next->red_ = node->red_;
+        node->left_->parent_ = next;
+        rb_replace_child_(root, node->parent_, node, next);
+    }
+    else
+    {
+        child = node->left_ ? node->left_ : node->right_;
+        parent = node->parent_;
+        red = node->red_;
+
+        if (child)
+            child->parent_ = parent;
+        rb_replace_child_(root, parent, node, child);
+    }
+
+    if (!red)
+        rb_erase_fixup_(root, child, parent);
+
+    node->parent_ = node->left_ = node->right_ = NULL;
+}
+
+t2u_rb_node *t2u_rb_first(const t2u_rb_root *root)
+{
+    t2u_rb_node *n = root->node_;
+
+    if (!n)
+        return NULL;
+    while (n->left_)
+        n = n->left_;
+    return n;
+}
+
+t2u_rb_node *t2u_rb_next(const t2u_rb_node *node)
+{
+    t2u_rb_node *parent;
+
+    if (node->right_)
+    {
+        node = node->right_;
+        while (node->left_)
+            node = node->left_;
+        return (t2u_rb_node *)node;
+    }
+
+    while ((parent = node->parent_) && node == parent->right_)
+        node = parent;
+    return parent;
+}
@@ -1,6 +1,9 @@
 #ifndef __t2u_rbtree_h__
 #define __t2u_rbtree_h__
 
+#include <stddef.h>
+#include <string.h>
+
 enum rb_color
 {
     RB_BLACK,
@@ -29,5 +32,104 @@ struct rbtree* rbtree_init(rbtree_cmp_proc fn);
 int rbtree_insert(struct rbtree *tree, void *key, void *data);
 void* rbtree_lookup(struct rbtree *tree,void *key);
 int rbtree_remove(struct rbtree *tree, void *key);
+struct rbtree_node* rbtree_min(struct rbtree *tree);
+
+
+/*
+ * intrusive tree. the node is embedded in the owner struct, so insert and
+ * remove never allocate. typed functions with inline comparators are
+ * generated by T2U_RB_GENERATE.
+ */
+typedef struct t2u_rb_node_
+{
+    struct t2u_rb_node_ *parent_;
+    struct t2u_rb_node_ *left_;
+    struct t2u_rb_node_ *right_;
+    int red_;
+} t2u_rb_node;
+
+typedef struct t2u_rb_root_
+{
+    t2u_rb_node *node_;
+} t2u_rb_root;
+
+#if defined _MSC_VER
+#define T2U_RB_INLINE static __inline
+#else
+#define T2U_RB_INLINE static __inline__
+#endif
+
+#define t2u_rb_entry(ptr, type, field) ((type *)((char *)(ptr) - offsetof(type, field)))
+#define t2u_rb_empty(root) ((root)->node_ == NULL)
+
+/* rebalance after the node is linked as a red leaf */
+void t2u_rb_insert_fixup(t2u_rb_root *root, t2u_rb_node *node);
+
+/* unlink the node */
+void t2u_rb_erase(t2u_rb_root *root, t2u_rb_node *node);
+
+/* in order walk */
+t2u_rb_node *t2u_rb_first(const t2u_rb_root *root);
+t2u_rb_node *t2u_rb_next(const t2u_rb_node *node);
+
+#define T2U_RB_CMP_NUM(a, b) (((a) > (b)) - ((a) < (b)))
+#define T2U_RB_CMP_STR(a, b) strcmp((a), (b))
+
+/*
+ * name##_find(root, key), name##_insert(root, elm), name##_remove(root, elm),
+ * name##_first(root), name##_next(elm), for type keyed by type.key.
+ * insert returns -1 and links nothing if the key exists.
+ */
+#define T2U_RB_GENERATE(name, type, field, key, key_type, cmp)                  \
+T2U_RB_INLINE type *name##_find(const t2u_rb_root *root, key_type k)            \
+{                                                                               \
+    t2u_rb_node *n = root->node_;                                               \
+    while (n)                                                                   \
+    {                                                                           \
+        int c = cmp(k, t2u_rb_entry(n, type, field)->key);                      \
+        if (c == 0)                                                             \
+        {                                                                       \
+            return t2u_rb_entry(n, type, field);                                \
+        }                                                                       \
+        n = (c < 0) ? n->left_ : n->right_;                                     \
+    }                                                                           \
+    return NULL;                                                                \
+}                                                                               \
+T2U_RB_INLINE int name##_insert(t2u_rb_root *root, type *elm)                   \
+{                                                                               \
+    t2u_rb_node **link = &root->node_;                                          \
+    t2u_rb_node *parent = NULL;                                                 \
+    while (*link)                                                               \
+    {                                                                           \
+        int c = cmp(elm->key, t2u_rb_entry(*link, type, field)->key);           \
+        if (c == 0)                                                             \
+        {                                                                       \
+            return -1;                                                          \
+        }                                                                       \
+        parent = *link;                                                         \
+        link = (c < 0) ? &parent->left_ : &parent->right_;                      \
+    }                                                                           \
+    elm->field.parent_ = parent;                                                \
+    elm->field.left_ = NULL;                                                    \
+    elm->field.right_ = NULL;                                                   \
+    elm->field.red_ = 1;                                                        \
+    *link = &elm->field;                                                        \
+    t2u_rb_insert_fixup(root, &elm->field);                                     \
+    return 0;                                                                   \
+}                                                                               \
+T2U_RB_INLINE void name##_remove(t2u_rb_root *root, type *elm)                  \
+{                                                                               \
+    t2u_rb_erase(root, &elm->field);                                            \
+}                                                                               \
+T2U_RB_INLINE type *name##_first(const t2u_rb_root *root)                       \
+{                                                                               \
+    t2u_rb_node *n = t2u_rb_first(root);                                        \
+    return n ? t2u_rb_entry(n, type, field) : NULL;                             \
+}                                                                               \
+T2U_RB_INLINE type *name##_next(type *elm)                                      \
+{                                                                               \
+    t2u_rb_node *n = t2u_rb_next(&elm->field);                                  \
+    return n ? t2u_rb_entry(n, type, field) : NULL;                             \
+}
 
 #endif /* __t2u_rbtree_h__ */
@@ -9,6 +9,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #endif
 
@@ -16,38 +17,35 @@
 #include "t2u_internal.h"
 
 
-static int compare_uint64_ptr(void *a, void *b)
+/*
+ * session tcp socket: nonblock. in sim mode also no nagle, its timers and
+ * delayed acks tick in real time and would leak wall time into the run.
+ */
+static void rule_setup_socket_(t2u_rule *rule, sock_t s)
 {
-    uint64_t *sa = (uint64_t *)a;
-    uint64_t *sb = (uint64_t *)b;
+    int one = 1;
 
-    if (*sa > *sb)
-    {
-        return 1;
-    }
-    
-    if (*sa < *sb)
+    evutil_make_socket_nonblocking(s);
+    if (rule->context_->runner_->sim_)
     {
-        return -1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (void *)&one, sizeof(one));
     }
-
-    return 0;
 }
 
-void t2u_rule_handle_connect_request(t2u_rule *rule, t2u_message_data *mdata)
+void t2u_rule_handle_connect_request(t2u_rule *rule, t2u_message_data *mdata, const struct sockaddr_in *from, uint64_t id)
 {
     uint64_t handle = mdata->handle_;
     t2u_session *session = NULL;
     t2u_session *oldsession = NULL;
 
-    oldsession = (t2u_session *)rbtree_lookup(rule->sessions_, &handle);
+    oldsession = t2u_session_tree_find(&rule->sessions_, handle);
     if (oldsession)
     {
         LOG_(2, "delete old session:%p", oldsession);
         t2u_delete_connected_session(oldsession, 0);
     }
 
-    oldsession = (t2u_session *)rbtree_lookup(rule->connecting_sessions_, &handle);
+    oldsession = t2u_session_tree_find(&rule->connecting_sessions_, handle);
     if (oldsession)
     {
         LOG_(2, "delete old session:%p", oldsession);
@@ -62,11 +60,11 @@ void t2u_rule_handle_connect_request(t2u_rule *rule, t2u_message_data *mdata)
         return;
     }
 
-    /* unblocking */
-    evutil_make_socket_nonblocking(s);
+    rule_setup_socket_(rule, s);
 
-    /* new session */
-    session = t2u_add_connecting_session(rule, s, handle);
+    /* new session, of the sender if the context serves many */
+    session = t2u_add_connecting_session(rule, s, handle,
+        (rule->context_->multi_peer_ && from) ? t2u_peer_get(rule->context_, from, id) : NULL);
     assert(NULL != session);
 }
 
@@ -80,64 +78,87 @@ static void rule_process_accept_cb_(evutil_socket_t sock, short events, void *ar
     t2u_rule *rule = ev->rule_;
     t2u_session *session;
 
+    (void)sock;
+    (void)events;
+
+    /* memory budget is tight, the listen event waits for buffers released */
+    if (!t2u_budget_accept(rule))
+    {
+        return;
+    }
+
     sock_t s = accept(rule->listen_sock_, (struct sockaddr *)&client_addr, &client_len);
     if (s < 0)
     {
         return;
     }
 
-    /* nonblock */
-    evutil_make_socket_nonblocking(s);
+    rule_setup_socket_(rule, s);
 
-    session = t2u_add_connecting_session(rule, s, 0);
+    session = t2u_add_connecting_session(rule, s, 0, NULL);
     assert(NULL != session);
 }
 
 
-static void add_rule_cb_(t2u_runner *runner, void *arg)
+/* rules of one add or delete, applied in one runner callback */
+typedef struct rule_batch_
 {
-    t2u_rule *rule = (t2u_rule *)arg;
-    t2u_context *context = (t2u_context *) rule->context_;
-
-    if (rule->mode_ == forward_client_mode)
-    {
-        rule->ev_listen_ = (t2u_event *)malloc(sizeof(t2u_event));
-        assert(NULL != rule->ev_listen_);
-
-        memset(rule->ev_listen_, 0, sizeof(t2u_event));
-
-        rule->ev_listen_->runner_ = runner;
-        rule->ev_listen_->context_ = rule->context_;
-        rule->ev_listen_->rule_ = rule;
+    t2u_rule **rules_;
+    size_t count_;
+} rule_batch;
 
-        rule->ev_listen_->event_ = event_new(runner->base_, rule->listen_sock_,
-            EV_READ | EV_PERSIST, rule_process_accept_cb_, rule->ev_listen_);
-        assert(NULL != rule->ev_listen_->event_);
+static void rule_error_(t2u_context *context, int code, const char *service, const char *what)
+{
+    error_callback ec = get_error_func_();
+    char mess[256];
 
-        event_add(rule->ev_listen_->event_, NULL);
-		LOG_(0, "add event for rule listen, rule: %p, sock: %d", rule, rule->listen_sock_);
+    LOG_(3, "%s, rule: %s", what, service);
+    if (ec)
+    {
+        snprintf(mess, sizeof(mess), "%s, rule: %s", what, service);
+        ec((forward_context)context, NULL, code, mess);
     }
+}
 
-    rbtree_insert(context->rules_, rule->service_, rule);
+static void rule_free_(t2u_rule *rule)
+{
+    if (forward_client_mode == rule->mode_)
+    {
+        closesocket(rule->listen_sock_);
+    }
+    free(rule->service_);
+    free(rule);
 }
 
-t2u_rule *t2u_add_rule(t2u_context *context, forward_mode mode, const char *service, const char *addr, unsigned short port)
+/* the rule and its listen socket, in caller's thread. NULL if failed */
+static t2u_rule *rule_new_(t2u_context *context, const rule_spec *spec)
 {
     int reuse = 1;
     struct sockaddr_in listen_addr;
     t2u_rule *rule = (t2u_rule *) malloc(sizeof(t2u_rule));
-    control_data cdata;
+    forward_mode mode = spec->mode;
+    const char *addr = spec->addr;
+    unsigned short port = spec->port;
 
     assert (NULL != rule);
     memset(rule, 0, sizeof(t2u_rule));
 
+    if ((mode == forward_client_mode) && context->multi_peer_)
+    {
+        /* a client session has no peer to send to */
+        rule_error_(context, T2U_ERR_MODE, spec->service, "client rule in a server context");
+
+        free(rule);
+        return NULL;
+    }
+
     if (mode == forward_client_mode)
     {
         /* try listen on addr, port */
         rule->listen_sock_ = socket(AF_INET, SOCK_STREAM, 0);
         if (-1 == rule->listen_sock_)
         {
-            LOG_(3, "create socket failed");
+            rule_error_(context, T2U_ERR_SOCKET, spec->service, "create socket failed");
 
             free(rule);
             return NULL;
@@ -146,6 +167,13 @@ t2u_rule *t2u_add_rule(t2u_context *context, forward_mode mode, const char *serv
         /* set socket nonblock */
         evutil_make_socket_nonblocking(rule->listen_sock_);
         setsockopt(rule->listen_sock_, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(reuse));
+#ifdef SO_REUSEPORT
+        /* shards of a group listen on the same port, the kernel spreads accepts */
+        if (context->group_)
+        {
+            setsockopt(rule->listen_sock_, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(reuse));
+        }
+#endif
 
         /* listen the socket */
         listen_addr.sin_family = AF_INET;
@@ -163,7 +191,7 @@ t2u_rule *t2u_add_rule(t2u_context *context, forward_mode mode, const char *serv
         {
             closesocket(rule->listen_sock_);
 
-            LOG_(3, "bind socket failed");
+            rule_error_(context, T2U_ERR_BIND, spec->service, "bind socket failed");
             free(rule);
             return NULL;
         }
@@ -172,7 +200,7 @@ t2u_rule *t2u_add_rule(t2u_context *context, forward_mode mode, const char *serv
         {
             closesocket(rule->listen_sock_);
             
-            LOG_(3, "listen socket failed");
+            rule_error_(context, T2U_ERR_LISTEN, spec->service, "listen socket failed");
             free(rule);
             return NULL;
         }
@@ -193,90 +221,324 @@ t2u_rule *t2u_add_rule(t2u_context *context, forward_mode mode, const char *serv
     }
 
     rule->mode_ = mode;
-    rule->service_ = malloc (strlen (service) + 1);
+    rule->service_ = malloc (strlen (spec->service) + 1);
     assert (NULL != rule->service_);
 
 #ifdef _MSC_VER
-    strcpy_s(rule->service_, strlen(service)+1, service);
+    strcpy_s(rule->service_, strlen(spec->service)+1, spec->service);
 #else
-    strcpy(rule->service_, service);
+    strcpy(rule->service_, spec->service);
 #endif
 
     rule->context_ = context;
-    rule->sessions_ = rbtree_init(compare_uint64_ptr);
-    rule->connecting_sessions_ = rbtree_init(compare_uint64_ptr); 
 
-    cdata.func_ = add_rule_cb_;
-    cdata.arg_ = rule;
+    LOG_(1, "create new rule %p, name: %s, addr: %s, port: %u", rule, rule->service_, addr, port);
+    return rule;
+}
 
+static void add_rules_cb_(t2u_runner *runner, void *arg)
+{
+    rule_batch *batch = (rule_batch *)arg;
+    size_t i;
 
-    LOG_(1, "create new rule %p, name: %s, addr: %s, port: %u", rule, rule->service_, addr, port);
+    for (i = 0; i < batch->count_; i++)
+    {
+        t2u_rule *rule = batch->rules_[i];
+        t2u_context *context;
+
+        if (!rule)
+        {
+            continue;
+        }
+
+        /* a duplicated name is handed back to the caller, not linked */
+        context = rule->context_;
+        if (0 != t2u_rule_tree_insert(&context->rules_, rule))
+        {
+            LOG_(3, "rule %p, name: %s already exists in context: %p", rule, rule->service_, context);
+            rule->context_ = NULL;
+            continue;
+        }
+
+        if (rule->mode_ == forward_client_mode)
+        {
+            rule->ev_listen_ = t2u_event_new(runner);
+            rule->ev_listen_->context_ = rule->context_;
+            rule->ev_listen_->rule_ = rule;
+
+            rule->ev_listen_->event_ = event_new(runner->base_, rule->listen_sock_,
+                EV_READ | EV_PERSIST, rule_process_accept_cb_, rule->ev_listen_);
+            assert(NULL != rule->ev_listen_->event_);
+
+            event_add(rule->ev_listen_->event_, NULL);
+            LOG_(0, "add event for rule listen, rule: %p, sock: %d", rule, rule->listen_sock_);
+        }
+    }
+}
+
+size_t t2u_add_rules(t2u_context *context, const rule_spec *specs, size_t count, t2u_rule **rules)
+{
+    rule_batch batch;
+    control_data cdata;
+    size_t added = 0;
+    size_t i;
+    t2u_rule **out = rules;
+
+    if (count == 0)
+    {
+        return 0;
+    }
 
+    /* the batch needs the rules, also when the caller doesn't */
+    if (!out)
+    {
+        rules = (t2u_rule **) malloc(count * sizeof(t2u_rule *));
+        assert(NULL != rules);
+    }
+
+    /* sockets in caller, so the runner only links the rules */
+    for (i = 0; i < count; i++)
+    {
+        rules[i] = rule_new_(context, &specs[i]);
+    }
+
+    batch.rules_ = rules;
+    batch.count_ = count;
+    cdata.func_ = add_rules_cb_;
+    cdata.arg_ = &batch;
     t2u_runner_control(context->runner_, &cdata);
 
+    for (i = 0; i < count; i++)
+    {
+        if (rules[i] && !rules[i]->context_)
+        {
+            rule_free_(rules[i]);
+            rules[i] = NULL;
+            rule_error_(context, T2U_ERR_DUPLICATE, specs[i].service, "service already exists");
+        }
+        else if (rules[i])
+        {
+            added++;
+        }
+    }
+
+    if (!out)
+    {
+        free(rules);
+    }
+    return added;
+}
+
+/* async add or delete, done is called in runner */
+typedef struct rule_async_
+{
+    t2u_context *context_;
+    t2u_rule *rule_;                /* NULL if the sockets failed */
+    forward_done done_;
+    void *arg_;
+} rule_async;
+
+static void add_rule_async_cb_(t2u_runner *runner, void *arg)
+{
+    rule_async *ra = (rule_async *)arg;
+    t2u_rule *rule = ra->rule_;
+
+    if (rule)
+    {
+        rule_batch batch;
+
+        batch.rules_ = &rule;
+        batch.count_ = 1;
+        add_rules_cb_(runner, &batch);
+
+        if (!rule->context_)
+        {
+            rule_error_(ra->context_, T2U_ERR_DUPLICATE, rule->service_, "service already exists");
+            rule_free_(rule);
+            rule = NULL;
+        }
+    }
+
+    if (ra->done_)
+    {
+        ra->done_(rule, ra->arg_);
+    }
+    free(ra);
+}
+
+void t2u_add_rule_async(t2u_context *context, const rule_spec *spec, forward_done done, void *arg)
+{
+    control_data cdata;
+    rule_async *ra = (rule_async *) malloc(sizeof(rule_async));
+    assert(NULL != ra);
+
+    /* done is called in runner also when the sockets failed */
+    ra->context_ = context;
+    ra->rule_ = rule_new_(context, spec);
+    ra->done_ = done;
+    ra->arg_ = arg;
+
+    cdata.func_ = add_rule_async_cb_;
+    cdata.arg_ = ra;
+    t2u_runner_post(context->runner_, &cdata);
+}
+
+t2u_rule *t2u_add_rule(t2u_context *context, forward_mode mode, const char *service, const char *addr, unsigned short port)
+{
+    rule_spec spec;
+    t2u_rule *rule = NULL;
+
+    spec.mode = mode;
+    spec.service = service;
+    spec.addr = addr;
+    spec.port = port;
+
+    t2u_add_rules(context, &spec, 1, &rule);
     return rule;
 }
 
 
-void delete_rule_cb_(t2u_runner *runner, void *arg)
+static void delete_rule_(t2u_rule *rule)
 {
-    t2u_rule *rule = (t2u_rule*)arg;
     t2u_context *context = rule->context_;
 	
 	/* remove the events */
 	t2u_delete_event(rule->ev_listen_);
 	rule->ev_listen_ = NULL;
 
-    if (forward_client_mode == rule->mode_)
-    {
-        closesocket(rule->listen_sock_);
-    }
-
     /* remove sessions */
-    while (rule->sessions_->root)
+    while (!t2u_rb_empty(&rule->sessions_))
     {
-        rbtree_node *node = rule->sessions_->root;
-        void *remove = node->data;
-        
-        t2u_delete_connected_session(remove, 0);
+        t2u_delete_connected_session(t2u_session_tree_first(&rule->sessions_), 0);
     }
 
     /* remove sessions */
-    while (rule->connecting_sessions_->root)
+    while (!t2u_rb_empty(&rule->connecting_sessions_))
     {
-        rbtree_node *node = rule->connecting_sessions_->root;
-        void *remove = node->data;
-        
-        t2u_delete_connecting_session(remove);
+        t2u_delete_connecting_session(t2u_session_tree_first(&rule->connecting_sessions_));
     }
-    
-    /* remove the tree */
-    free(rule->sessions_);
-    rule->sessions_ = NULL;
 
-    free(rule->connecting_sessions_);
-    rule->connecting_sessions_ = NULL;
+    /* idle sweep timer */
+    t2u_session_idle_cleanup(rule);
 
-    /* remove from context */
-    rbtree_remove(context->rules_, rule->service_);
+    t2u_rule_tree_remove(&context->rules_, rule);
 
     LOG_(1, "delete the rule %p, name: %s from context: %p", 
         rule, rule->service_, context);
 
-    free(rule->service_);
-    free(rule);
+    rule_free_(rule);
 }
 
+static void delete_rules_cb_(t2u_runner *runner, void *arg)
+{
+    rule_batch *batch = (rule_batch *)arg;
+    size_t i;
+
+    (void) runner;
+
+    for (i = 0; i < batch->count_; i++)
+    {
+        if (batch->rules_[i])
+        {
+            delete_rule_(batch->rules_[i]);
+        }
+    }
+}
+
+void t2u_delete_rules(t2u_rule **rules, size_t count)
+{
+    size_t i = 0;
+
+    /* one round trip for each run of rules on the same runner */
+    while (i < count)
+    {
+        rule_batch batch;
+        control_data cdata;
+        t2u_runner *runner;
+
+        if (!rules[i])
+        {
+            i++;
+            continue;
+        }
+
+        runner = rules[i]->context_->runner_;
+        batch.rules_ = &rules[i];
+        batch.count_ = 1;
+        while ((i + batch.count_ < count) &&
+            (!rules[i + batch.count_] || rules[i + batch.count_]->context_->runner_ == runner))
+        {
+            batch.count_++;
+        }
+
+        memset(&cdata, 0, sizeof(cdata));
+        cdata.func_ = delete_rules_cb_;
+        cdata.arg_ = &batch;
+        t2u_runner_control(runner, &cdata);
+
+        i += batch.count_;
+    }
+}
 
 void t2u_delete_rule(t2u_rule *rule)
+{
+    t2u_delete_rules(&rule, 1);
+}
+
+static void delete_rule_async_cb_(t2u_runner *runner, void *arg)
+{
+    rule_async *ra = (rule_async *)arg;
+
+    (void) runner;
+
+    delete_rule_(ra->rule_);
+    if (ra->done_)
+    {
+        ra->done_(ra->rule_, ra->arg_);
+    }
+    free(ra);
+}
+
+void t2u_delete_rule_async(t2u_rule *rule, forward_done done, void *arg)
 {
     control_data cdata;
-    memset(&cdata, 0, sizeof(cdata));
+    rule_async *ra = (rule_async *) malloc(sizeof(rule_async));
+    assert(NULL != ra);
+
+    ra->context_ = rule->context_;
+    ra->rule_ = rule;
+    ra->done_ = done;
+    ra->arg_ = arg;
+
+    cdata.func_ = delete_rule_async_cb_;
+    cdata.arg_ = ra;
+    t2u_runner_post(rule->context_->runner_, &cdata);
+}
 
-    cdata.func_ = delete_rule_cb_;
-    cdata.arg_ = rule;
-    t2u_runner_control(rule->context_->runner_, &cdata);
-    return;
+const struct timeval *t2u_rule_utimeout(t2u_rule *rule)
+{
+    t2u_context *context = rule->context_;
+
+    if (rule->utimeout_)
+    {
+        return t2u_runner_timeout(context->runner_, &rule->utimeout_timer_, rule->utimeout_);
+    }
+    return t2u_runner_timeout(context->runner_, &context->utimeout_timer_, context->utimeout_);
+}
+
+unsigned long t2u_rule_uretries(t2u_rule *rule)
+{
+    return rule->uretries_ ? rule->uretries_ : rule->context_->uretries_;
+}
+
+unsigned long t2u_rule_slide_window(t2u_rule *rule)
+{
+    return rule->udp_slide_window_ ? rule->udp_slide_window_ : rule->context_->udp_slide_window_;
+}
+
+unsigned long t2u_rule_session_timeout(t2u_rule *rule)
+{
+    return rule->session_timeout_ ? rule->session_timeout_ : rule->context_->session_timeout_;
 }
 
 
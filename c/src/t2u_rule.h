@@ -5,11 +5,29 @@
 t2u_rule *t2u_add_rule(t2u_context *context, forward_mode mode, 
                        const char *service, const char *addr, unsigned short port);
 
+/* add rules in one runner callback, rules[i] is NULL if specs[i] failed, rules may be NULL. return count added */
+size_t t2u_add_rules(t2u_context *context, const rule_spec *specs, size_t count, t2u_rule **rules);
+
+/* add a rule without waiting, done gets the rule or NULL in runner */
+void t2u_add_rule_async(t2u_context *context, const rule_spec *spec, forward_done done, void *arg);
+
 /* delete a rule */
 void t2u_delete_rule(t2u_rule *rule);
 
-/* handle connect request in t2u data (udp) */
-void t2u_rule_handle_connect_request(t2u_rule *rule, t2u_message_data *mdata);
+/* delete a rule without waiting, done is called in runner after it */
+void t2u_delete_rule_async(t2u_rule *rule, forward_done done, void *arg);
+
+/* delete rules, one runner callback for rules of the same runner. NULL is skipped */
+void t2u_delete_rules(t2u_rule **rules, size_t count);
+
+/* handle connect request in t2u data (udp), id is the sender's peer id */
+void t2u_rule_handle_connect_request(t2u_rule *rule, t2u_message_data *mdata, const struct sockaddr_in *from, uint64_t id);
+
+/* options of the rule, the context's unless overridden. in runner */
+const struct timeval *t2u_rule_utimeout(t2u_rule *rule);
+unsigned long t2u_rule_uretries(t2u_rule *rule);
+unsigned long t2u_rule_slide_window(t2u_rule *rule);
+unsigned long t2u_rule_session_timeout(t2u_rule *rule);
 
 
 #endif /* __t2u_rule_h__ */
\ No newline at end of file
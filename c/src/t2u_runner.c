@@ -37,8 +37,18 @@
 #endif
 {
     t2u_runner *runner = (t2u_runner *)arg;
+    int err;
+
     runner->tid_ = t2u_thr_self();
 
+    /* pinned and named before any work, a failed priority is not fatal */
+    err = t2u_thr_setup(&runner->attr_);
+    if (err)
+    {
+        LOG_(2, "setup runner thread: %p, name: %s, cpus: %llx, priority: %d, error: %d",
+            (void *)runner, runner->attr_.name_, runner->attr_.cpus_, runner->attr_.priority_, err);
+    }
+
     t2u_mutex_lock(&runner->mutex_);
     t2u_cond_signal(&runner->cond_);
     t2u_mutex_unlock(&runner->mutex_);
@@ -56,6 +66,13 @@
 #endif
 }
 
+/* a call queued by t2u_runner_post */
+typedef struct t2u_post_
+{
+    control_data cdata_;
+    struct t2u_post_ *next_;
+} t2u_post;
+
 static void t2u_runner_control_process(t2u_runner *runner, control_data *cdata)
 {
     (void) runner;
@@ -63,6 +80,38 @@ static void t2u_runner_control_process(t2u_runner *runner, control_data *cdata)
     cdata->func_(runner, cdata->arg_);
 }
 
+/*
+ * run the posted calls, in runner. one at a time off the queue, so a call
+ * made by a posted call drains the rest first and the order is kept.
+ */
+static void runner_drain_posts_(t2u_runner *runner)
+{
+    t2u_post *post;
+
+    for (;;)
+    {
+        t2u_mutex_lock(&runner->post_mutex_);
+        post = runner->post_head_;
+        if (post)
+        {
+            runner->post_head_ = post->next_;
+            if (!runner->post_head_)
+            {
+                runner->post_tail_ = NULL;
+            }
+        }
+        t2u_mutex_unlock(&runner->post_mutex_);
+
+        if (!post)
+        {
+            break;
+        }
+
+        t2u_runner_control_process(runner, &post->cdata_);
+        free(post);
+    }
+}
+
 static void runner_control_cb_(evutil_socket_t sock, short events, void *arg)
 {
 
@@ -81,6 +130,13 @@ static void runner_control_cb_(evutil_socket_t sock, short events, void *arg)
         /* todo: error */
     }
 
+    /* wake up for posted calls, nobody waits for a reply */
+    if (NULL == cdata.func_)
+    {
+        runner_drain_posts_(runner);
+        return;
+    }
+
     t2u_runner_control_process(runner, &cdata);
 
     /* send back message. */
@@ -92,11 +148,16 @@ void t2u_runner_control(t2u_runner *runner, control_data *cdata)
 {
     if (t2u_thr_self() == runner->tid_)
     {
+        /* posted before, run first */
+        runner_drain_posts_(runner);
         t2u_runner_control_process(runner, cdata);
     }
     else
     {
         int len; 
+
+        /* a local runner has no control socket, only its thread may call */
+        assert(!runner->local_);
         t2u_mutex_lock(&runner->mutex_);
         
         send(runner->sock_[1], (char *) cdata, sizeof(control_data), 0);
@@ -113,12 +174,56 @@ void t2u_runner_control(t2u_runner *runner, control_data *cdata)
     }
 }
 
-t2u_event *t2u_event_new()
+void t2u_runner_post(t2u_runner *runner, control_data *cdata)
+{
+    t2u_post *post;
+    int wake;
+
+    /* direct call in runner, or without runner thread, after the calls posted before */
+    if (runner->local_ || (t2u_thr_self() == runner->tid_))
+    {
+        runner_drain_posts_(runner);
+        t2u_runner_control_process(runner, cdata);
+        return;
+    }
+
+    post = (t2u_post *) malloc(sizeof(t2u_post));
+    assert(NULL != post);
+    post->cdata_ = *cdata;
+    post->next_ = NULL;
+
+    t2u_mutex_lock(&runner->post_mutex_);
+    wake = (NULL == runner->post_head_);
+    if (runner->post_tail_)
+    {
+        runner->post_tail_->next_ = post;
+    }
+    else
+    {
+        runner->post_head_ = post;
+    }
+    runner->post_tail_ = post;
+    t2u_mutex_unlock(&runner->post_mutex_);
+
+    /*
+     * one wake up for a batch of posts, the control socket can't overflow.
+     * sent before any later blocking call, so the order of calls is kept.
+     */
+    if (wake)
+    {
+        control_data w;
+        memset(&w, 0, sizeof(w));
+        send(runner->sock_[1], (char *) &w, sizeof(w), 0);
+    }
+}
+
+t2u_event *t2u_event_new(t2u_runner *runner)
 {
-    t2u_event *r = (t2u_event *) malloc(sizeof(t2u_event));
+    t2u_event *r = (t2u_event *) t2u_slab_alloc(&runner->event_slab_);
     assert(NULL != r);
     
     memset(r, 0, sizeof(t2u_event));
+    r->runner_ = runner;
     return r;
 }
 
@@ -128,25 +233,54 @@ void t2u_delete_event(t2u_event *ev)
     {
         if (ev->event_)
         {
-            event_free(ev->event_);
+            t2u_event_free(ev->runner_, ev->event_);
             ev->event_ = NULL;
         }
 
         if (ev->extra_event_)
         {
-            event_free(ev->extra_event_);
+            t2u_event_free(ev->runner_, ev->extra_event_);
             ev->extra_event_ = NULL;
         }
 
-        free(ev);
+        t2u_slab_free(&ev->runner_->event_slab_, ev);
     }
 }
 
+/* object caches of the runner */
+static void runner_init_slabs_(t2u_runner *runner)
+{
+    t2u_slab_init(&runner->event_slab_, "event", sizeof(t2u_event));
+    t2u_slab_init(&runner->session_slab_, "session", sizeof(t2u_session));
+    t2u_slab_init(&runner->window_slab_, "window", sizeof(t2u_session_window));
+    t2u_slab_init(&runner->message_slab_, "message", sizeof(t2u_message));
+    t2u_slab_init(&runner->packet_slab_, "packet", sizeof(t2u_packet) + T2U_MESS_BUFFER_MAX);
+}
+
+static void runner_destroy_slabs_(t2u_runner *runner)
+{
+    t2u_slab_destroy(&runner->event_slab_);
+    t2u_slab_destroy(&runner->session_slab_);
+    t2u_slab_destroy(&runner->window_slab_);
+    t2u_slab_destroy(&runner->message_slab_);
+    t2u_slab_destroy(&runner->packet_slab_);
+}
+
+void t2u_runner_dump(t2u_runner *runner, FILE *fp)
+{
+    fprintf(fp, "runner: %p\n", (void *)runner);
+    t2u_slab_dump(&runner->event_slab_, fp);
+    t2u_slab_dump(&runner->session_slab_, fp);
+    t2u_slab_dump(&runner->window_slab_, fp);
+    t2u_slab_dump(&runner->message_slab_, fp);
+    t2u_slab_dump(&runner->packet_slab_, fp);
+}
+
 
 #define CONTROL_PORT_START (50505)
 #define CONTROL_PORT_END   (50605)
 /* runner init */
-t2u_runner * t2u_runner_new()
+t2u_runner * t2u_runner_new(const t2u_thr_attr *attr)
 {
     int ret = 0;
     struct sockaddr_in addr_c;
@@ -154,16 +288,24 @@ t2u_runner * t2u_runner_new()
 
     t2u_runner *runner = (t2u_runner *) malloc(sizeof(t2u_runner));
     assert(runner != NULL);
+    memset(runner, 0, sizeof(t2u_runner));
 
     /* alloc event base. */
     runner->base_ = event_base_new();
     assert(runner->base_ != NULL);
         
     t2u_mutex_init(&runner->mutex_);
+    t2u_mutex_init(&runner->post_mutex_);
     t2u_cond_init(&runner->cond_);
 
     runner->running_ = 0; /* not running */
     runner->tid_ = 0;
+    if (attr)
+    {
+        runner->attr_ = *attr;
+    }
+
+    runner_init_slabs_(runner);
 
     /* control message */
     runner->sock_[0] = socket(AF_INET, SOCK_DGRAM, 0);
@@ -213,6 +355,9 @@ t2u_runner * t2u_runner_new()
     /* contexts */
     runner->contexts_ = rbtree_init(NULL);
 
+    /* log writer, keep log callback off the event loop */
+    t2u_log_start();
+
     /* run the runner */
     t2u_mutex_lock(&runner->mutex_);
     runner->running_ = 1;
@@ -223,11 +368,41 @@ t2u_runner * t2u_runner_new()
     return runner;
 }
 
+/* runner driven by caller's thread */
+t2u_runner * t2u_runner_new_local(struct event_base *base)
+{
+    t2u_runner *runner = (t2u_runner *) malloc(sizeof(t2u_runner));
+    assert(runner != NULL);
+    memset(runner, 0, sizeof(t2u_runner));
+
+    runner->base_ = base;
+    runner->local_ = 1;
+    runner->running_ = 0;
+
+    /* control calls are direct calls in this thread */
+    runner->tid_ = t2u_thr_self();
+    runner->sock_[0] = -1;
+    runner->sock_[1] = -1;
+
+    t2u_mutex_init(&runner->mutex_);
+    t2u_mutex_init(&runner->post_mutex_);
+    t2u_cond_init(&runner->cond_);
+
+    runner_init_slabs_(runner);
+    runner->contexts_ = rbtree_init(NULL);
+
+    LOG_(0, "create new local runner: %p", (void *)runner);
+    return runner;
+}
+
 
 static void delete_runner_cb_(t2u_runner *runner, void *arg)
 {
     (void) arg;
 
+    /* posted before the delete */
+    runner_drain_posts_(runner);
+
     while (runner->contexts_->root)
     {
         rbtree_node *node = runner->contexts_->root;
@@ -270,6 +445,17 @@ void t2u_delete_runner(t2u_runner *runner)
 
         t2u_thr_join(runner->thread_);
     }
+    else if (runner->local_)
+    {
+        /* local runner, cleanup in this thread. the base is owned by caller */
+        delete_runner_cb_(runner, NULL);
+        runner->base_ = NULL;
+        runner_destroy_slabs_(runner);
+
+        LOG_(0, "delete the local runner: %p", (void *)runner);
+        free(runner);
+        return;
+    }
 
 
     /* cleanup */
@@ -286,8 +472,11 @@ void t2u_delete_runner(t2u_runner *runner)
         runner->base_ = NULL;
     }
 
-    /* last cleanup */
+    /* last cleanup, the runner thread is gone */
+    runner_destroy_slabs_(runner);
     free(runner);
+
+    t2u_log_stop();
 }
 
 int t2u_runner_has_context(t2u_runner *runner)
@@ -295,4 +484,94 @@ int t2u_runner_has_context(t2u_runner *runner)
     return (runner->contexts_->root != NULL);
 }
 
+static uint64_t monotonic_us_()
+{
+#if defined _MSC_VER
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+
+    if (!freq.QuadPart)
+    {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 +
+        (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+uint64_t t2u_time_us(t2u_runner *runner)
+{
+    struct timeval tv;
+
+    if (runner->sim_)
+    {
+        return t2u_sim_now_us(runner->sim_);
+    }
+
+    /*
+     * libevent caches its time once per loop iteration, read the monotonic
+     * clock only when that changes. outside the loop the cache is empty and
+     * every call reads the clock.
+     */
+    event_base_gettimeofday_cached(runner->base_, &tv);
+    if (!runner->now_us_ || evutil_timercmp(&tv, &runner->now_key_, !=))
+    {
+        runner->now_key_ = tv;
+        runner->now_us_ = monotonic_us_();
+    }
+    return runner->now_us_;
+}
+
+uint64_t t2u_time_ms(t2u_runner *runner)
+{
+    return t2u_time_us(runner) / 1000;
+}
+
+void t2u_timer_add(t2u_runner *runner, struct event *ev, const struct timeval *tv)
+{
+    if (runner->sim_)
+    {
+        t2u_sim_timer_add(runner->sim_, ev, (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec);
+        return;
+    }
+
+    event_add(ev, tv);
+}
+
+const struct timeval *t2u_runner_timeout(t2u_runner *runner, t2u_timeout *timeout, unsigned long ms)
+{
+    if (timeout->ms_ != ms)
+    {
+        timeout->ms_ = ms;
+        timeout->tv_.tv_sec = (long)(ms / 1000);
+        timeout->tv_.tv_usec = (long)(ms % 1000) * 1000;
+
+        /* same duration on the base shares one queue */
+        timeout->common_ = event_base_init_common_timeout(runner->base_, &timeout->tv_);
+    }
+
+    /* virtual timers need the plain duration */
+    if (runner->sim_ || !timeout->common_)
+    {
+        return &timeout->tv_;
+    }
+    return timeout->common_;
+}
+
+void t2u_event_free(t2u_runner *runner, struct event *ev)
+{
+    if (runner->sim_)
+    {
+        t2u_sim_timer_del(runner->sim_, ev);
+    }
+
+    event_free(ev);
+}
+
 
@@ -4,19 +4,49 @@
 /* run some function with userdata in current runner */
 void t2u_runner_control(t2u_runner *runner, control_data *cdata);
 
-/* alloc new t2u_event */
-t2u_event *t2u_event_new();
+/*
+ * run some function in runner without waiting for it. calls run in order,
+ * also with t2u_runner_control. a direct call in runner or a local runner.
+ */
+void t2u_runner_post(t2u_runner *runner, control_data *cdata);
+
+/* alloc new t2u_event of runner */
+t2u_event *t2u_event_new(t2u_runner *runner);
 
 /* cleanup t2u_event */
 void t2u_delete_event(t2u_event *ev);
 
-/* new a runner */
-t2u_runner * t2u_runner_new();
+/* new a runner, the thread applies attr. NULL for defaults */
+t2u_runner * t2u_runner_new(const t2u_thr_attr *attr);
+
+/* new a runner driven by caller's thread on base, without thread and control socket */
+t2u_runner * t2u_runner_new_local(struct event_base *base);
 
 /* delete runner */
 void t2u_delete_runner(t2u_runner *runner);
 
+/* print runner internals, in runner */
+void t2u_runner_dump(t2u_runner *runner, FILE *fp);
+
 /* check runner has context? */
 int t2u_runner_has_context(t2u_runner *runner);
 
+/* monotonic time of runner, us. cached per loop iteration, virtual time in simulation */
+uint64_t t2u_time_us(t2u_runner *runner);
+
+/* same as t2u_time_us, ms */
+uint64_t t2u_time_ms(t2u_runner *runner);
+
+/* add a timer event, virtual timer in simulation */
+void t2u_timer_add(t2u_runner *runner, struct event *ev, const struct timeval *tv);
+
+/*
+ * timer duration of ms, cached in timeout. a libevent common timeout, so
+ * arming is O(1) with many timers of the same duration. in runner.
+ */
+const struct timeval *t2u_runner_timeout(t2u_runner *runner, t2u_timeout *timeout, unsigned long ms);
+
+/* free an event, with its virtual timer in simulation */
+void t2u_event_free(t2u_runner *runner, struct event *ev);
+
 #endif /* __t2u_runner_h__ */
\ No newline at end of file
@@ -19,50 +19,207 @@
 #include "t2u_internal.h"
 
 
-static rbtree *g_session_tree = NULL;
-static rbtree *g_session_tree_remote = NULL;
-static unsigned long g_session_count = 0;
 
-static int compare_uint32_ptr(void *a, void *b)
+static void session_idle_sweep_cb_(evutil_socket_t sock, short events, void *arg);
+
+/* idle time after which the session expires, ms */
+static uint64_t session_idle_limit_(t2u_rule *rule)
+{
+    return (uint64_t)t2u_rule_session_timeout(rule) * 1000;
+}
+
+/* arm the sweep timer for the coldest session, one timer per rule since the timeout is per rule */
+static void session_idle_arm_(t2u_rule *rule)
 {
-    uint32_t *sa = (uint32_t *)a;
-    uint32_t *sb = (uint32_t *)b;
+    t2u_context *context = rule->context_;
+    t2u_session *session = rule->idle_tail_;
+    uint64_t c = t2u_time_ms(context->runner_);
+    uint64_t due;
+    uint64_t wait = 1;
+    struct timeval t;
 
-    if (*sa > *sb)
+    if (!session || rule->idle_armed_)
     {
-        return 1;
+        return;
     }
 
-    if (*sa < *sb)
+    if (!rule->ev_idle_)
     {
-        return -1;
+        rule->ev_idle_ = t2u_event_new(context->runner_);
+        rule->ev_idle_->context_ = context;
+        rule->ev_idle_->rule_ = rule;
+        rule->ev_idle_->event_ = evtimer_new(context->runner_->base_, session_idle_sweep_cb_, rule->ev_idle_);
+        assert(NULL != rule->ev_idle_->event_);
     }
 
-    return 0;
-}
+    /* expires when idle for more than session_timeout_ seconds */
+    due = session->last_send_ms_ + session_idle_limit_(rule) + 1;
+    if (due > c)
+    {
+        wait = due - c;
+    }
 
+    t.tv_sec = (long)(wait / 1000);
+    t.tv_usec = (long)(wait % 1000) * 1000;
+    t2u_timer_add(context->runner_, rule->ev_idle_->event_, &t);
+    rule->idle_armed_ = 1;
+}
 
-static void session_timeout_check_cb_(evutil_socket_t sock, short events, void *arg)
+static void session_idle_sweep_cb_(evutil_socket_t sock, short events, void *arg)
 {
     t2u_event *ev = (t2u_event *)arg;
-    t2u_session *session = ev->session_;
-    time_t c = time(NULL);
+    t2u_rule *rule = ev->rule_;
+    uint64_t c = t2u_time_ms(rule->context_->runner_);
+
+    (void)sock;
+    (void)events;
+
+    rule->idle_armed_ = 0;
 
-    if ((c > session->last_send_ts_) && (c - session->last_send_ts_ > ev->context_->session_timeout_))
+    /* expire from the cold end, stop at the first live one */
+    while (rule->idle_tail_)
     {
+        t2u_session *session = rule->idle_tail_;
+
+        if ((c <= session->last_send_ms_) || (c - session->last_send_ms_ <= session_idle_limit_(rule)))
+        {
+            break;
+        }
+
         LOG_(2, "delete timeout session: %p", session);
         t2u_delete_connected_session(session, 0);
     }
+
+    session_idle_arm_(rule);
+}
+
+static int session_idle_linked_(t2u_rule *rule, t2u_session *session)
+{
+    return session->idle_prev_ || (rule->idle_head_ == session);
+}
+
+static void session_idle_unlink_(t2u_rule *rule, t2u_session *session)
+{
+    if (session->idle_prev_)
+    {
+        session->idle_prev_->idle_next_ = session->idle_next_;
+    }
     else
     {
-        /* add event to extra session */
-        long s = (long)ev->context_->session_timeout_ - (long)(c - session->last_send_ts_);
-        if (s <= 0)
-        {
-            s = 1;
-        }
-        struct timeval t = {s, 0 };
-        event_add(session->ev_->extra_event_, &t);
+        rule->idle_head_ = session->idle_next_;
+    }
+
+    if (session->idle_next_)
+    {
+        session->idle_next_->idle_prev_ = session->idle_prev_;
+    }
+    else
+    {
+        rule->idle_tail_ = session->idle_prev_;
+    }
+
+    session->idle_prev_ = NULL;
+    session->idle_next_ = NULL;
+}
+
+static void session_idle_push_(t2u_rule *rule, t2u_session *session)
+{
+    session->idle_prev_ = NULL;
+    session->idle_next_ = rule->idle_head_;
+    if (rule->idle_head_)
+    {
+        rule->idle_head_->idle_prev_ = session;
+    }
+    else
+    {
+        rule->idle_tail_ = session;
+    }
+    rule->idle_head_ = session;
+}
+
+/* session established, start idle tracking */
+static void session_idle_link_(t2u_session *session)
+{
+    t2u_rule *rule = session->rule_;
+
+    session->last_send_ms_ = t2u_time_ms(rule->context_->runner_);
+    session_idle_push_(rule, session);
+    session_idle_arm_(rule);
+}
+
+t2u_session_window *t2u_session_window_get(t2u_session *session)
+{
+    if (!session->window_)
+    {
+        t2u_runner *runner = session->rule_->context_->runner_;
+
+        session->window_ = (t2u_session_window *)t2u_slab_alloc(&runner->window_slab_);
+        assert(NULL != session->window_);
+        memset(session->window_, 0, sizeof(t2u_session_window));
+    }
+    return session->window_;
+}
+
+void t2u_session_park(t2u_session *session)
+{
+    t2u_session_window *window = session->window_;
+
+    if (window && t2u_rb_empty(&window->send_mess_) && t2u_rb_empty(&window->recv_mess_) &&
+        !t2u_budget_blocked(session))
+    {
+        t2u_slab_free(&session->rule_->context_->runner_->window_slab_, window);
+        session->window_ = NULL;
+    }
+}
+
+void t2u_session_resume_read(t2u_session *session)
+{
+    t2u_event *ev = session->ev_;
+
+    if (ev && !ev->event_ && !t2u_budget_blocked(session) && !(session->fin_ & T2U_FIN_SENT))
+    {
+        ev->event_ = event_new(session->rule_->context_->runner_->base_, session->sock_,
+            EV_READ | EV_PERSIST, t2u_session_process_tcp, ev);
+        assert(NULL != ev->event_);
+
+        event_add(ev->event_, NULL);
+        LOG_(0, "readd event with session: %p, sock: %d", session, session->sock_);
+    }
+}
+
+void t2u_session_touch(t2u_session *session)
+{
+    t2u_rule *rule = session->rule_;
+
+    session->last_send_ms_ = t2u_time_ms(rule->context_->runner_);
+    if (session_idle_linked_(rule, session) && (rule->idle_head_ != session))
+    {
+        session_idle_unlink_(rule, session);
+        session_idle_push_(rule, session);
+    }
+}
+
+void t2u_session_idle_rearm(t2u_rule *rule)
+{
+    /* adding the pending timer again reschedules it */
+    rule->idle_armed_ = 0;
+    session_idle_arm_(rule);
+}
+
+void t2u_session_idle_cleanup(t2u_rule *rule)
+{
+    t2u_delete_event(rule->ev_idle_);
+    rule->ev_idle_ = NULL;
+    rule->idle_armed_ = 0;
+}
+
+/* both directions finished, close when the queues are flushed */
+static void session_finish_(t2u_session *session)
+{
+    if ((session->fin_ == (T2U_FIN_SENT | T2U_FIN_RECV)) && (session->status_ == 2))
+    {
+        LOG_(1, "session: %p finished both directions", session);
+        t2u_delete_connected_session_later(session);
     }
 }
 
@@ -79,15 +236,22 @@ void t2u_session_process_tcp(evutil_socket_t sock, short events, void *arg)
     (void)events;
 
     /* check session is ready for sent */
-    if (session->send_buffer_count_ >= context->udp_slide_window_)
+    if (session->window_ && (session->window_->send_buffer_count_ >= t2u_rule_slide_window(session->rule_)))
     {
-        LOG_(1, "data not confirmed, disable event for session: %p %d", session, session->send_buffer_count_);
+        LOG_(1, "data not confirmed, disable event for session: %p %d", session, session->window_->send_buffer_count_);
         /* data is not confirmed, disable the event */
-        event_free(ev->event_);
+        t2u_event_free(ev->runner_, ev->event_);
         ev->event_ = NULL;
         return;
     }
 
+    /* memory budget is full, wait for buffers released */
+    if (t2u_budget_full(session))
+    {
+        t2u_budget_block(session);
+        return;
+    }
+
     buff = (char *)malloc(T2U_PAYLOAD_MAX);
     assert(NULL != buff);
 
@@ -102,33 +266,33 @@ void t2u_session_process_tcp(evutil_socket_t sock, short events, void *arg)
     if (read_bytes > 0)
     {
     }
-
-#if defined _MSC_VER
-    else if ((int)read_bytes == 0 ||
-        ((read_bytes < 0) && (last_error != WSAEWOULDBLOCK)))
-#else
-    else if ((((int)read_bytes == 0)  && (last_error != EINPROGRESS)) ||
-        ((read_bytes < 0) && (last_error != EINTR && last_error != EWOULDBLOCK && last_error != EAGAIN)))
-#endif
+    else if ((int)read_bytes == 0)
     {
-        LOG_(3, "recv failed on socket %d, read_bytes(%d). %d",
-            session->sock_, read_bytes, last_error);
+        /* fin, the peer gets the end of stream after the data. writes go on */
+        LOG_(1, "tcp of session: %p finished sending, sock: %d", session, session->sock_);
 
-        /* error */
+        session->fin_ |= T2U_FIN_SENT;
+        t2u_event_free(ev->runner_, ev->event_);
+        ev->event_ = NULL;
+
+        t2u_add_request_message(session, buff, 0);
         free(buff);
 
-        /* close session later, after send_mess_ out */
-		t2u_delete_connected_session(session, 0);
+        session_finish_(session);
         return;
     }
-    else if(((int)read_bytes == 0)  && (last_error == EINPROGRESS))
+#if defined _MSC_VER
+    else if ((read_bytes < 0) && (last_error != WSAEWOULDBLOCK))
+#else
+    else if ((read_bytes < 0) && (last_error != EINTR && last_error != EWOULDBLOCK && last_error != EAGAIN))
+#endif
     {
-        LOG_(3, "EINPROGRESS recv failed on socket %d , read_bytes(%d). %d",
+        LOG_(3, "recv failed on socket %d, read_bytes(%d). %d",
             session->sock_, read_bytes, last_error);
 
         /* error */
         free(buff);
-        t2u_delete_connected_session(session, 0);
+		t2u_delete_connected_session(session, 0);
         return;
     }
     else
@@ -141,6 +305,8 @@ void t2u_session_process_tcp(evutil_socket_t sock, short events, void *arg)
     }
     
     /* build a session message */
+    context->stat_[CTX_STAT_TCP_RECV_BYTES] += read_bytes;
+    session->bytes_ += read_bytes;
     t2u_add_request_message(session, buff, read_bytes);
     free(buff);
 
@@ -153,7 +319,6 @@ void t2u_session_handle_connect_response(t2u_session *session, t2u_message_data
     t2u_rule *rule = session->rule_;
     t2u_context *context = rule->context_;
     t2u_runner *runner = context->runner_;
-    struct timeval t = { context->session_timeout_, 0 };
 
     uint32_t error = *((uint32_t *)(void *)mdata->payload);
     error = ntohl(error);
@@ -163,13 +328,15 @@ void t2u_session_handle_connect_response(t2u_session *session, t2u_message_data
         session->status_ = 2;
 
         // clear events
-        event_free(session->ev_->event_);
+        t2u_event_free(runner, session->ev_->event_);
         session->ev_->event_ = NULL;
 
         // move connecting -> connected
-        rbtree_remove(rule->connecting_sessions_, &session->handle_);
+        t2u_session_tree_remove(&rule->connecting_sessions_, session);
+        t2u_group_disown(context, session->handle_);
         session->handle_ = mdata->handle_;
-        rbtree_insert(rule->sessions_, &session->handle_, session);
+        t2u_session_tree_insert(&rule->sessions_, session);
+        t2u_group_own(context, session->handle_);
 
 
         // binding new events
@@ -178,9 +345,7 @@ void t2u_session_handle_connect_response(t2u_session *session, t2u_message_data
         assert(NULL != session->ev_->event_);
         event_add(session->ev_->event_, NULL);
 
-        session->ev_->extra_event_ = evtimer_new(runner->base_, session_timeout_check_cb_, session->ev_);
-        assert(NULL != session->ev_->extra_event_);
-        event_add(session->ev_->extra_event_, &t);
+        session_idle_link_(session);
 
 		LOG_(1, "connect for session: %p with handle: %llu success. sock: %d", session, session->handle_, session->sock_);
 
@@ -200,10 +365,12 @@ void t2u_session_handle_data_request(t2u_session *session, t2u_message_data *mda
     t2u_runner *runner = context->runner_;
     t2u_message_data *mdata_resp = NULL;
     t2u_message_data *this_mdata = mdata;
+    t2u_packet *this_packet = NULL;
+    unsigned long slide_window = t2u_rule_slide_window(rule);
 
     uint32_t seq_diff = this_mdata->seq_ - session->recv_seq_;
 
-    if ((seq_diff > context->udp_slide_window_) || (seq_diff <= 1))
+    if ((seq_diff > slide_window) || (seq_diff <= 1))
     {
         mdata_resp = (t2u_message_data *)malloc(sizeof(t2u_message_data) + sizeof(int));
         mdata_resp->handle_ = hton64(session->handle_);
@@ -228,21 +395,39 @@ void t2u_session_handle_data_request(t2u_session *session, t2u_message_data *mda
 #ifdef __apple__
                 flags |= SO_NOSIGPIPE;
 #endif
-                int r = send(session->sock_, this_mdata->payload, mdata_len - sizeof(t2u_message_data), flags);
+                int payload_len = (int)(mdata_len - sizeof(t2u_message_data));
+                int r = 0;
 
-                if (this_mdata->seq_ != mdata->seq_)
+                if (payload_len > 0)
+                {
+                    r = send(session->sock_, this_mdata->payload, payload_len, flags);
+                }
+                else if (!(session->fin_ & T2U_FIN_RECV))
+                {
+                    /* end of stream, the tcp peer reads fin and may still send */
+                    LOG_(1, "peer of session: %p finished sending, sock: %d", session, session->sock_);
+                    session->fin_ |= T2U_FIN_RECV;
+#ifdef _MSC_VER
+                    shutdown(session->sock_, SD_SEND);
+#else
+                    shutdown(session->sock_, SHUT_WR);
+#endif
+                }
+
+                if (this_packet)
                 {
                     // this mdata is copy from recv queue. need to free it.
-                    free(this_mdata);
+                    t2u_budget_packet_free(session, this_packet);
+                    this_packet = NULL;
                 }
                 this_mdata = NULL;
 
 #ifdef _MSC_VER
                 int last_error = WSAGetLastError();
-                if (r == 0 || (r < 0 && last_error != WSAEWOULDBLOCK))
+                if ((r == 0 && payload_len > 0) || (r < 0 && last_error != WSAEWOULDBLOCK))
 #else
                 int last_error = errno;
-                if (r == 0 || (r < 0 && last_error != EWOULDBLOCK && last_error != EAGAIN))
+                if ((r == 0 && payload_len > 0) || (r < 0 && last_error != EWOULDBLOCK && last_error != EAGAIN))
 #endif
                 {
                     // error, response it's error.
@@ -258,6 +443,8 @@ void t2u_session_handle_data_request(t2u_session *session, t2u_message_data *mda
                 {
 					// block or success
 					*value = htonl(r);
+					context->stat_[CTX_STAT_TCP_SENT_BYTES] += r;
+					session->bytes_ += (r > 0) ? r : 0;
 					t2u_send_message_data(context, (char *)mdata_resp, sizeof(t2u_message_data)+sizeof(int), session);
 					
 					if (r != mdata_len - sizeof(t2u_message_data))
@@ -272,55 +459,65 @@ void t2u_session_handle_data_request(t2u_session *session, t2u_message_data *mda
 					}
                 }
                 
-                t2u_message *this_m  = rbtree_lookup(session->recv_mess_, &next_seq);
+                t2u_session_window *window = session->window_;
+                t2u_message *this_m  = window ? t2u_message_tree_find(&window->recv_mess_, next_seq) : NULL;
 
                 if (this_m)
                 {
-                    this_mdata = this_m->data_;
-                    mdata_len = this_m->len_;
+                    this_packet = this_m->packet_;
+                    this_mdata = t2u_packet_mdata(this_packet);
+                    mdata_len = this_packet->len_;
 
                     // find next. remove it from recv queue
-                    rbtree_remove(session->recv_mess_, &this_mdata->seq_);
+                    t2u_message_tree_remove(&window->recv_mess_, this_m);
 
                     // free the mess
-                    free(this_m);
+                    t2u_slab_free(&runner->message_slab_, this_m);
 
-                    session->recv_buffer_count_--;
+                    window->recv_buffer_count_--;
+                    t2u_session_park(session);
 
                     // update the response seq.
                     mdata_resp->seq_ = htonl(this_mdata->seq_);
-
-                    // try delete.
-                    t2u_try_delete_connected_session(session);
                 }
             }
         }
         else
         {
+            /* delivered before, the response was lost. ack all of it, else the peer resends until timeout */
+            *value = htonl((int)(mdata_len - sizeof(t2u_message_data)));
             t2u_send_message_data(context, (char *)mdata_resp, sizeof(t2u_message_data) + sizeof(int), session);
         }
 
         free(mdata_resp);
+
+        /* a closing session goes once its window drained, nothing to finish then */
+        if (t2u_try_delete_connected_session(session))
+        {
+            return;
+        }
+        session_finish_(session);
     }
     else
     {
         // in range, but not in sequence. push to recv queue.
         LOG_(1, "we want:%lu but:%lu", session->recv_seq_ + 1, mdata->seq_);
         this_mdata = NULL;
-        t2u_message *this_m = rbtree_lookup(session->recv_mess_, &mdata->seq_);
+        t2u_session_window *window = t2u_session_window_get(session);
+        t2u_message *this_m = t2u_message_tree_find(&window->recv_mess_, mdata->seq_);
         
-        if (!this_m && session->recv_buffer_count_ < context->udp_slide_window_)
+        if (!this_m && window->recv_buffer_count_ < slide_window && !t2u_budget_full(session))
         {
-            this_m = (t2u_message *) malloc(sizeof(t2u_message));
-            this_mdata = (t2u_message_data *)malloc(mdata_len);
-            assert(NULL != this_mdata);
+            assert((size_t)mdata_len <= T2U_MESS_BUFFER_MAX);
+            this_m = (t2u_message *) t2u_slab_alloc(&runner->message_slab_);
+            this_m->packet_ = t2u_budget_packet_alloc(session, mdata_len);
+            this_mdata = t2u_packet_mdata(this_m->packet_);
 
             memcpy(this_mdata, mdata, mdata_len);
-            this_m->data_ = this_mdata;
-            this_m->len_ = mdata_len;
+            this_m->seq_ = this_mdata->seq_;
 
-            rbtree_insert(session->recv_mess_, &this_mdata->seq_, this_m);
-            session->recv_buffer_count_++;
+            t2u_message_tree_insert(&window->recv_mess_, this_m);
+            window->recv_buffer_count_++;
         }
 
         // send retrans request
@@ -331,15 +528,15 @@ void t2u_session_handle_data_request(t2u_session *session, t2u_message_data *mda
         retrans_md.version_ = htons(1);
         
         uint32_t i = 0;
-        for (i = 0; i < context->udp_slide_window_; i++)
+        for (i = 0; i < slide_window; i++)
         {
             uint32_t test_seq = session->recv_seq_ + 1 + i;
-            if (rbtree_lookup(session->recv_mess_, &test_seq) == NULL)
+            if (t2u_message_tree_find(&window->recv_mess_, test_seq) == NULL)
             {
                 uint32_t span1 = mdata->seq_ - test_seq;
                 uint32_t span2 = session->retry_seq_ - test_seq;
 
-                if (span1 <= context->udp_slide_window_ && span2 > context->udp_slide_window_)
+                if (span1 <= slide_window && span2 > slide_window)
                 {
                     retrans_md.seq_ = htonl(test_seq);
                     t2u_send_message_data(context, (char *)&retrans_md, sizeof(retrans_md), session);
@@ -347,6 +544,8 @@ void t2u_session_handle_data_request(t2u_session *session, t2u_message_data *mda
                 }
             }
         }
+
+        t2u_session_park(session);
     }
 }
 
@@ -386,9 +585,9 @@ static void session_connect_(t2u_session *session)
 
     if (rule->mode_ == forward_client_mode)
     {
-        /* translate tcp->udp */
-       
-        t2u_message_data *mdata = (t2u_message_data *) malloc(sizeof(t2u_message_data) + name_len + 1);
+        /* translate tcp->udp, the service name then the peer id */
+        uint64_t id = hton64(rule->context_->peer_id_);
+        t2u_message_data *mdata = (t2u_message_data *) malloc(sizeof(t2u_message_data) + name_len + 1 + sizeof(id));
 
         mdata->magic_ = htonl(T2U_MESS_MAGIC);
         mdata->version_ = htons(0x0001);
@@ -402,7 +601,8 @@ static void session_connect_(t2u_session *session)
 #else
         strcpy(mdata->payload, rule->service_);
 #endif
-        t2u_send_message_data(rule->context_, (char *)mdata, sizeof(t2u_message_data) + name_len + 1, session);
+        memcpy(mdata->payload + name_len + 1, &id, sizeof(id));
+        t2u_send_message_data(rule->context_, (char *)mdata, sizeof(t2u_message_data) + name_len + 1 + sizeof(id), session);
 
         free(mdata);
     }
@@ -432,7 +632,6 @@ static void session_connect_success_cb_(evutil_socket_t sock, short events, void
     t2u_runner *runner = ev->runner_;
     t2u_rule *rule = ev->rule_;
     t2u_session *session = ev->session_;
-    struct timeval t = { ev->context_->session_timeout_, 0 };
 
     (void)events;
 
@@ -443,18 +642,18 @@ static void session_connect_success_cb_(evutil_socket_t sock, short events, void
         session->status_ = 2;
 
         // clear events
-        event_free(ev->event_);
+        t2u_event_free(runner, ev->event_);
         ev->event_ = NULL;
 
-		event_free(ev->extra_event_);
+		t2u_event_free(runner, ev->extra_event_);
         ev->extra_event_ = NULL;
 
         // send response
         session_connect_response_(session);
 
         // move connecting -> connected
-        rbtree_remove(rule->connecting_sessions_, &session->handle_);
-        rbtree_insert(rule->sessions_, &session->handle_, session);
+        t2u_session_tree_remove(&rule->connecting_sessions_, session);
+        t2u_session_tree_insert(&rule->sessions_, session);
 
         // binding new events
         ev->event_ = event_new(runner->base_, session->sock_, 
@@ -462,9 +661,7 @@ static void session_connect_success_cb_(evutil_socket_t sock, short events, void
         assert(NULL != ev->event_);
         event_add(ev->event_, NULL);
 
-        ev->extra_event_ = evtimer_new(runner->base_, session_timeout_check_cb_, ev);
-        assert(NULL != ev->extra_event_);
-        event_add(ev->extra_event_, &t);
+        session_idle_link_(session);
 
 		LOG_(1, "connect for session: %p with handle: %llu success. sock: %d", session, session->handle_, session->sock_);
 
@@ -481,15 +678,14 @@ static void session_connect_timeout_cb_(evutil_socket_t sock, short events, void
     t2u_event *ev = (t2u_event *)arg;
     t2u_session *session = ev->session_;
     t2u_rule *rule = ev->rule_;
-    t2u_context *context = ev->context_;
 
     (void) sock;
     (void) events;
 
-    if (++session->connect_retries_ >= context->uretries_)
+    if (++session->connect_retries_ >= t2u_rule_uretries(rule))
     {
-        LOG_(2, "timeout for accept session connection, session: %lu, retry: %lu, delay: %lums",
-            (unsigned long)session->handle_, context->uretries_, context->utimeout_);
+        LOG_(2, "timeout for accept session connection, session: %lu, retry: %lu",
+            (unsigned long)session->handle_, t2u_rule_uretries(rule));
         
         /* timeout */
         t2u_delete_connecting_session(session);
@@ -497,11 +693,7 @@ static void session_connect_timeout_cb_(evutil_socket_t sock, short events, void
     else
     {
         /* readd the timer */
-        struct timeval t;
-        t.tv_sec = context->utimeout_ / 1000;
-        t.tv_usec = (context->utimeout_ % 1000) * 1000;
-
-        event_add(session->ev_->event_, &t);
+        t2u_timer_add(ev->runner_, session->ev_->event_, t2u_rule_utimeout(rule));
 
         /* do connect again, if in client mode. */
         if (forward_client_mode == rule->mode_)
@@ -512,57 +704,52 @@ static void session_connect_timeout_cb_(evutil_socket_t sock, short events, void
 }
 
 
-t2u_session *t2u_add_connecting_session(t2u_rule *rule, sock_t sock, uint64_t handle)
+t2u_session *t2u_add_connecting_session(t2u_rule *rule, sock_t sock, uint64_t handle, t2u_peer *peer)
 {
-    struct timeval t;
     t2u_context *context = rule->context_;
     t2u_runner *runner = context->runner_;
 
-    t2u_session *session = (t2u_session *)malloc(sizeof(t2u_session));
+    t2u_session *session = (t2u_session *)t2u_slab_alloc(&runner->session_slab_);
     assert(NULL != session);
     memset(session, 0, sizeof(t2u_session));
 
-    static uint32_t handle_seq_ = 0;
+    /* runners of the pool share it, handles stay unique in a group */
+    static t2u_atomic_t handle_seq_ = 0;
+    uint32_t seq = (uint32_t)t2u_atomic_add(&handle_seq_, 1);
 
-    ++handle_seq_;
-    if (handle_seq_ == 0)
+    if (seq == 0)
     {
-        ++handle_seq_;
+        seq = (uint32_t)t2u_atomic_add(&handle_seq_, 1);
     }
 
     if (handle == 0)
     {
-        session->handle_ = (uint64_t)(handle_seq_);
+        session->handle_ = (uint64_t)(seq);
     }
     else
     {
         // handle is from client, add server part.
-        session->handle_ = handle + ((uint64_t)handle_seq_ << 32);
+        session->handle_ = handle + ((uint64_t)seq << 32);
     }
     handle = session->handle_;
 
 
     session->rule_ = rule;
     session->sock_ = sock;
+    session->peer_ = t2u_peer_ref(peer);
 
     session->status_ = 1;
 
-    session->send_mess_ = rbtree_init(compare_uint32_ptr);
-    session->recv_mess_ = rbtree_init(compare_uint32_ptr);
-
     LOG_(1, "create new session %p handle: %llu, sock :%d", session, session->handle_, sock);
 
-    session->ev_ = t2u_event_new();
-    session->ev_->runner_ = runner;
+    session->ev_ = t2u_event_new(runner);
     session->ev_->context_ = context;
     session->ev_->rule_ = rule;
     session->ev_->session_ = session;
     session->ev_->event_ = evtimer_new(runner->base_, session_connect_timeout_cb_, session->ev_);
     assert (NULL != session->ev_->event_);
     
-    t.tv_sec = context->utimeout_ / 1000;
-    t.tv_usec = (context->utimeout_ % 1000) * 1000;
-    event_add(session->ev_->event_, &t);
+    t2u_timer_add(runner, session->ev_->event_, t2u_rule_utimeout(rule));
 
     if (forward_server_mode == rule->mode_)
     {
@@ -573,7 +760,8 @@ t2u_session *t2u_add_connecting_session(t2u_rule *rule, sock_t sock, uint64_t ha
     }
 
     /* add session to rule, using self handle as key */
-    rbtree_insert(rule->connecting_sessions_, &session->handle_, session);
+    t2u_session_tree_insert(&rule->connecting_sessions_, session);
+    t2u_group_own(context, session->handle_);
 
     /* connecting */
     session_connect_(session);
@@ -586,6 +774,8 @@ t2u_session *t2u_add_connecting_session(t2u_rule *rule, sock_t sock, uint64_t ha
 
 void t2u_delete_connecting_session(t2u_session *session)
 {
+    t2u_runner *runner = session->rule_->context_->runner_;
+
     t2u_delete_event(session->ev_);
     session->ev_ = NULL;
 
@@ -596,30 +786,27 @@ void t2u_delete_connecting_session(t2u_session *session)
     }
 
     /* delete from rule */
-    rbtree_remove(session->rule_->connecting_sessions_, &session->handle_);
+    t2u_session_tree_remove(&session->rule_->connecting_sessions_, session);
+    t2u_group_disown(session->rule_->context_, session->handle_);
+    t2u_peer_put(session->rule_->context_, session->peer_);
 
     /* free */
 	session->sock_ = 0;
-    free(session->send_mess_);
-    free(session->recv_mess_);
-    free(session);
+    t2u_slab_free(&runner->session_slab_, session);
 }
 
 void t2u_delete_connected_session(t2u_session *session, int sync_from_pair)
 {
+    t2u_runner *runner = session->rule_->context_->runner_;
+
     t2u_delete_event(session->ev_);
     session->ev_ = NULL;
+    t2u_budget_unblock(session);
 
     if (!sync_from_pair)
     {
-        t2u_message_data md;
-        md.handle_ = hton64(session->handle_);
-        md.magic_ = htonl(T2U_MESS_MAGIC);
-        md.oper_ = htons(close_request);
-        md.seq_ = htonl(0);
-        md.version_ = htons(1);
-
-        t2u_send_message_data(session->rule_->context_, (char *)&md, sizeof(md), session);
+        /* resent until the peer answers, the close keeps the handle */
+        t2u_close_send(session);
     }
 
     /* close socket */
@@ -629,47 +816,67 @@ void t2u_delete_connected_session(t2u_session *session, int sync_from_pair)
     }
 
     /* clear recv queue */
-    while (session->recv_mess_->root)
+    if (session->window_)
     {
-        t2u_message *m = session->recv_mess_->root->data;
-        rbtree_remove(session->recv_mess_, session->recv_mess_->root->key);
-        
-        free(m->data_);
-        free(m);
-    }
+        t2u_session_window *window = session->window_;
 
-    while (session->send_mess_->root)
-    {
-        t2u_message *m = session->send_mess_->root->data;
+        LOG_(1, "session end with %d send buffers.", window->send_buffer_count_);
+        LOG_(1, "session end with %d recv buffers.", window->recv_buffer_count_);
 
-        /* t2u_message only in send queue */
-        t2u_delete_request_message(m);
+        while (!t2u_rb_empty(&window->recv_mess_))
+        {
+            t2u_message *m = t2u_message_tree_first(&window->recv_mess_);
+            t2u_message_tree_remove(&window->recv_mess_, m);
+
+            t2u_budget_packet_free(session, m->packet_);
+            t2u_slab_free(&runner->message_slab_, m);
+        }
+        window->recv_buffer_count_ = 0;
     }
 
-    // TODO: remove it
-    LOG_(1, "session end with %d send buffers.", session->send_buffer_count_);
-    LOG_(1, "session end with %d recv buffers.", session->recv_buffer_count_);
-    // t2u_sleep(3000);
+    /* t2u_message only in send queue, the last one parks the window */
+    while (session->window_ && !t2u_rb_empty(&session->window_->send_mess_))
+    {
+        t2u_delete_request_message(t2u_message_tree_first(&session->window_->send_mess_));
+    }
+    t2u_session_park(session);
 
-    /* delete from rule */
-    rbtree_remove(session->rule_->sessions_, &session->handle_);
+    /* delete from rule and idle list */
+    t2u_session_tree_remove(&session->rule_->sessions_, session);
+    if (sync_from_pair)
+    {
+        t2u_group_disown(session->rule_->context_, session->handle_);
+    }
+    t2u_peer_put(session->rule_->context_, session->peer_);
+    if (session_idle_linked_(session->rule_, session))
+    {
+        session_idle_unlink_(session->rule_, session);
+    }
 
     LOG_(1, "delete connected session: %p, sock: %d", session, session->sock_);
     
     /* free */
 	session->sock_ = 0;
-    free(session->send_mess_);
-    free(session->recv_mess_);
-    free(session);
+    t2u_slab_free(&runner->session_slab_, session);
 }
 
-void t2u_try_delete_connected_session(t2u_session *session)
+/* 1 if the session was deleted, it must not be touched then */
+int t2u_try_delete_connected_session(t2u_session *session)
 {
-    /* check status send_mess_ recv_mess_ */
-    if ((session->status_ == 3) && (NULL == session->send_mess_->root) && (NULL == session->recv_mess_->root))
+    /* a closing session reads no more, its window need not wait for memory */
+    if (session->status_ == 3)
+    {
+        t2u_budget_unblock(session);
+    }
+
+    /* check status, parked if send_mess_ and recv_mess_ are empty */
+    t2u_session_park(session);
+    if ((session->status_ == 3) && !session->window_)
     {
         t2u_delete_connected_session(session, 0);
+        return 1;
     }
+    return 0;
 }
 
 void t2u_delete_connected_session_later(t2u_session *session)
@@ -679,45 +886,230 @@ void t2u_delete_connected_session_later(t2u_session *session)
 }
 
 
-static t2u_session *find_session_in_rule(t2u_rule *rule, uint64_t handle, int connected)
+/* a queued message of a moving session */
+typedef struct session_move_mess_
 {
-    void *n = NULL;
-    if (connected)
+    uint32_t seq_;
+    unsigned long send_retries_;
+    uint32_t len_;
+    char data_[T2U_MESS_BUFFER_MAX];
+} session_move_mess;
+
+/* a session between runners, see t2u_session_migrate */
+typedef struct session_move_
+{
+    t2u_context *context_;          /* target */
+    char *service_;                 /* rule of the session in target */
+    uint64_t handle_;
+    sock_t sock_;
+    uint32_t send_seq_;
+    uint32_t recv_seq_;
+    uint32_t retry_seq_;
+    uint32_t send_count_;
+    uint32_t recv_count_;
+    session_move_mess mess_[0];     /* send queue, then recv queue */
+} session_move;
+
+static void session_move_free_(session_move *move)
+{
+    free(move->service_);
+    free(move);
+}
+
+static void session_import_cb_(t2u_runner *runner, void *arg)
+{
+    session_move *move = (session_move *)arg;
+    t2u_context *context = move->context_;
+    t2u_rule *rule = NULL;
+    t2u_session *session;
+    t2u_session_window *window;
+    uint32_t i;
+
+    if (rbtree_lookup(runner->contexts_, context))
     {
-        /* sessions_ */
-        n = rbtree_lookup(rule->sessions_, &handle);
+        rule = t2u_rule_tree_find(&context->rules_, move->service_);
     }
-    else
+
+    if (!rule)
     {
-        /* connecting_sessions_  */
-        n = rbtree_lookup(rule->connecting_sessions_, &handle);
+        LOG_(2, "no rule %s to move session with handle: %llu, closed", move->service_,
+            (unsigned long long)move->handle_);
+        if (rbtree_lookup(runner->contexts_, context))
+        {
+            t2u_group_disown(context, move->handle_);
+        }
+        closesocket(move->sock_);
+        session_move_free_(move);
+        return;
     }
-    return (t2u_session *)n;
+
+    session = (t2u_session *)t2u_slab_alloc(&runner->session_slab_);
+    assert(NULL != session);
+    memset(session, 0, sizeof(t2u_session));
+
+    session->rule_ = rule;
+    session->handle_ = move->handle_;
+    session->sock_ = move->sock_;
+    session->status_ = 2;
+    session->send_seq_ = move->send_seq_;
+    session->recv_seq_ = move->recv_seq_;
+    session->retry_seq_ = move->retry_seq_;
+
+    session->ev_ = t2u_event_new(runner);
+    session->ev_->context_ = context;
+    session->ev_->rule_ = rule;
+    session->ev_->session_ = session;
+
+    t2u_session_tree_insert(&rule->sessions_, session);
+
+    /* in flight messages wait for ack or timeout again, no resend now */
+    for (i = 0; i < move->send_count_; i++)
+    {
+        session_move_mess *mm = &move->mess_[i];
+        t2u_restore_request_message(session, mm->seq_, mm->send_retries_, mm->data_, mm->len_);
+    }
+
+    for (i = move->send_count_; i < move->send_count_ + move->recv_count_; i++)
+    {
+        session_move_mess *mm = &move->mess_[i];
+        t2u_message *m = (t2u_message *)t2u_slab_alloc(&runner->message_slab_);
+
+        m->packet_ = t2u_budget_packet_alloc(session, mm->len_);
+        memcpy(m->packet_->data_, mm->data_, mm->len_);
+        m->seq_ = mm->seq_;
+
+        window = t2u_session_window_get(session);
+        t2u_message_tree_insert(&window->recv_mess_, m);
+        window->recv_buffer_count_++;
+    }
+
+    session_idle_link_(session);
+    t2u_session_resume_read(session);
+
+    LOG_(1, "moved session: %p with handle: %llu to context: %p", session,
+        (unsigned long long)session->handle_, context);
+    session_move_free_(move);
 }
 
-static t2u_session *find_session_in_context_walk(rbtree_node *node, uint64_t handle, int connected)
+int t2u_session_migrate(t2u_session *session, t2u_context *target)
 {
-    t2u_session *session = NULL;
-    if (node)
+    t2u_rule *rule = session->rule_;
+    t2u_context *context = rule->context_;
+    t2u_runner *runner = context->runner_;
+    t2u_session_window *window = session->window_;
+    uint32_t send_count = window ? window->send_buffer_count_ : 0;
+    uint32_t recv_count = window ? window->recv_buffer_count_ : 0;
+    session_move *move;
+    control_data cdata;
+    t2u_message *m;
+    uint32_t i = 0;
+
+    /* only established open sessions, a paused one would lose its wakeup */
+    if ((session->status_ != 2) || t2u_budget_blocked(session) || session->fin_ || !context->group_)
     {
-        session = find_session_in_context_walk(node->left, handle, connected);
-        if (!session)
-        {
-            t2u_rule *rule = node->data;
-            session = find_session_in_rule(rule, handle, connected);
+        return -1;
+    }
 
-            if (!session)
-            {
-                session = find_session_in_context_walk(node->right, handle, connected);
-            }
-        }
+    move = (session_move *)malloc(sizeof(session_move) + (send_count + recv_count) * sizeof(session_move_mess));
+    assert(NULL != move);
+
+    move->context_ = target;
+    move->service_ = malloc(strlen(rule->service_) + 1);
+    assert(NULL != move->service_);
+    memcpy(move->service_, rule->service_, strlen(rule->service_) + 1);
+    move->handle_ = session->handle_;
+    move->sock_ = session->sock_;
+    move->send_seq_ = session->send_seq_;
+    move->recv_seq_ = session->recv_seq_;
+    move->retry_seq_ = session->retry_seq_;
+    move->send_count_ = send_count;
+    move->recv_count_ = recv_count;
+
+    /* copy and release the queues, packets are of this runner's pool */
+    while (window && !t2u_rb_empty(&window->send_mess_))
+    {
+        m = t2u_message_tree_first(&window->send_mess_);
+        move->mess_[i].seq_ = m->seq_;
+        move->mess_[i].send_retries_ = m->send_retries_;
+        move->mess_[i].len_ = m->packet_->len_;
+        memcpy(move->mess_[i].data_, m->packet_->data_, m->packet_->len_);
+        i++;
+
+        t2u_delete_event(m->ev_timeout_);
+        t2u_message_tree_remove(&window->send_mess_, m);
+        t2u_budget_packet_free(session, m->packet_);
+        t2u_slab_free(&runner->message_slab_, m);
     }
-    return session;
+
+    while (window && !t2u_rb_empty(&window->recv_mess_))
+    {
+        m = t2u_message_tree_first(&window->recv_mess_);
+        move->mess_[i].seq_ = m->seq_;
+        move->mess_[i].len_ = m->packet_->len_;
+        memcpy(move->mess_[i].data_, m->packet_->data_, m->packet_->len_);
+        i++;
+
+        t2u_message_tree_remove(&window->recv_mess_, m);
+        t2u_budget_packet_free(session, m->packet_);
+        t2u_slab_free(&runner->message_slab_, m);
+    }
+    assert(i == send_count + recv_count);
+
+    if (window)
+    {
+        window->send_buffer_count_ = 0;
+        window->recv_buffer_count_ = 0;
+        t2u_session_park(session);
+    }
+
+    t2u_delete_event(session->ev_);
+    session->ev_ = NULL;
+    t2u_session_tree_remove(&rule->sessions_, session);
+    if (session_idle_linked_(rule, session))
+    {
+        session_idle_unlink_(rule, session);
+    }
+
+    /* route to the target before it has the session, a message between is resent */
+    t2u_group_move(context, session->handle_, target->shard_);
+
+    LOG_(1, "move session: %p with handle: %llu to context: %p", session,
+        (unsigned long long)session->handle_, target);
+    session->sock_ = 0;
+    t2u_slab_free(&runner->session_slab_, session);
+
+    cdata.func_ = session_import_cb_;
+    cdata.arg_ = move;
+    t2u_runner_post(target->runner_, &cdata);
+    return 0;
+}
+
+
+static t2u_session *find_session_in_rule(t2u_rule *rule, uint64_t handle, int connected)
+{
+    if (connected)
+    {
+        /* sessions_ */
+        return t2u_session_tree_find(&rule->sessions_, handle);
+    }
+
+    /* connecting_sessions_  */
+    return t2u_session_tree_find(&rule->connecting_sessions_, handle);
 }
 
 t2u_session *find_session_in_context(t2u_context *context, uint64_t handle, int connected)
 {
-    return find_session_in_context_walk(context->rules_->root, handle, connected);
+    t2u_rule *rule;
+
+    for (rule = t2u_rule_tree_first(&context->rules_); rule; rule = t2u_rule_tree_next(rule))
+    {
+        t2u_session *session = find_session_in_rule(rule, handle, connected);
+        if (session)
+        {
+            return session;
+        }
+    }
+    return NULL;
 }
 
 
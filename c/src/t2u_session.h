@@ -2,7 +2,7 @@
 #define __t2u_session_h__
 
 /* new session while connecting */
-t2u_session *t2u_add_connecting_session(t2u_rule *rule, sock_t sock, uint64_t handle);
+t2u_session *t2u_add_connecting_session(t2u_rule *rule, sock_t sock, uint64_t handle, t2u_peer *peer);
 
 /* delete unestablished session */
 void t2u_delete_connecting_session(t2u_session *session);
@@ -14,7 +14,7 @@ void t2u_delete_connected_session(t2u_session *session, int sync_from_peer);
 void t2u_delete_connected_session_later(t2u_session *session);
 
 /* test and try delete session after delete later */
-void t2u_try_delete_connected_session(t2u_session *session);
+int t2u_try_delete_connected_session(t2u_session *session);
 
 /* handler for connect response */
 void t2u_session_handle_connect_response(t2u_session *session, t2u_message_data *mdata);
@@ -22,6 +22,31 @@ void t2u_session_handle_connect_response(t2u_session *session, t2u_message_data
 /* handler for data request */
 void t2u_session_handle_data_request(t2u_session *session, t2u_message_data *mdata, int mdata_len);
 
+/* send and recv queues of session, allocated if parked */
+t2u_session_window *t2u_session_window_get(t2u_session *session);
+
+/* release the queues when nothing is in flight, session stays usable */
+void t2u_session_park(t2u_session *session);
+
+/* read tcp of the session again, after paused for window or memory */
+void t2u_session_resume_read(t2u_session *session);
+
+/* refresh idle timestamp and move to the hot end of idle list, O(1) */
+void t2u_session_touch(t2u_session *session);
+
+/* arm the idle sweep timer of rule again, after its session timeout changed */
+void t2u_session_idle_rearm(t2u_rule *rule);
+
+/* free the idle sweep timer of rule, sessions must be gone */
+void t2u_session_idle_cleanup(t2u_rule *rule);
+
+/*
+ * move an established session of a group shard to target, another shard.
+ * its socket, sequences and queues go to the target runner, the handle
+ * routes there at once. 0 if moved, the session is gone. in runner
+ */
+int t2u_session_migrate(t2u_session *session, t2u_context *target);
+
 /* tcp */
 void t2u_session_process_tcp(evutil_socket_t sock, short events, void *arg);
 
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <event2/event.h>
+
+#include "t2u.h"
+#include "t2u_internal.h"
+#include "t2u_runner.h"
+#include "t2u_context.h"
+
+/* rounds of settle at one virtual instant, guard against busy loops */
+#define T2U_SIM_SETTLE_MAX (10000)
+
+/* virtual timer, keyed by (due_, serial_) */
+typedef struct t2u_sim_timer_
+{
+    uint64_t due_;                  /* virtual time to fire, us */
+    uint64_t serial_;               /* keep fifo for same due time */
+    struct event *ev_;              /* the event to active */
+} t2u_sim_timer;
+
+/* udp packet in flight */
+typedef struct t2u_sim_packet_
+{
+    struct t2u_sim_packet_ *next_;  /* fifo */
+    t2u_context *to_;               /* receiver context */
+    size_t len_;                    /* length of data */
+    char data_[0];                  /* the udp message */
+} t2u_sim_packet;
+
+typedef struct t2u_sim_
+{
+    t2u_runner *runner_;            /* local runner of sim */
+    struct event_base *base_;       /* the event base, owned */
+    uint64_t now_;                  /* virtual clock, us */
+    uint64_t serial_;               /* timer serial */
+    rbtree *timers_;                /* timers by due time */
+    rbtree *timer_events_;          /* timers by event */
+    t2u_sim_packet *head_;          /* packets in flight */
+    t2u_sim_packet *tail_;
+} t2u_sim;
+
+static int compare_timer(void *a, void *b)
+{
+    t2u_sim_timer *ta = (t2u_sim_timer *)a;
+    t2u_sim_timer *tb = (t2u_sim_timer *)b;
+
+    if (ta->due_ != tb->due_)
+    {
+        return (ta->due_ > tb->due_) ? 1 : -1;
+    }
+
+    if (ta->serial_ != tb->serial_)
+    {
+        return (ta->serial_ > tb->serial_) ? 1 : -1;
+    }
+
+    return 0;
+}
+
+uint64_t t2u_sim_now_us(t2u_sim *sim)
+{
+    return sim->now_;
+}
+
+void t2u_sim_timer_del(t2u_sim *sim, struct event *ev)
+{
+    t2u_sim_timer *timer = (t2u_sim_timer *)rbtree_lookup(sim->timer_events_, ev);
+    if (!timer)
+    {
+        return;
+    }
+
+    rbtree_remove(sim->timers_, timer);
+    rbtree_remove(sim->timer_events_, ev);
+    free(timer);
+}
+
+void t2u_sim_timer_add(t2u_sim *sim, struct event *ev, uint64_t us)
+{
+    t2u_sim_timer *timer;
+
+    /* same as event_add, re-add reschedules */
+    t2u_sim_timer_del(sim, ev);
+
+    timer = (t2u_sim_timer *)malloc(sizeof(t2u_sim_timer));
+    assert(NULL != timer);
+
+    timer->due_ = sim->now_ + us;
+    timer->serial_ = ++sim->serial_;
+    timer->ev_ = ev;
+
+    rbtree_insert(sim->timers_, timer, timer);
+    rbtree_insert(sim->timer_events_, ev, timer);
+}
+
+/* transport hook of sim contexts: the peer receives it in next round */
+static void sim_transmit_(t2u_context *context, const char *data, size_t size)
+{
+    t2u_sim *sim = context->runner_->sim_;
+    t2u_sim_packet *packet = (t2u_sim_packet *)malloc(sizeof(t2u_sim_packet) + size);
+    assert(NULL != packet);
+
+    packet->next_ = NULL;
+    packet->to_ = (t2u_context *)context->transport_arg_;
+    packet->len_ = size;
+    memcpy(packet->data_, data, size);
+
+    if (sim->tail_)
+    {
+        sim->tail_->next_ = packet;
+    }
+    else
+    {
+        sim->head_ = packet;
+    }
+    sim->tail_ = packet;
+}
+
+/* deliver packets in flight, return count */
+static int sim_deliver_(t2u_sim *sim)
+{
+    int count = 0;
+
+    while (sim->head_)
+    {
+        t2u_sim_packet *packet = sim->head_;
+        sim->head_ = packet->next_;
+        if (!sim->head_)
+        {
+            sim->tail_ = NULL;
+        }
+
+        /* the peer may be gone */
+        if (packet->to_ && rbtree_lookup(sim->runner_->contexts_, packet->to_))
+        {
+            t2u_context_process_udp(packet->to_, NULL, packet->data_, (int)packet->len_);
+        }
+
+        free(packet);
+        count++;
+    }
+
+    return count;
+}
+
+/* active timers due now, return count */
+static int sim_fire_timers_(t2u_sim *sim)
+{
+    int count = 0;
+    rbtree_node *node;
+
+    while ((node = rbtree_min(sim->timers_)) != NULL)
+    {
+        t2u_sim_timer *timer = (t2u_sim_timer *)node->data;
+        struct event *ev = timer->ev_;
+
+        if (timer->due_ > sim->now_)
+        {
+            break;
+        }
+
+        t2u_sim_timer_del(sim, ev);
+        event_active(ev, EV_TIMEOUT, 1);
+        count++;
+    }
+
+    return count;
+}
+
+/* run everything of current virtual instant until quiet */
+static void sim_settle_(t2u_sim *sim)
+{
+    int i;
+
+    for (i = 0; i < T2U_SIM_SETTLE_MAX; i++)
+    {
+        int busy = 0;
+
+        event_base_loop(sim->base_, EVLOOP_NONBLOCK);
+        busy += sim_deliver_(sim);
+        busy += sim_fire_timers_(sim);
+        if (!busy)
+        {
+            break;
+        }
+    }
+}
+
+forward_sim create_forward_sim()
+{
+    t2u_sim *sim = (t2u_sim *)malloc(sizeof(t2u_sim));
+    assert(NULL != sim);
+    memset(sim, 0, sizeof(t2u_sim));
+
+    sim->base_ = event_base_new();
+    assert(NULL != sim->base_);
+
+    sim->timers_ = rbtree_init(compare_timer);
+    sim->timer_events_ = rbtree_init(NULL);
+
+    sim->runner_ = t2u_runner_new_local(sim->base_);
+    sim->runner_->sim_ = sim;
+
+    return (forward_sim)sim;
+}
+
+void create_sim_context_pair(forward_sim s, forward_context *c1, forward_context *c2)
+{
+    t2u_sim *sim = (t2u_sim *)s;
+    t2u_context *a = t2u_add_context(sim->runner_, (sock_t)-1);
+    t2u_context *b = t2u_add_context(sim->runner_, (sock_t)-1);
+
+    a->transport_send_ = sim_transmit_;
+    a->transport_arg_ = b;
+    b->transport_send_ = sim_transmit_;
+    b->transport_arg_ = a;
+
+    *c1 = (forward_context)a;
+    *c2 = (forward_context)b;
+}
+
+unsigned long long run_forward_sim(forward_sim s, unsigned long ms)
+{
+    t2u_sim *sim = (t2u_sim *)s;
+    uint64_t target = sim->now_ + (uint64_t)ms * 1000;
+    rbtree_node *node;
+
+    sim_settle_(sim);
+
+    /* jump from timer to timer */
+    while ((node = rbtree_min(sim->timers_)) != NULL)
+    {
+        t2u_sim_timer *timer = (t2u_sim_timer *)node->data;
+        if (timer->due_ > target)
+        {
+            break;
+        }
+
+        sim->now_ = timer->due_;
+        sim_settle_(sim);
+    }
+
+    sim->now_ = target;
+    sim_settle_(sim);
+
+    return sim->now_ / 1000;
+}
+
+void free_forward_sim(forward_sim s)
+{
+    t2u_sim *sim = (t2u_sim *)s;
+
+    /* contexts free their events, timers go with them */
+    t2u_delete_runner(sim->runner_);
+    sim->runner_ = NULL;
+
+    while (sim->timers_->root)
+    {
+        t2u_sim_timer *timer = (t2u_sim_timer *)sim->timers_->root->data;
+        t2u_sim_timer_del(sim, timer->ev_);
+    }
+    free(sim->timers_);
+    free(sim->timer_events_);
+
+    while (sim->head_)
+    {
+        t2u_sim_packet *packet = sim->head_;
+        sim->head_ = packet->next_;
+        free(packet);
+    }
+
+    event_base_free(sim->base_);
+    free(sim);
+}
@@ -0,0 +1,13 @@
+#ifndef __t2u_sim_h__
+#define __t2u_sim_h__
+
+/* virtual clock of simulator, us */
+uint64_t t2u_sim_now_us(struct t2u_sim_ *sim);
+
+/* add or re-add a virtual timer for event, fires us later */
+void t2u_sim_timer_add(struct t2u_sim_ *sim, struct event *ev, uint64_t us);
+
+/* remove the virtual timer of event, if any */
+void t2u_sim_timer_del(struct t2u_sim_ *sim, struct event *ev);
+
+#endif /* __t2u_sim_h__ */
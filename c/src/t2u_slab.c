@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <event2/event.h>
+#if defined _MSC_VER
+#include <malloc.h>
+#endif
+
+#include "t2u.h"
+#include "t2u_internal.h"
+
+/* min page size, and min objects per page */
+#define T2U_SLAB_PAGE_MIN (16384)
+#define T2U_SLAB_PAGE_OBJS (16)
+
+/* page header, objects follow at the next cache line */
+typedef struct t2u_slab_page_
+{
+    struct t2u_slab_page_ *prev_;
+    struct t2u_slab_page_ *next_;
+    void *free_;                    /* free objects in this page */
+    size_t used_;                   /* live objects in this page */
+    size_t fresh_;                  /* objects never handed out */
+} t2u_slab_page;
+
+#define T2U_SLAB_HEADER (((sizeof(t2u_slab_page) + T2U_CACHE_LINE - 1) / T2U_CACHE_LINE) * T2U_CACHE_LINE)
+
+static void *page_alloc_(size_t size)
+{
+#if defined _MSC_VER
+    return _aligned_malloc(size, size);
+#else
+    void *p = NULL;
+    if (posix_memalign(&p, size, size) != 0)
+    {
+        return NULL;
+    }
+    return p;
+#endif
+}
+
+static void page_free_(void *p)
+{
+#if defined _MSC_VER
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+static void list_remove_(t2u_slab_page **head, t2u_slab_page *page)
+{
+    if (page->prev_)
+    {
+        page->prev_->next_ = page->next_;
+    }
+    else
+    {
+        *head = page->next_;
+    }
+    if (page->next_)
+    {
+        page->next_->prev_ = page->prev_;
+    }
+    page->prev_ = page->next_ = NULL;
+}
+
+static void list_push_(t2u_slab_page **head, t2u_slab_page *page)
+{
+    page->prev_ = NULL;
+    page->next_ = *head;
+    if (*head)
+    {
+        (*head)->prev_ = page;
+    }
+    *head = page;
+}
+
+static void list_release_(t2u_slab *slab, t2u_slab_page **head)
+{
+    while (*head)
+    {
+        t2u_slab_page *page = *head;
+        *head = page->next_;
+        page_free_(page);
+        slab->pages_--;
+    }
+}
+
+void t2u_slab_init(t2u_slab *slab, const char *name, size_t size)
+{
+    size_t need;
+
+    memset(slab, 0, sizeof(t2u_slab));
+    slab->name_ = name;
+    slab->size_ = ((size + T2U_CACHE_LINE - 1) / T2U_CACHE_LINE) * T2U_CACHE_LINE;
+
+    need = T2U_SLAB_HEADER + slab->size_ * T2U_SLAB_PAGE_OBJS;
+    slab->page_size_ = T2U_SLAB_PAGE_MIN;
+    while (slab->page_size_ < need)
+    {
+        slab->page_size_ <<= 1;
+    }
+    slab->per_page_ = (slab->page_size_ - T2U_SLAB_HEADER) / slab->size_;
+}
+
+void *t2u_slab_alloc(t2u_slab *slab)
+{
+    t2u_slab_page *page = slab->partial_;
+    void *p;
+
+    if (!page)
+    {
+        page = slab->empty_;
+        slab->empty_ = NULL;
+        if (!page)
+        {
+            page = (t2u_slab_page *)page_alloc_(slab->page_size_);
+            assert(NULL != page);
+            memset(page, 0, sizeof(t2u_slab_page));
+            page->fresh_ = slab->per_page_;
+            slab->pages_++;
+        }
+        list_push_(&slab->partial_, page);
+    }
+
+    if (page->free_)
+    {
+        p = page->free_;
+        page->free_ = *(void **)p;
+    }
+    else
+    {
+        /* carve lazily, untouched objects cost no rss */
+        p = (char *)page + T2U_SLAB_HEADER + (slab->per_page_ - page->fresh_) * slab->size_;
+        page->fresh_--;
+    }
+
+    page->used_++;
+    if (page->used_ == slab->per_page_)
+    {
+        list_remove_(&slab->partial_, page);
+        list_push_(&slab->full_, page);
+    }
+
+    slab->used_++;
+    slab->allocs_++;
+    return p;
+}
+
+void t2u_slab_free(t2u_slab *slab, void *p)
+{
+    t2u_slab_page *page;
+
+    if (!p)
+    {
+        return;
+    }
+
+    page = (t2u_slab_page *)((uintptr_t)p & ~(uintptr_t)(slab->page_size_ - 1));
+
+    if (page->used_ == slab->per_page_)
+    {
+        list_remove_(&slab->full_, page);
+        list_push_(&slab->partial_, page);
+    }
+
+    *(void **)p = page->free_;
+    page->free_ = p;
+    page->used_--;
+
+    slab->used_--;
+    slab->frees_++;
+
+    if (page->used_ == 0)
+    {
+        /* keep one empty page for churn, give the others back */
+        list_remove_(&slab->partial_, page);
+        if (slab->empty_)
+        {
+            page_free_(page);
+            slab->pages_--;
+        }
+        else
+        {
+            slab->empty_ = page;
+        }
+    }
+}
+
+void t2u_slab_destroy(t2u_slab *slab)
+{
+    if (slab->used_)
+    {
+        LOG_(3, "slab %s leaks %lu objects", slab->name_, slab->used_);
+    }
+
+    list_release_(slab, &slab->partial_);
+    list_release_(slab, &slab->full_);
+    list_release_(slab, &slab->empty_);
+}
+
+void t2u_slab_dump(t2u_slab *slab, FILE *fp)
+{
+    fprintf(fp, "  slab %-8s size: %4lu, used: %lu, pages: %lu (%lu bytes), allocs: %llu, frees: %llu\n",
+        slab->name_, (unsigned long)slab->size_, slab->used_,
+        slab->pages_, (unsigned long)(slab->pages_ * slab->page_size_),
+        slab->allocs_, slab->frees_);
+}
@@ -0,0 +1,40 @@
+#ifndef __t2u_slab_h__
+#define __t2u_slab_h__
+
+#define T2U_CACHE_LINE (64)
+
+/*
+ * fixed size object cache, owned by one runner thread so no locks.
+ * pages are aligned to their size, an object finds its page by masking.
+ */
+typedef struct t2u_slab_
+{
+    const char *name_;              /* for debug_dump */
+    size_t size_;                   /* object size, cache line aligned */
+    size_t page_size_;              /* power of 2 */
+    size_t per_page_;               /* objects per page */
+    struct t2u_slab_page_ *partial_;/* pages with free objects */
+    struct t2u_slab_page_ *full_;   /* pages without free objects */
+    struct t2u_slab_page_ *empty_;  /* one cached empty page */
+    unsigned long pages_;           /* pages allocated */
+    unsigned long used_;            /* live objects */
+    unsigned long long allocs_;     /* total allocs */
+    unsigned long long frees_;      /* total frees */
+} t2u_slab;
+
+/* init the cache for objects of size */
+void t2u_slab_init(t2u_slab *slab, const char *name, size_t size);
+
+/* alloc an object, not zeroed */
+void *t2u_slab_alloc(t2u_slab *slab);
+
+/* free an object from this cache, NULL is ok */
+void t2u_slab_free(t2u_slab *slab, void *p);
+
+/* release all pages, live objects are reported as leaks */
+void t2u_slab_destroy(t2u_slab *slab);
+
+/* print the accounting */
+void t2u_slab_dump(t2u_slab *slab, FILE *fp);
+
+#endif /* __t2u_slab_h__ */
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <event2/event.h>
+#include <event2/util.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/bpf.h>
+#endif
+
+#include "t2u.h"
+#include "t2u_internal.h"
+
+#if defined __linux__ && defined SO_ATTACH_REUSEPORT_EBPF
+
+/* handles in the kernel map, later ones are left to the handoff */
+#define T2U_STEER_MAP_MAX (65536)
+
+/* offsets in the udp payload, see t2u_message_data */
+#define T2U_STEER_OPER (6)
+#define T2U_STEER_HANDLE_HI (8)
+#define T2U_STEER_HANDLE_LO (12)
+
+#define INSN_(c, d, s, o, i) { (c), (d), (s), (o), (i) }
+
+static long steer_bpf_(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int steer_map_new_()
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_HASH;
+    attr.key_size = sizeof(uint64_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = T2U_STEER_MAP_MAX;
+    return (int)steer_bpf_(BPF_MAP_CREATE, &attr);
+}
+
+/*
+ * r0 = the reuseport index. ld_abs loads in host order, so the key is the
+ * handle as the sessions keep it. the index is out of range on a map miss,
+ * the kernel hashes then.
+ */
+static int steer_prog_new_(int map, uint32_t count)
+{
+    struct bpf_insn prog[] =
+    {
+        INSN_(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        INSN_(BPF_LD | BPF_ABS | BPF_H, 0, 0, 0, T2U_STEER_OPER),
+        INSN_(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0),
+        INSN_(BPF_LD | BPF_ABS | BPF_W, 0, 0, 0, T2U_STEER_HANDLE_LO),
+        INSN_(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_8, BPF_REG_0, 0, 0),
+
+        /* connect request: a new session, spread by the client half */
+        INSN_(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_7, 0, 2, connect_request),
+        INSN_(BPF_ALU | BPF_MOD | BPF_K, BPF_REG_0, 0, 0, (int32_t)count),
+        INSN_(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+
+        /* connect response is found by the client half only */
+        INSN_(BPF_LD | BPF_ABS | BPF_W, 0, 0, 0, T2U_STEER_HANDLE_HI),
+        INSN_(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_7, 0, 1, connect_response),
+        INSN_(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0),
+        INSN_(BPF_ALU64 | BPF_LSH | BPF_K, BPF_REG_0, 0, 0, 32),
+        INSN_(BPF_ALU64 | BPF_OR | BPF_X, BPF_REG_0, BPF_REG_8, 0, 0),
+        INSN_(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0),
+
+        INSN_(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map),
+        INSN_(0, 0, 0, 0, 0),
+        INSN_(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        INSN_(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+        INSN_(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        INSN_(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 2, 0),
+        INSN_(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_0, 0, 0),
+        INSN_(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        INSN_(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, -1),
+        INSN_(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+    attr.insns = (uint64_t)(uintptr_t)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uint64_t)(uintptr_t)"Apache-2.0";
+    return (int)steer_bpf_(BPF_PROG_LOAD, &attr);
+}
+
+static void steer_update_(int map, uint64_t handle, uint32_t shard)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map;
+    attr.key = (uint64_t)(uintptr_t)&handle;
+    attr.value = (uint64_t)(uintptr_t)&shard;
+    attr.flags = BPF_ANY;
+    if (steer_bpf_(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+    {
+        LOG_(1, "steer map update failed, handle: %llu, errno: %d", (unsigned long long)handle, errno);
+    }
+}
+
+int t2u_steer_attach(t2u_group *group)
+{
+    t2u_group_owner *owner;
+    int map;
+    int prog;
+    int err;
+
+    if (group->steer_map_ >= 0)
+    {
+        return 0;
+    }
+
+    map = steer_map_new_();
+    if (map < 0)
+    {
+        err = errno;
+        LOG_(3, "create steer map failed, errno: %d", err);
+        return err;
+    }
+
+    prog = steer_prog_new_(map, (uint32_t)group->count_);
+    if (prog < 0)
+    {
+        err = errno;
+        LOG_(3, "load steer program failed, errno: %d", err);
+        close(map);
+        return err;
+    }
+
+    /* shard i joined the reuseport group i-th, its index is i */
+    if (setsockopt(group->socks_[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF, &prog, sizeof(prog)) < 0)
+    {
+        err = errno;
+        LOG_(3, "attach steer program failed, errno: %d", err);
+        close(prog);
+        close(map);
+        return err;
+    }
+
+    t2u_mutex_lock(&group->mutex_);
+    group->steer_map_ = map;
+    group->steer_prog_ = prog;
+    for (owner = t2u_owner_tree_first(&group->owners_); owner; owner = t2u_owner_tree_next(owner))
+    {
+        steer_update_(map, owner->handle_, owner->shard_);
+    }
+    t2u_mutex_unlock(&group->mutex_);
+
+    LOG_(1, "steer group %p by handle", (void *)group);
+    return 0;
+}
+
+void t2u_steer_detach(t2u_group *group)
+{
+    if (group->steer_map_ >= 0)
+    {
+        close(group->steer_prog_);
+        close(group->steer_map_);
+        group->steer_prog_ = -1;
+        group->steer_map_ = -1;
+    }
+}
+
+void t2u_steer_own(t2u_group *group, uint64_t handle, uint32_t shard)
+{
+    if (group->steer_map_ >= 0)
+    {
+        steer_update_(group->steer_map_, handle, shard);
+    }
+}
+
+void t2u_steer_disown(t2u_group *group, uint64_t handle)
+{
+    union bpf_attr attr;
+
+    if (group->steer_map_ < 0)
+    {
+        return;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = group->steer_map_;
+    attr.key = (uint64_t)(uintptr_t)&handle;
+    steer_bpf_(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+#else
+
+int t2u_steer_attach(t2u_group *group)
+{
+    (void) group;
+
+    LOG_(3, "reuseport steering is not supported");
+    return ENOSYS;
+}
+
+void t2u_steer_detach(t2u_group *group)
+{
+    (void) group;
+}
+
+void t2u_steer_own(t2u_group *group, uint64_t handle, uint32_t shard)
+{
+    (void) group;
+    (void) handle;
+    (void) shard;
+}
+
+void t2u_steer_disown(t2u_group *group, uint64_t handle)
+{
+    (void) group;
+    (void) handle;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef __t2u_steer_h__
+#define __t2u_steer_h__
+
+/*
+ * reuseport steering of a group, linux only. an ebpf program on the
+ * reuseport sockets picks the shard of a datagram from the handle in its
+ * header, with a kernel copy of the handle -> shard map of the group.
+ * connect requests are spread by the client half of the handle. a handle
+ * not in the map falls back to the kernel hash, and to a handoff.
+ */
+
+/* load the program and map, fill the map with owners_. 0 for ok, else errno */
+int t2u_steer_attach(t2u_group *group);
+
+/* close program and map, the sockets keep the program until closed */
+void t2u_steer_detach(t2u_group *group);
+
+/* handle is owned by shard, in the kernel map. nothing if not attached. with mutex_ */
+void t2u_steer_own(t2u_group *group, uint64_t handle, uint32_t shard);
+
+/* handle is gone from the kernel map. with mutex_ */
+void t2u_steer_disown(t2u_group *group, uint64_t handle);
+
+#endif /* __t2u_steer_h__ */
@@ -1,3 +1,17 @@
+#if defined __linux__ && !defined _GNU_SOURCE
+#define _GNU_SOURCE     /* sched_setaffinity, pthread_setname_np */
+#endif
+#ifdef _MSC_VER
+#define _CRT_RAND_S     /* rand_s */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __GNUC__
+#include <sched.h>
+#include <fcntl.h>
+#endif
+
 #include "t2u_thread.h"
 
 
@@ -20,6 +34,71 @@ int t2u_thr_create(t2u_thr_t *tid, t2u_thr_proc proc, void *arg)
 #endif
 }
 
+int t2u_thr_setup(const t2u_thr_attr *attr)
+{
+    int ret = 0;
+    int r = 0;
+
+#if defined __linux__
+    if (attr->cpus_)
+    {
+        cpu_set_t set;
+        int i;
+
+        CPU_ZERO(&set);
+        for (i = 0; i < 64 && i < CPU_SETSIZE; i++)
+        {
+            if (attr->cpus_ & (1ULL << i))
+            {
+                CPU_SET(i, &set);
+            }
+        }
+        r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        ret = ret ? ret : r;
+    }
+
+    if (attr->name_[0])
+    {
+        r = pthread_setname_np(pthread_self(), attr->name_);
+        ret = ret ? ret : r;
+    }
+#elif defined __APPLE__
+    /* no affinity api, only the name */
+    if (attr->name_[0])
+    {
+        r = pthread_setname_np(attr->name_);
+        ret = ret ? ret : r;
+    }
+#endif
+
+#if defined __GNUC__
+    if (attr->priority_ > 0)
+    {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = attr->priority_;
+        r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        ret = ret ? ret : r;
+    }
+#endif
+
+#ifdef _MSC_VER
+    if (attr->cpus_ && !SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)attr->cpus_))
+    {
+        ret = ret ? ret : (int)GetLastError();
+    }
+
+    if (attr->priority_ > 0 && !SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+    {
+        ret = ret ? ret : (int)GetLastError();
+    }
+#endif
+
+    (void) r;
+    return ret;
+}
+
 /* join thread */
 int t2u_thr_join(t2u_thr_t tid)
 {
@@ -181,4 +260,38 @@ void t2u_sleep(unsigned long ms)
 #ifdef _MSC_VER
     Sleep(ms);
 #endif
-}
\ No newline at end of file
+}
+
+unsigned long long t2u_random64()
+{
+    unsigned long long r = 0;
+#ifdef __GNUC__
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if ((fd < 0) || (read(fd, &r, sizeof(r)) != (ssize_t)sizeof(r)))
+    {
+        /* no urandom, still differs between processes and calls */
+        struct timeval t;
+
+        gettimeofday(&t, NULL);
+        r = ((unsigned long long)t.tv_sec << 32) ^ (unsigned long long)t.tv_usec ^
+            ((unsigned long long)getpid() << 16) ^ (unsigned long long)(size_t)&r;
+        r ^= r >> 33;
+        r *= 0xff51afd7ed558ccdULL;
+        r ^= r >> 33;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+#endif
+#ifdef _MSC_VER
+    unsigned int hi = 0;
+    unsigned int lo = 0;
+
+    rand_s(&hi);
+    rand_s(&lo);
+    r = ((unsigned long long)hi << 32) | lo;
+#endif
+    return r;
+}
@@ -22,14 +22,40 @@
     #error "Compiler not support."
 #endif
 
+/* atomic helpers, full barrier for cas/add, acquire load, release store */
+#if defined __GNUC__
+    typedef volatile long t2u_atomic_t;
+    #define t2u_atomic_load(p)          __atomic_load_n((p), __ATOMIC_ACQUIRE)
+    #define t2u_atomic_store(p, v)      __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+    #define t2u_atomic_add(p, v)        __sync_add_and_fetch((p), (v))
+    #define t2u_atomic_cas(p, o, n)     __sync_bool_compare_and_swap((p), (o), (n))
+#elif defined _MSC_VER
+    typedef volatile LONG t2u_atomic_t;
+    #define t2u_atomic_load(p)          (*(p))
+    #define t2u_atomic_store(p, v)      (*(p) = (v))
+    #define t2u_atomic_add(p, v)        (InterlockedExchangeAdd((p), (v)) + (v))
+    #define t2u_atomic_cas(p, o, n)     (InterlockedCompareExchange((p), (n), (o)) == (o))
+#endif
+
 #ifndef ETIMEDOUT
 #define ETIMEDOUT (110)
 #endif
 #define T2U_ETIMEDOUT (ETIMEDOUT)
 
+/* attributes of a runner thread, applied by the thread itself */
+typedef struct t2u_thr_attr_
+{
+    unsigned long long cpus_;       /* cpu mask, bit i for cpu i. 0 for any */
+    int priority_;                  /* 0 for normal, 1-99 for realtime */
+    char name_[16];                 /* thread name, "" for none */
+} t2u_thr_attr;
+
 /* create a thread */
 int t2u_thr_create(t2u_thr_t *tid, t2u_thr_proc proc, void *arg);
 
+/* apply attr to the calling thread. 0 for ok, else the first error */
+int t2u_thr_setup(const t2u_thr_attr *attr);
+
 /* join thread */
 int t2u_thr_join(t2u_thr_t tid);
 
@@ -60,5 +86,8 @@ t2u_thr_id t2u_thr_self();
 /* sleep ms */
 void t2u_sleep(unsigned long ms);
 
+/* random from the os, for ids others must not guess */
+unsigned long long t2u_random64();
+
 
 #endif /* __t2u_thread_h__ */
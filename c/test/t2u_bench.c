@@ -0,0 +1,1236 @@
+/*
+ * t2u benchmark.
+ *
+ * runs a client and a server context over loopback udp in one process,
+ * with a tcp server behind the server context, and drives tcp clients
+ * through the client context. results are written as json.
+ *
+ * scenarios:
+ *     bulk        one session, one way bulk transfer, throughput
+ *     concurrent  N sessions, one way bulk transfer, aggregate throughput
+ *     pingpong    one session, small message echo, latency
+ *     setup       connect, 1 byte echo, close. session setup rate
+ *     sim         one session bulk transfer in simulation mode, virtual
+ *                 clock and in-memory udp. reproducible for a seed
+ *     matrix      simulated bulk and interactive runs over a grid of rtt,
+ *                 loss and bandwidth, with a plain tcp model for reference
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <event2/event.h>
+#include <assert.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <math.h>
+
+#include "t2u.h"
+#include "t2u_internal.h"
+
+#define BENCH_MAX_SESSIONS (1024)
+#define BENCH_SCENARIO_TIMEOUT (60) /* seconds */
+#define BENCH_SIM_TIMEOUT (3600)    /* virtual seconds */
+#define BENCH_SIM_STALL (60)        /* virtual seconds without progress */
+#define BENCH_MATRIX_AXIS (32)      /* max values per matrix axis */
+
+/* bench config, from command line */
+typedef struct bench_config_
+{
+    const char *scenario;           /* scenario name or "all" */
+    unsigned long window;           /* CTX_UDP_SLIDEWINDOW */
+    unsigned long timeout;          /* CTX_UDP_TIMEOUT, ms */
+    unsigned long payload;          /* bytes per tcp send */
+    unsigned long long bytes;       /* bytes per session for bulk */
+    unsigned long sessions;         /* sessions for concurrent */
+    unsigned long count;            /* iterations for pingpong and setup */
+    const char *output;             /* json output, NULL for stdout */
+    int log_level;                  /* t2u log level to stderr */
+    unsigned long delay;            /* CTX_UDP_DEBUG_DELAY, one way ms */
+    unsigned long loss;             /* CTX_UDP_DEBUG_PACKET_LOSS, 1/10000 */
+    unsigned long burst;            /* CTX_UDP_DEBUG_LOSS_BURST */
+    unsigned long reorder;          /* CTX_UDP_DEBUG_REORDER, 1/10000 */
+    unsigned long bandwidth;        /* CTX_UDP_DEBUG_BANDWIDTH, bps */
+    unsigned long seed;             /* CTX_UDP_DEBUG_SEED */
+    const char *matrix;             /* rtts/losses/bandwidths for matrix */
+} bench_config;
+
+/* one benchmark result */
+typedef struct bench_result_
+{
+    const char *scenario;
+    int completed;                  /* 1 if finished before timeout */
+    unsigned long sessions;
+    unsigned long long bytes;       /* payload bytes delivered */
+    unsigned long count;            /* iterations done */
+    double seconds;                 /* wall time, virtual time for sim */
+    double wall_seconds;            /* wall time */
+    unsigned long long retrans;     /* udp packets sent again, both contexts */
+    unsigned long long udp_sent;    /* udp packets sent, both contexts */
+    double throughput_mbps;         /* payload megabits per second */
+    double rate;                    /* iterations per second */
+    double lat_avg_us;
+    double lat_p50_us;
+    double lat_p99_us;
+    double lat_max_us;
+} bench_result;
+
+/* one cell of the matrix, simulated */
+typedef struct bench_cell_
+{
+    unsigned long rtt;              /* ms */
+    unsigned long loss;             /* 1/10000 */
+    unsigned long bandwidth;        /* bps, 0 unlimited */
+    bench_result bulk;
+    bench_result interactive;
+    double tcp_mbps;                /* plain tcp reference, model */
+    double tcp_p99_ms;
+} bench_cell;
+
+/* server behavior, set before each scenario */
+enum bench_server_mode
+{
+    bench_server_sink,
+    bench_server_echo,
+};
+
+/* tcp server behind the server context */
+typedef struct bench_server_
+{
+    struct event_base *base_;
+    struct event *ev_listen_;
+    struct event *ev_tick_;         /* wakes the loop to see loopbreak */
+    sock_t sock_;
+    unsigned short port_;
+    t2u_thr_t thread_;
+} bench_server;
+
+/* tunnel: a client and server context pair */
+typedef struct bench_tunnel_
+{
+    sock_t usock_[2];               /* 0 client, 1 server */
+    forward_context context_[2];
+    forward_rule rule_[2];
+    unsigned short port_;           /* client rule listen port */
+} bench_tunnel;
+
+/* bulk sender thread */
+typedef struct bench_sender_
+{
+    unsigned short port_;
+    unsigned long payload_;
+    unsigned long long bytes_;
+    unsigned long long wait_;       /* sink bytes to wait for before close */
+    int ok_;
+    t2u_thr_t thread_;
+} bench_sender;
+
+static volatile int g_server_mode = bench_server_sink;
+static t2u_atomic_t g_sink_bytes = 0;
+
+
+static double now_()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void bench_log(int level, const char *mess)
+{
+    fprintf(stderr, "%d %s", level, mess);
+}
+
+static int compare_double_(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+/* sorts lat */
+static void latency_stats_(bench_result *result, double *lat, double total, unsigned long n)
+{
+    if (n > 0)
+    {
+        qsort(lat, n, sizeof(double), compare_double_);
+        result->lat_avg_us = total / n;
+        result->lat_p50_us = lat[n / 2];
+        result->lat_p99_us = lat[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1];
+        result->lat_max_us = lat[n - 1];
+    }
+}
+
+static unsigned short sock_port_(sock_t s)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    getsockname(s, (struct sockaddr *)&addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+/* blocking tcp connect to loopback */
+static sock_t connect_loopback_(unsigned short port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    sock_t s = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (s == -1)
+    {
+        return -1;
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(port);
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        closesocket(s);
+        return -1;
+    }
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (void *)&one, sizeof(one));
+    return s;
+}
+
+static int send_all_(sock_t s, const char *buff, size_t len)
+{
+    size_t n = 0;
+    while (n < len)
+    {
+        ssize_t r = send(s, buff + n, len - n, MSG_NOSIGNAL);
+        if (r <= 0)
+        {
+            if (r < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        n += (size_t)r;
+    }
+    return 0;
+}
+
+static int recv_all_(sock_t s, char *buff, size_t len)
+{
+    size_t n = 0;
+    while (n < len)
+    {
+        ssize_t r = recv(s, buff + n, len - n, 0);
+        if (r <= 0)
+        {
+            if (r < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        n += (size_t)r;
+    }
+    return 0;
+}
+
+
+/******************** tcp server ********************/
+
+static void server_conn_cb_(evutil_socket_t sock, short events, void *arg)
+{
+    struct event *ev = *(struct event **)arg;
+    char buff[16384];
+    ssize_t r;
+
+    (void)events;
+
+    r = recv(sock, buff, sizeof(buff), 0);
+    if (r > 0)
+    {
+        if (g_server_mode == bench_server_echo)
+        {
+            send_all_(sock, buff, (size_t)r);
+        }
+        else
+        {
+            t2u_atomic_add(&g_sink_bytes, (long)r);
+        }
+        return;
+    }
+
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return;
+    }
+
+    /* closed by peer */
+    event_free(ev);
+    free(arg);
+    closesocket(sock);
+}
+
+static void server_accept_cb_(evutil_socket_t sock, short events, void *arg)
+{
+    bench_server *server = (bench_server *)arg;
+    struct event **pev;
+    int one = 1;
+    sock_t s = accept(sock, NULL, NULL);
+
+    (void)events;
+
+    if (s < 0)
+    {
+        return;
+    }
+
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (void *)&one, sizeof(one));
+    evutil_make_socket_nonblocking(s);
+
+    /* the event frees itself on close */
+    pev = (struct event **)malloc(sizeof(struct event *));
+    assert(NULL != pev);
+    *pev = event_new(server->base_, s, EV_READ | EV_PERSIST, server_conn_cb_, pev);
+    event_add(*pev, NULL);
+}
+
+static void server_tick_cb_(evutil_socket_t sock, short events, void *arg)
+{
+    (void)sock;
+    (void)events;
+    (void)arg;
+}
+
+static void *server_loop_(void *arg)
+{
+    bench_server *server = (bench_server *)arg;
+    event_base_dispatch(server->base_);
+    return NULL;
+}
+
+static bench_server *server_start_()
+{
+    struct sockaddr_in addr;
+    struct timeval tick = { 0, 100000 };
+    bench_server *server = (bench_server *)malloc(sizeof(bench_server));
+    assert(NULL != server);
+
+    server->sock_ = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = 0;
+    if (-1 == bind(server->sock_, (struct sockaddr *)&addr, sizeof(addr)) ||
+        -1 == listen(server->sock_, 1024))
+    {
+        fprintf(stderr, "bench server listen failed. %d\n", errno);
+        exit(1);
+    }
+    server->port_ = sock_port_(server->sock_);
+    evutil_make_socket_nonblocking(server->sock_);
+
+    server->base_ = event_base_new();
+    server->ev_listen_ = event_new(server->base_, server->sock_, EV_READ | EV_PERSIST, server_accept_cb_, server);
+    event_add(server->ev_listen_, NULL);
+
+    /* libevent is not thread enabled, loopbreak from main is seen on next tick */
+    server->ev_tick_ = event_new(server->base_, -1, EV_PERSIST, server_tick_cb_, NULL);
+    event_add(server->ev_tick_, &tick);
+
+    t2u_thr_create(&server->thread_, server_loop_, server);
+    return server;
+}
+
+static void server_stop_(bench_server *server)
+{
+    event_base_loopbreak(server->base_);
+    t2u_thr_join(server->thread_);
+
+    /* connection events left are freed with the base */
+    event_free(server->ev_listen_);
+    event_free(server->ev_tick_);
+    event_base_free(server->base_);
+    closesocket(server->sock_);
+    free(server);
+}
+
+
+/******************** tunnel ********************/
+
+static void context_options_(forward_context context, const bench_config *config, int i)
+{
+    set_context_option(context, CTX_UDP_SLIDEWINDOW, config->window);
+    set_context_option(context, CTX_UDP_TIMEOUT, config->timeout);
+
+    /* emulated link, same for both directions */
+    set_context_option(context, CTX_UDP_DEBUG_SEED, config->seed + i);
+    set_context_option(context, CTX_UDP_DEBUG_DELAY, config->delay);
+    set_context_option(context, CTX_UDP_DEBUG_PACKET_LOSS, config->loss);
+    set_context_option(context, CTX_UDP_DEBUG_LOSS_BURST, config->burst);
+    set_context_option(context, CTX_UDP_DEBUG_REORDER, config->reorder);
+    set_context_option(context, CTX_UDP_DEBUG_BANDWIDTH, config->bandwidth);
+}
+
+static void tunnel_open_(bench_tunnel *tunnel, const bench_config *config, unsigned short server_port)
+{
+    struct sockaddr_in addr;
+    int i;
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = 0;
+
+    for (i = 0; i < 2; i++)
+    {
+        tunnel->usock_[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (-1 == bind(tunnel->usock_[i], (struct sockaddr *)&addr, sizeof(addr)))
+        {
+            fprintf(stderr, "bench udp bind failed. %d\n", errno);
+            exit(1);
+        }
+    }
+
+    /* connect the pair to each other */
+    for (i = 0; i < 2; i++)
+    {
+        addr.sin_port = htons(sock_port_(tunnel->usock_[1 - i]));
+        if (-1 == connect(tunnel->usock_[i], (struct sockaddr *)&addr, sizeof(addr)))
+        {
+            fprintf(stderr, "bench udp connect failed. %d\n", errno);
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        tunnel->context_[i] = create_forward(tunnel->usock_[i]);
+        context_options_(tunnel->context_[i], config, i);
+    }
+
+    tunnel->rule_[1] = add_forward_rule(tunnel->context_[1], forward_server_mode, "bench", "127.0.0.1", server_port);
+    tunnel->rule_[0] = add_forward_rule(tunnel->context_[0], forward_client_mode, "bench", "127.0.0.1", 0);
+    if (!tunnel->rule_[0] || !tunnel->rule_[1])
+    {
+        fprintf(stderr, "bench add rule failed.\n");
+        exit(1);
+    }
+
+    tunnel->port_ = sock_port_(((t2u_rule *)tunnel->rule_[0])->listen_sock_);
+}
+
+/* stat summed over both contexts */
+static unsigned long long tunnel_stat_(forward_context *contexts, int stat)
+{
+    return get_context_stat(contexts[0], stat) + get_context_stat(contexts[1], stat);
+}
+
+static void tunnel_close_(bench_tunnel *tunnel)
+{
+    int i;
+    for (i = 0; i < 2; i++)
+    {
+        free_forward(tunnel->context_[i]);
+        closesocket(tunnel->usock_[i]);
+    }
+}
+
+
+/******************** scenarios ********************/
+
+static void *sender_loop_(void *arg)
+{
+    bench_sender *sender = (bench_sender *)arg;
+    char *buff = (char *)malloc(sender->payload_);
+    unsigned long long sent = 0;
+    sock_t s;
+
+    assert(NULL != buff);
+    memset(buff, 0x5a, sender->payload_);
+    sender->ok_ = 0;
+
+    s = connect_loopback_(sender->port_);
+    if (s != -1)
+    {
+        while (sent < sender->bytes_)
+        {
+            size_t n = sender->payload_;
+            if (sender->bytes_ - sent < n)
+            {
+                n = (size_t)(sender->bytes_ - sent);
+            }
+            if (send_all_(s, buff, n) != 0)
+            {
+                break;
+            }
+            sent += n;
+        }
+        sender->ok_ = (sent == sender->bytes_);
+
+        /* keep the session until the sink has got all bytes */
+        while (sender->ok_ && (unsigned long long)t2u_atomic_load(&g_sink_bytes) < sender->wait_)
+        {
+            t2u_sleep(1);
+        }
+        closesocket(s);
+    }
+
+    free(buff);
+    return NULL;
+}
+
+static void run_bulk_(const bench_config *config, unsigned short port, unsigned long sessions, bench_result *result)
+{
+    bench_sender *senders = (bench_sender *)calloc(sessions, sizeof(bench_sender));
+    unsigned long long expected = config->bytes * sessions;
+    unsigned long i;
+    double start;
+    double deadline;
+
+    assert(NULL != senders);
+    g_server_mode = bench_server_sink;
+    t2u_atomic_store(&g_sink_bytes, 0);
+
+    start = now_();
+    deadline = start + BENCH_SCENARIO_TIMEOUT;
+
+    for (i = 0; i < sessions; i++)
+    {
+        senders[i].port_ = port;
+        senders[i].payload_ = config->payload;
+        senders[i].bytes_ = config->bytes;
+        senders[i].wait_ = expected;
+        t2u_thr_create(&senders[i].thread_, sender_loop_, &senders[i]);
+    }
+
+    while ((unsigned long long)t2u_atomic_load(&g_sink_bytes) < expected && now_() < deadline)
+    {
+        t2u_sleep(1);
+    }
+
+    result->seconds = now_() - start;
+    result->bytes = (unsigned long long)t2u_atomic_load(&g_sink_bytes);
+    result->completed = (result->bytes >= expected);
+    result->sessions = sessions;
+    result->throughput_mbps = result->bytes * 8 / result->seconds / 1e6;
+
+    /* senders leave when sink has all of their bytes, or on error */
+    if (!result->completed)
+    {
+        t2u_atomic_store(&g_sink_bytes, (long)expected);
+    }
+    for (i = 0; i < sessions; i++)
+    {
+        t2u_thr_join(senders[i].thread_);
+    }
+    free(senders);
+}
+
+static void run_pingpong_(const bench_config *config, unsigned short port, bench_result *result)
+{
+    char *buff = (char *)malloc(config->payload);
+    double *lat = (double *)calloc(config->count, sizeof(double));
+    double start;
+    double deadline;
+    double total = 0;
+    unsigned long i;
+    sock_t s;
+
+    assert(NULL != buff && NULL != lat);
+    memset(buff, 0x5a, config->payload);
+    g_server_mode = bench_server_echo;
+    result->sessions = 1;
+
+    s = connect_loopback_(port);
+    start = now_();
+    deadline = start + BENCH_SCENARIO_TIMEOUT;
+
+    for (i = 0; s != -1 && i < config->count && now_() < deadline; i++)
+    {
+        double t = now_();
+        if (send_all_(s, buff, config->payload) != 0 ||
+            recv_all_(s, buff, config->payload) != 0)
+        {
+            break;
+        }
+        lat[i] = (now_() - t) * 1e6;
+        total += lat[i];
+    }
+
+    result->seconds = now_() - start;
+    result->count = i;
+    result->completed = (i == config->count);
+    result->bytes = (unsigned long long)i * config->payload * 2;
+    result->rate = i / result->seconds;
+
+    latency_stats_(result, lat, total, i);
+
+    if (s != -1)
+    {
+        closesocket(s);
+    }
+    free(lat);
+    free(buff);
+}
+
+static void run_setup_(const bench_config *config, unsigned short port, bench_result *result)
+{
+    double *lat = (double *)calloc(config->count, sizeof(double));
+    double start;
+    double deadline;
+    double total = 0;
+    unsigned long i;
+
+    assert(NULL != lat);
+    g_server_mode = bench_server_echo;
+    result->sessions = 1;
+
+    start = now_();
+    deadline = start + BENCH_SCENARIO_TIMEOUT;
+
+    for (i = 0; i < config->count && now_() < deadline; i++)
+    {
+        char c = 'x';
+        double t = now_();
+        sock_t s = connect_loopback_(port);
+
+        /* the echo proves the session is established end to end */
+        if (s == -1 || send_all_(s, &c, 1) != 0 || recv_all_(s, &c, 1) != 0)
+        {
+            if (s != -1)
+            {
+                closesocket(s);
+            }
+            break;
+        }
+        closesocket(s);
+
+        lat[i] = (now_() - t) * 1e6;
+        total += lat[i];
+    }
+
+    result->seconds = now_() - start;
+    result->count = i;
+    result->completed = (i == config->count);
+    result->rate = i / result->seconds;
+
+    latency_stats_(result, lat, total, i);
+    free(lat);
+}
+
+/******************** simulation ********************/
+
+/* simulated tunnel. the tcp ends are real loopback sockets driven from
+ * this thread, the udp link and all timers are virtual */
+typedef struct bench_sim_
+{
+    forward_sim sim_;
+    forward_context context_[2];
+    forward_rule rule_[2];
+    sock_t listen_;                 /* tcp server behind the server rule */
+    sock_t client_;                 /* tcp client of the client rule */
+    sock_t server_;                 /* accepted from listen_ */
+    int echo_;                      /* server echoes, else sinks */
+    unsigned long long sink_;       /* bytes got by the sink */
+    unsigned long long now_;        /* virtual ms */
+} bench_sim;
+
+static void sim_open_(bench_sim *bs, const bench_config *config, int echo)
+{
+    struct sockaddr_in addr;
+    int i;
+
+    memset(bs, 0, sizeof(*bs));
+    bs->server_ = -1;
+    bs->echo_ = echo;
+    bs->sim_ = create_forward_sim();
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = 0;
+    bs->listen_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (-1 == bind(bs->listen_, (struct sockaddr *)&addr, sizeof(addr)) || -1 == listen(bs->listen_, 16))
+    {
+        fprintf(stderr, "bench sim listen failed. %d\n", errno);
+        exit(1);
+    }
+    evutil_make_socket_nonblocking(bs->listen_);
+
+    create_sim_context_pair(bs->sim_, &bs->context_[0], &bs->context_[1]);
+    for (i = 0; i < 2; i++)
+    {
+        context_options_(bs->context_[i], config, i);
+    }
+    bs->rule_[1] = add_forward_rule(bs->context_[1], forward_server_mode, "bench", "127.0.0.1", sock_port_(bs->listen_));
+    bs->rule_[0] = add_forward_rule(bs->context_[0], forward_client_mode, "bench", "127.0.0.1", 0);
+    if (!bs->rule_[0] || !bs->rule_[1])
+    {
+        fprintf(stderr, "bench add rule failed.\n");
+        exit(1);
+    }
+
+    bs->client_ = connect_loopback_(sock_port_(((t2u_rule *)bs->rule_[0])->listen_sock_));
+    if (bs->client_ != -1)
+    {
+        evutil_make_socket_nonblocking(bs->client_);
+    }
+}
+
+/* serve the tcp server side, then run 1ms of virtual time */
+static void sim_step_(bench_sim *bs)
+{
+    char buff[16384];
+    ssize_t r;
+
+    if (bs->server_ == -1)
+    {
+        bs->server_ = accept(bs->listen_, NULL, NULL);
+        if (bs->server_ != -1)
+        {
+            evutil_make_socket_nonblocking(bs->server_);
+        }
+    }
+
+    while (bs->server_ != -1 && (r = recv(bs->server_, buff, sizeof(buff), 0)) > 0)
+    {
+        bs->sink_ += (unsigned long long)r;
+        if (bs->echo_)
+        {
+            /* small messages, the socket buffer takes them */
+            send(bs->server_, buff, (size_t)r, MSG_NOSIGNAL);
+        }
+    }
+
+    bs->now_ = run_forward_sim(bs->sim_, 1);
+}
+
+static void sim_close_(bench_sim *bs)
+{
+    free_forward_sim(bs->sim_);
+    if (bs->client_ != -1)
+    {
+        closesocket(bs->client_);
+    }
+    if (bs->server_ != -1)
+    {
+        closesocket(bs->server_);
+    }
+    closesocket(bs->listen_);
+}
+
+/* one way bulk transfer, virtual time */
+static void run_sim_bulk_(bench_sim *bs, const bench_config *config, bench_result *result)
+{
+    char *buff = (char *)malloc(config->payload);
+    unsigned long long sent = 0;
+    unsigned long long start = bs->now_;
+    unsigned long long progress = bs->now_;
+    unsigned long long sink = 0;
+    double wall = now_();
+
+    assert(NULL != buff);
+    memset(buff, 0x5a, config->payload);
+    result->sessions = 1;
+
+    while (bs->client_ != -1 && bs->sink_ < config->bytes && bs->now_ - start < BENCH_SIM_TIMEOUT * 1000ULL &&
+        bs->now_ - progress < BENCH_SIM_STALL * 1000ULL)
+    {
+        if (bs->sink_ != sink)
+        {
+            sink = bs->sink_;
+            progress = bs->now_;
+        }
+
+        while (sent < config->bytes)
+        {
+            size_t n = config->payload;
+            ssize_t r;
+            if (config->bytes - sent < n)
+            {
+                n = (size_t)(config->bytes - sent);
+            }
+            r = send(bs->client_, buff, n, MSG_NOSIGNAL);
+            if (r <= 0)
+            {
+                break;
+            }
+            sent += (unsigned long long)r;
+        }
+
+        sim_step_(bs);
+    }
+
+    result->wall_seconds = now_() - wall;
+    result->seconds = (bs->now_ - start) / 1000.0;
+    result->bytes = bs->sink_;
+    result->completed = (bs->sink_ >= config->bytes);
+    result->throughput_mbps = result->seconds > 0 ? bs->sink_ * 8 / result->seconds / 1e6 : 0;
+    free(buff);
+}
+
+/* small message echo, virtual time. latency resolution is 1ms */
+static void run_sim_pingpong_(bench_sim *bs, const bench_config *config, bench_result *result)
+{
+    char *buff = (char *)malloc(config->payload);
+    double *lat = (double *)calloc(config->count, sizeof(double));
+    unsigned long long start = bs->now_;
+    unsigned long long limit = start + BENCH_SIM_TIMEOUT * 1000ULL;
+    double wall = now_();
+    double total = 0;
+    unsigned long i;
+
+    assert(NULL != buff && NULL != lat);
+    memset(buff, 0x5a, config->payload);
+    result->sessions = 1;
+
+    for (i = 0; bs->client_ != -1 && i < config->count && bs->now_ < limit; i++)
+    {
+        unsigned long long t = bs->now_;
+        size_t got = 0;
+        ssize_t r;
+
+        if (send_all_(bs->client_, buff, config->payload) != 0)
+        {
+            break;
+        }
+
+        while (got < config->payload && bs->now_ < limit && bs->now_ - t < BENCH_SIM_STALL * 1000ULL)
+        {
+            sim_step_(bs);
+            while (got < config->payload && (r = recv(bs->client_, buff, config->payload - got, 0)) > 0)
+            {
+                got += (size_t)r;
+            }
+        }
+        if (got < config->payload)
+        {
+            break;
+        }
+
+        lat[i] = (bs->now_ - t) * 1000.0;
+        total += lat[i];
+    }
+
+    result->wall_seconds = now_() - wall;
+    result->seconds = (bs->now_ - start) / 1000.0;
+    result->count = i;
+    result->completed = (i == config->count);
+    result->bytes = (unsigned long long)i * config->payload * 2;
+    result->rate = result->seconds > 0 ? i / result->seconds : 0;
+    latency_stats_(result, lat, total, i);
+
+    free(lat);
+    free(buff);
+}
+
+static void sim_stats_(bench_sim *bs, bench_result *result)
+{
+    result->retrans = tunnel_stat_(bs->context_, CTX_STAT_UDP_RETRANS_PACKETS);
+    result->udp_sent = tunnel_stat_(bs->context_, CTX_STAT_UDP_SENT_PACKETS);
+}
+
+static void run_sim_(const bench_config *config, bench_result *result)
+{
+    bench_sim bs;
+
+    sim_open_(&bs, config, 0);
+    run_sim_bulk_(&bs, config, result);
+    sim_stats_(&bs, result);
+    sim_close_(&bs);
+}
+
+
+/******************** matrix ********************/
+
+/*
+ * reference for plain tcp over the same link, the mathis model:
+ * goodput = mss / rtt * 1.22 / sqrt(p), capped by the bandwidth and by a
+ * 4MB receive window. latency p99 is one rtt, plus a 200ms min rto when
+ * more than 1% of the exchanges lose a packet.
+ */
+#define BENCH_TCP_MSS (1448.0)
+#define BENCH_TCP_WINDOW (4.0 * 1024 * 1024)
+#define BENCH_TCP_MIN_RTO (200.0)
+
+static double tcp_model_mbps_(unsigned long rtt, unsigned long loss, unsigned long bandwidth)
+{
+    double r = (rtt > 0 ? rtt : 1) / 1000.0;
+    double p = loss / 10000.0;
+    double bps = BENCH_TCP_WINDOW * 8 / r;
+
+    if (p > 0)
+    {
+        double mathis = BENCH_TCP_MSS * 8 / r * 1.22 / sqrt(p);
+        bps = mathis < bps ? mathis : bps;
+    }
+    if (bandwidth > 0 && bandwidth < bps)
+    {
+        bps = (double)bandwidth;
+    }
+    return bps / 1e6;
+}
+
+static double tcp_model_p99_ms_(unsigned long rtt, unsigned long loss)
+{
+    double p = loss / 10000.0;
+    double lost = 1.0 - (1.0 - p) * (1.0 - p);
+    double rto = 2.0 * rtt > BENCH_TCP_MIN_RTO ? 2.0 * rtt : BENCH_TCP_MIN_RTO;
+
+    return rtt + (lost > 0.01 ? rto : 0);
+}
+
+/* parse "1,10,50" into list, return count */
+static int parse_list_(const char *s, unsigned long *list, int max)
+{
+    int n = 0;
+    char *end;
+
+    while (*s && n < max)
+    {
+        list[n++] = strtoul(s, &end, 0);
+        if (*end != ',')
+        {
+            break;
+        }
+        s = end + 1;
+    }
+    return n;
+}
+
+static void run_cell_(const bench_config *config, bench_cell *cell)
+{
+    bench_config c = *config;
+    bench_sim bs;
+    int mode;
+
+    c.loss = cell->loss;
+    c.bandwidth = cell->bandwidth;
+
+    /* bulk, then interactive, each on a fresh tunnel */
+    for (mode = 0; mode < 2; mode++)
+    {
+        bench_result *result = mode ? &cell->interactive : &cell->bulk;
+
+        memset(result, 0, sizeof(*result));
+        result->scenario = mode ? "interactive" : "bulk";
+
+        sim_open_(&bs, &c, mode);
+
+        /* split the rtt over both directions */
+        set_context_option(bs.context_[0], CTX_UDP_DEBUG_DELAY, cell->rtt / 2);
+        set_context_option(bs.context_[1], CTX_UDP_DEBUG_DELAY, cell->rtt - cell->rtt / 2);
+
+        if (mode)
+        {
+            run_sim_pingpong_(&bs, &c, result);
+        }
+        else
+        {
+            run_sim_bulk_(&bs, &c, result);
+        }
+        sim_stats_(&bs, result);
+        sim_close_(&bs);
+    }
+
+    cell->tcp_mbps = tcp_model_mbps_(cell->rtt, cell->loss, cell->bandwidth);
+    cell->tcp_p99_ms = tcp_model_p99_ms_(cell->rtt, cell->loss);
+}
+
+/* matrix "rtts/losses/bandwidths", each a comma list */
+static int run_matrix_(const bench_config *config, bench_cell **cells)
+{
+    unsigned long rtt[BENCH_MATRIX_AXIS];
+    unsigned long loss[BENCH_MATRIX_AXIS];
+    unsigned long bw[BENCH_MATRIX_AXIS];
+    int nrtt;
+    int nloss;
+    int nbw;
+    int n = 0;
+    int i, j, k;
+    const char *s = config->matrix;
+
+    nrtt = parse_list_(s, rtt, BENCH_MATRIX_AXIS);
+    s = strchr(s, '/');
+    nloss = s ? parse_list_(s + 1, loss, BENCH_MATRIX_AXIS) : 0;
+    s = s ? strchr(s + 1, '/') : NULL;
+    nbw = s ? parse_list_(s + 1, bw, BENCH_MATRIX_AXIS) : 0;
+
+    if (nrtt == 0 || nloss == 0 || nbw == 0)
+    {
+        return -1;
+    }
+
+    *cells = (bench_cell *)calloc(nrtt * nloss * nbw, sizeof(bench_cell));
+    assert(NULL != *cells);
+
+    for (k = 0; k < nbw; k++)
+    {
+        for (j = 0; j < nloss; j++)
+        {
+            for (i = 0; i < nrtt; i++)
+            {
+                bench_cell *cell = &(*cells)[n++];
+                cell->rtt = rtt[i];
+                cell->loss = loss[j];
+                cell->bandwidth = bw[k];
+                run_cell_(config, cell);
+            }
+        }
+    }
+    return n;
+}
+
+static int run_scenario_(const bench_config *config, const char *scenario, bench_result *result)
+{
+    bench_server *server;
+    bench_tunnel tunnel;
+
+    memset(result, 0, sizeof(*result));
+    result->scenario = scenario;
+
+    if (!strcmp(scenario, "sim"))
+    {
+        run_sim_(config, result);
+        return 0;
+    }
+
+    if (strcmp(scenario, "bulk") && strcmp(scenario, "concurrent") &&
+        strcmp(scenario, "pingpong") && strcmp(scenario, "setup"))
+    {
+        return -1;
+    }
+
+    server = server_start_();
+    tunnel_open_(&tunnel, config, server->port_);
+
+    if (!strcmp(scenario, "bulk"))
+    {
+        run_bulk_(config, tunnel.port_, 1, result);
+    }
+    else if (!strcmp(scenario, "concurrent"))
+    {
+        run_bulk_(config, tunnel.port_, config->sessions, result);
+    }
+    else if (!strcmp(scenario, "pingpong"))
+    {
+        run_pingpong_(config, tunnel.port_, result);
+    }
+    else
+    {
+        run_setup_(config, tunnel.port_, result);
+    }
+
+    result->wall_seconds = result->seconds;
+    result->retrans = tunnel_stat_(tunnel.context_, CTX_STAT_UDP_RETRANS_PACKETS);
+    result->udp_sent = tunnel_stat_(tunnel.context_, CTX_STAT_UDP_SENT_PACKETS);
+
+    tunnel_close_(&tunnel);
+    server_stop_(server);
+    return 0;
+}
+
+
+/******************** output ********************/
+
+static void print_result_(FILE *fp, const bench_result *r, int last)
+{
+    fprintf(fp, "    {\"scenario\": \"%s\", \"completed\": %s, \"sessions\": %lu, "
+        "\"bytes\": %llu, \"count\": %lu, \"seconds\": %.6f, \"wall_seconds\": %.6f, "
+        "\"udp_sent\": %llu, \"retrans\": %llu, "
+        "\"throughput_mbps\": %.3f, \"rate_per_sec\": %.3f, "
+        "\"latency_us\": {\"avg\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f}}%s\n",
+        r->scenario, r->completed ? "true" : "false", r->sessions,
+        r->bytes, r->count, r->seconds, r->wall_seconds,
+        r->udp_sent, r->retrans,
+        r->throughput_mbps, r->rate,
+        r->lat_avg_us, r->lat_p50_us, r->lat_p99_us, r->lat_max_us,
+        last ? "" : ",");
+}
+
+static double retrans_ratio_(const bench_result *r)
+{
+    return r->udp_sent ? (double)r->retrans / r->udp_sent : 0;
+}
+
+static void print_cell_(FILE *fp, const bench_cell *c, int last)
+{
+    fprintf(fp, "    {\"rtt_ms\": %lu, \"loss\": %lu, \"bandwidth_bps\": %lu, "
+        "\"bulk\": {\"completed\": %s, \"seconds\": %.3f, \"goodput_mbps\": %.3f, "
+        "\"retrans\": %llu, \"retrans_ratio\": %.4f}, "
+        "\"interactive\": {\"completed\": %s, \"count\": %lu, \"p50_ms\": %.1f, \"p99_ms\": %.1f, "
+        "\"retrans_ratio\": %.4f}, "
+        "\"tcp_model\": {\"goodput_mbps\": %.3f, \"p99_ms\": %.1f}}%s\n",
+        c->rtt, c->loss, c->bandwidth,
+        c->bulk.completed ? "true" : "false", c->bulk.seconds, c->bulk.throughput_mbps,
+        c->bulk.retrans, retrans_ratio_(&c->bulk),
+        c->interactive.completed ? "true" : "false", c->interactive.count,
+        c->interactive.lat_p50_us / 1000, c->interactive.lat_p99_us / 1000,
+        retrans_ratio_(&c->interactive),
+        c->tcp_mbps, c->tcp_p99_ms,
+        last ? "" : ",");
+}
+
+static void usage_(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -s scenario   bulk|concurrent|pingpong|setup|sim|all|matrix, default all\n"
+        "  -w window     udp slide window, default 16\n"
+        "  -t timeout    udp timeout in ms, default 500\n"
+        "  -p payload    bytes per tcp send, default 1400\n"
+        "  -b bytes      bytes per session for bulk, default 16777216\n"
+        "  -n sessions   sessions for concurrent, default 8\n"
+        "  -c count      iterations for pingpong and setup, default 1000\n"
+        "  -o file       json output, default stdout\n"
+        "  -l level      t2u log level to stderr, default 3\n"
+        "  -D ms         emulated one way delay, default 0\n"
+        "  -L loss       emulated loss in 1/10000, default 0\n"
+        "  -B packets    emulated mean loss burst length, default 0\n"
+        "  -R reorder    emulated reorder in 1/10000, default 0\n"
+        "  -K bps        emulated bandwidth, default 0 unlimited\n"
+        "  -S seed       emulator seed, default 1\n"
+        "  -M matrix     rtts/losses/bandwidths for matrix, comma lists,\n"
+        "                default 1,10,50,100,300/0,10,100,500,1000/0,10000000\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *all[] = { "bulk", "concurrent", "pingpong", "setup", "sim" };
+    bench_config config;
+    bench_result results[5];
+    bench_cell *cells = NULL;
+    int ncells = 0;
+    int nresults = 0;
+    FILE *fp = stdout;
+    int opt;
+    int i;
+
+    config.scenario = "all";
+    config.window = 16;
+    config.timeout = 500;
+    config.payload = 1400;
+    config.bytes = 16 * 1024 * 1024;
+    config.sessions = 8;
+    config.count = 1000;
+    config.output = NULL;
+    config.log_level = 3;
+    config.delay = 0;
+    config.loss = 0;
+    config.burst = 0;
+    config.reorder = 0;
+    config.bandwidth = 0;
+    config.seed = 1;
+    config.matrix = "1,10,50,100,300/0,10,100,500,1000/0,10000000";
+
+    while ((opt = getopt(argc, argv, "s:w:t:p:b:n:c:o:l:D:L:B:R:K:S:M:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 's': config.scenario = optarg; break;
+        case 'w': config.window = strtoul(optarg, NULL, 0); break;
+        case 't': config.timeout = strtoul(optarg, NULL, 0); break;
+        case 'p': config.payload = strtoul(optarg, NULL, 0); break;
+        case 'b': config.bytes = strtoull(optarg, NULL, 0); break;
+        case 'n': config.sessions = strtoul(optarg, NULL, 0); break;
+        case 'c': config.count = strtoul(optarg, NULL, 0); break;
+        case 'o': config.output = optarg; break;
+        case 'l': config.log_level = atoi(optarg); break;
+        case 'D': config.delay = strtoul(optarg, NULL, 0); break;
+        case 'L': config.loss = strtoul(optarg, NULL, 0); break;
+        case 'B': config.burst = strtoul(optarg, NULL, 0); break;
+        case 'R': config.reorder = strtoul(optarg, NULL, 0); break;
+        case 'K': config.bandwidth = strtoul(optarg, NULL, 0); break;
+        case 'S': config.seed = strtoul(optarg, NULL, 0); break;
+        case 'M': config.matrix = optarg; break;
+        default: usage_(argv[0]); return 1;
+        }
+    }
+
+    if (config.payload == 0 || config.count == 0 ||
+        config.sessions == 0 || config.sessions > BENCH_MAX_SESSIONS)
+    {
+        usage_(argv[0]);
+        return 1;
+    }
+
+    set_log_callback(bench_log);
+    set_log_level(config.log_level);
+
+    if (!strcmp(config.scenario, "matrix"))
+    {
+        ncells = run_matrix_(&config, &cells);
+        if (ncells < 0)
+        {
+            usage_(argv[0]);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < 5; i++)
+    {
+        if (strcmp(config.scenario, "all") && strcmp(config.scenario, all[i]))
+        {
+            continue;
+        }
+        run_scenario_(&config, all[i], &results[nresults++]);
+    }
+
+    if (nresults == 0 && ncells == 0)
+    {
+        usage_(argv[0]);
+        return 1;
+    }
+
+    if (config.output)
+    {
+        fp = fopen(config.output, "w");
+        if (!fp)
+        {
+            fprintf(stderr, "open %s failed. %d\n", config.output, errno);
+            return 1;
+        }
+    }
+
+    fprintf(fp, "{\n  \"bench\": \"t2u\",\n");
+    fprintf(fp, "  \"config\": {\"window\": %lu, \"timeout_ms\": %lu, \"payload\": %lu, "
+        "\"bytes\": %llu, \"sessions\": %lu, \"count\": %lu, "
+        "\"delay_ms\": %lu, \"loss\": %lu, \"burst\": %lu, \"reorder\": %lu, "
+        "\"bandwidth_bps\": %lu, \"seed\": %lu, \"matrix\": \"%s\"},\n",
+        config.window, config.timeout, config.payload,
+        config.bytes, config.sessions, config.count,
+        config.delay, config.loss, config.burst, config.reorder,
+        config.bandwidth, config.seed, config.matrix);
+    fprintf(fp, "  \"results\": [\n");
+    for (i = 0; i < nresults; i++)
+    {
+        print_result_(fp, &results[i], i == nresults - 1);
+    }
+    fprintf(fp, "  ]");
+    if (ncells > 0)
+    {
+        fprintf(fp, ",\n  \"matrix\": [\n");
+        for (i = 0; i < ncells; i++)
+        {
+            print_cell_(fp, &cells[i], i == ncells - 1);
+        }
+        fprintf(fp, "  ]");
+    }
+    fprintf(fp, "\n}\n");
+    free(cells);
+
+    if (fp != stdout)
+    {
+        fclose(fp);
+    }
+
+    for (i = 0; i < nresults; i++)
+    {
+        if (!results[i].completed)
+        {
+            return 2;
+        }
+    }
+    return 0;
+}
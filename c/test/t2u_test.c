@@ -355,10 +355,628 @@ test_context *setup_t2u(int isserver)
 
 
 
+/* intrusive tree, typed the way the containers of t2u are */
+typedef struct test_rb_item_
+{
+    uint32_t key_;
+    t2u_rb_node rb_;
+} test_rb_item;
+
+T2U_RB_GENERATE(test_rb_tree, test_rb_item, rb_, key_, uint32_t, T2U_RB_CMP_NUM)
+
+#define TEST_RB_COUNT (1000)
+
+/* black height of the subtree, asserts the red-black rules and parent links */
+static int test_rb_check_(t2u_rb_node *node, t2u_rb_node *parent)
+{
+    int left;
+    int right;
+
+    if (!node)
+    {
+        return 1;
+    }
+
+    assert(node->parent_ == parent);
+    if (node->red_)
+    {
+        assert(!node->left_ || !node->left_->red_);
+        assert(!node->right_ || !node->right_->red_);
+    }
+
+    left = test_rb_check_(node->left_, node);
+    right = test_rb_check_(node->right_, node);
+    assert(left == right);
+
+    return left + (node->red_ ? 0 : 1);
+}
+
+/* in order walk, count of items */
+static int test_rb_walk_(t2u_rb_root *root)
+{
+    test_rb_item *item;
+    int count = 0;
+    uint32_t last = 0;
+
+    assert(!root->node_ || !root->node_->red_);
+    test_rb_check_(root->node_, NULL);
+
+    for (item = test_rb_tree_first(root); item; item = test_rb_tree_next(item))
+    {
+        assert((count == 0) || (item->key_ > last));
+        last = item->key_;
+        count++;
+    }
+    return count;
+}
+
+static void test_rbtree_()
+{
+    test_rb_item *items = (test_rb_item *)malloc(TEST_RB_COUNT * sizeof(test_rb_item));
+    test_rb_item dup;
+    t2u_rb_root root;
+    int i;
+
+    memset(&root, 0, sizeof(root));
+    assert(t2u_rb_empty(&root));
+    assert(NULL == test_rb_tree_first(&root));
+
+    /* insert in a scrambled order */
+    for (i = 0; i < TEST_RB_COUNT; i++)
+    {
+        items[i].key_ = (uint32_t)((i * 7919) % TEST_RB_COUNT);
+        assert(0 == test_rb_tree_insert(&root, &items[i]));
+    }
+    assert(TEST_RB_COUNT == test_rb_walk_(&root));
+
+    dup.key_ = 17;
+    assert(-1 == test_rb_tree_insert(&root, &dup));
+    assert(TEST_RB_COUNT == test_rb_walk_(&root));
+
+    for (i = 0; i < TEST_RB_COUNT; i++)
+    {
+        test_rb_item *found = test_rb_tree_find(&root, (uint32_t)i);
+        assert(NULL != found);
+        assert(found->key_ == (uint32_t)i);
+    }
+    assert(NULL == test_rb_tree_find(&root, TEST_RB_COUNT));
+
+    /* remove the even keys, from the back */
+    for (i = TEST_RB_COUNT - 1; i >= 0; i--)
+    {
+        if ((items[i].key_ % 2) == 0)
+        {
+            test_rb_tree_remove(&root, &items[i]);
+        }
+    }
+    assert(TEST_RB_COUNT / 2 == test_rb_walk_(&root));
+
+    for (i = 0; i < TEST_RB_COUNT; i++)
+    {
+        test_rb_item *found = test_rb_tree_find(&root, (uint32_t)i);
+        assert((i % 2) ? (NULL != found) : (NULL == found));
+    }
+
+    /* drain from the smallest */
+    while (!t2u_rb_empty(&root))
+    {
+        test_rb_tree_remove(&root, test_rb_tree_first(&root));
+        test_rb_walk_(&root);
+    }
+    assert(NULL == test_rb_tree_first(&root));
+
+    free(items);
+    printf("rbtree ok\n");
+}
+
+static void test_slab_()
+{
+    t2u_slab slab;
+    void **objs;
+    size_t count;
+    size_t i;
+    size_t j;
+
+    t2u_slab_init(&slab, "test", 40);
+    assert(slab.size_ == T2U_CACHE_LINE);
+
+    /* more than two pages */
+    count = slab.per_page_ * 2 + 1;
+    objs = (void **)malloc(count * sizeof(void *));
+
+    for (i = 0; i < count; i++)
+    {
+        objs[i] = t2u_slab_alloc(&slab);
+        assert(NULL != objs[i]);
+        assert(((size_t)objs[i] % T2U_CACHE_LINE) == 0);
+        memset(objs[i], (int)(i & 0xff), slab.size_);
+    }
+    assert(slab.used_ == count);
+    assert(slab.pages_ == 3);
+
+    /* no object was handed out twice */
+    for (i = 0; i < count; i++)
+    {
+        for (j = 0; j < slab.size_; j++)
+        {
+            assert(((unsigned char *)objs[i])[j] == (unsigned char)(i & 0xff));
+        }
+    }
+
+    /* freed objects are used again, no new page */
+    for (i = 0; i < count; i += 2)
+    {
+        t2u_slab_free(&slab, objs[i]);
+    }
+    for (i = 0; i < count; i += 2)
+    {
+        objs[i] = t2u_slab_alloc(&slab);
+        assert(NULL != objs[i]);
+    }
+    assert(slab.pages_ == 3);
+    assert(slab.used_ == count);
+
+    for (i = 0; i < count; i++)
+    {
+        t2u_slab_free(&slab, objs[i]);
+    }
+    t2u_slab_free(&slab, NULL);
+    assert(slab.used_ == 0);
+    assert(slab.allocs_ == slab.frees_);
+
+    t2u_slab_destroy(&slab);
+    assert(slab.pages_ == 0);
+
+    free(objs);
+    printf("slab ok\n");
+}
+
+/* a tunnel in simulation mode, the tcp ends are loopback sockets of this thread */
+typedef struct test_sim_
+{
+    forward_sim sim;
+    forward_context context[2];     /* client side, server side */
+    forward_rule rule[2];
+    sock_t listen;                  /* tcp server behind the server rule */
+    sock_t client;                  /* tcp client of the client rule */
+    sock_t server;                  /* accepted from listen */
+} test_sim;
+
+static unsigned short test_sock_port_(sock_t s)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    getsockname(s, (struct sockaddr *)&addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+static void test_shutdown_(sock_t s)
+{
+#ifdef _MSC_VER
+    shutdown(s, SD_SEND);
+#else
+    shutdown(s, SHUT_WR);
+#endif
+}
+
+static void test_sim_open_(test_sim *ts)
+{
+    struct sockaddr_in addr;
+    int r;
+
+    memset(ts, 0, sizeof(*ts));
+    ts->server = -1;
+    ts->sim = create_forward_sim();
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = 0;
+    ts->listen = socket(AF_INET, SOCK_STREAM, 0);
+    r = bind(ts->listen, (struct sockaddr *)&addr, sizeof(addr));
+    assert(-1 != r);
+    r = listen(ts->listen, 16);
+    assert(-1 != r);
+    evutil_make_socket_nonblocking(ts->listen);
+
+    create_sim_context_pair(ts->sim, &ts->context[0], &ts->context[1]);
+    ts->rule[1] = add_forward_rule(ts->context[1], forward_server_mode, "test", "127.0.0.1", test_sock_port_(ts->listen));
+    ts->rule[0] = add_forward_rule(ts->context[0], forward_client_mode, "test", "127.0.0.1", 0);
+    assert(ts->rule[0] && ts->rule[1]);
+
+    ts->client = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_port = htons(test_sock_port_(((t2u_rule *)ts->rule[0])->listen_sock_));
+    r = connect(ts->client, (struct sockaddr *)&addr, sizeof(addr));
+    assert(-1 != r);
+    evutil_make_socket_nonblocking(ts->client);
+}
+
+/* accept the tunneled connection, then run ms of virtual time */
+static void test_sim_step_(test_sim *ts, unsigned long ms)
+{
+    if (ts->server == -1)
+    {
+        ts->server = accept(ts->listen, NULL, NULL);
+        if (ts->server != -1)
+        {
+            evutil_make_socket_nonblocking(ts->server);
+        }
+    }
+    run_forward_sim(ts->sim, ms);
+}
+
+/* step until the tunnel is up */
+static void test_sim_connect_(test_sim *ts)
+{
+    int i;
+
+    for (i = 0; i < 1000 && ts->server == -1; i++)
+    {
+        test_sim_step_(ts, 1);
+    }
+    assert(ts->server != -1);
+}
+
+/* read what is there, 0 at end of stream, -1 if nothing yet */
+static int test_sim_recv_(sock_t s, char *buff, int len, int *got)
+{
+    int r;
+
+    while ((r = recv(s, buff, len, 0)) > 0)
+    {
+        *got += r;
+    }
+    return r;
+}
+
+static void test_sim_close_(test_sim *ts)
+{
+    free_forward_sim(ts->sim);
+    if (ts->client != -1)
+    {
+        closesocket(ts->client);
+    }
+    if (ts->server != -1)
+    {
+        closesocket(ts->server);
+    }
+    closesocket(ts->listen);
+}
+
+/* fin of the client while the server still sends, then fin back tears the session down */
+static void test_half_close_()
+{
+    test_sim ts;
+    char buff[4096];
+    char in[4096];
+    int got = 0;
+    int sent = 0;
+    int eof = 0;
+    int i;
+    const int total = 256 * 1024;
+
+    test_sim_open_(&ts);
+    test_sim_connect_(&ts);
+
+    i = send(ts.client, "ping", 4, 0);
+    assert(4 == i);
+    test_shutdown_(ts.client);
+
+    /* the server reads the request, then end of stream */
+    for (i = 0; i < 1000 && !eof; i++)
+    {
+        test_sim_step_(&ts, 1);
+        eof = (0 == test_sim_recv_(ts.server, buff, sizeof(buff), &got));
+    }
+    assert(eof);
+    assert(4 == got);
+
+    /* the other direction still flows */
+    memset(buff, 0x5a, sizeof(buff));
+    got = 0;
+    for (i = 0; i < 10000 && got < total; i++)
+    {
+        while (sent < total)
+        {
+            int n = (total - sent < (int)sizeof(buff)) ? (total - sent) : (int)sizeof(buff);
+            int r = send(ts.server, buff, n, 0);
+            if (r <= 0)
+            {
+                break;
+            }
+            sent += r;
+        }
+
+        test_sim_step_(&ts, 1);
+        eof = (0 == test_sim_recv_(ts.client, in, sizeof(in), &got));
+        assert(!eof);
+    }
+    assert(total == got);
+    assert(!t2u_rb_empty(&((t2u_rule *)ts.rule[0])->sessions_));
+    assert(!t2u_rb_empty(&((t2u_rule *)ts.rule[1])->sessions_));
+
+    /* fin back, the client sees end of stream and both sessions go */
+    test_shutdown_(ts.server);
+    eof = 0;
+    for (i = 0; i < 1000 && !eof; i++)
+    {
+        test_sim_step_(&ts, 1);
+        eof = (0 == test_sim_recv_(ts.client, buff, sizeof(buff), &got));
+    }
+    assert(eof);
+    assert(total == got);
+
+    test_sim_step_(&ts, 1000);
+    assert(t2u_rb_empty(&((t2u_rule *)ts.rule[0])->sessions_));
+    assert(t2u_rb_empty(&((t2u_rule *)ts.rule[1])->sessions_));
+    assert(t2u_rb_empty(&((t2u_context *)ts.context[0])->closes_));
+    assert(t2u_rb_empty(&((t2u_context *)ts.context[1])->closes_));
+
+    test_sim_close_(&ts);
+    printf("half close ok\n");
+}
+
+/* reset of the client, the close is resent with the timeout and retries of the rule */
+static void test_close_retrans_()
+{
+    test_sim ts;
+    t2u_context *context;
+    struct linger lg;
+    char buff[16];
+    unsigned long long retrans;
+    int got = 0;
+    int i;
+
+    test_sim_open_(&ts);
+    context = (t2u_context *)ts.context[0];
+
+    /* differ from the context's 500ms and 3 */
+    set_rule_option(ts.rule[0], RULE_UDP_TIMEOUT, 200);
+    set_rule_option(ts.rule[0], RULE_UDP_RETRIES, 2);
+    test_sim_connect_(&ts);
+
+    i = send(ts.client, "ping", 4, 0);
+    assert(4 == i);
+    for (i = 0; i < 1000 && got < 4; i++)
+    {
+        test_sim_step_(&ts, 1);
+        test_sim_recv_(ts.server, buff, sizeof(buff), &got);
+    }
+    assert(4 == got);
+    test_sim_step_(&ts, 100);
+
+    /* close responses of the server side are lost */
+    set_context_option(ts.context[1], CTX_UDP_DEBUG_PACKET_LOSS, 10000);
+    retrans = get_context_stat(ts.context[0], CTX_STAT_UDP_RETRANS_PACKETS);
+
+    lg.l_onoff = 1;
+    lg.l_linger = 0;
+    setsockopt(ts.client, SOL_SOCKET, SO_LINGER, (const char *)&lg, sizeof(lg));
+    closesocket(ts.client);
+    ts.client = -1;
+
+    for (i = 0; i < 1000 && t2u_rb_empty(&context->closes_); i++)
+    {
+        test_sim_step_(&ts, 1);
+    }
+    assert(t2u_rb_empty(&((t2u_rule *)ts.rule[0])->sessions_));
+    assert(!t2u_rb_empty(&context->closes_));
+
+    test_sim_step_(&ts, 150);
+    assert(retrans == get_context_stat(ts.context[0], CTX_STAT_UDP_RETRANS_PACKETS));
+
+    /* every resend waits the rule's 200ms */
+    test_sim_step_(&ts, 100);
+    assert(retrans + 1 == get_context_stat(ts.context[0], CTX_STAT_UDP_RETRANS_PACKETS));
+    test_sim_step_(&ts, 200);
+    assert(retrans + 2 == get_context_stat(ts.context[0], CTX_STAT_UDP_RETRANS_PACKETS));
+    assert(!t2u_rb_empty(&context->closes_));
+
+    /* no third resend, given up */
+    test_sim_step_(&ts, 200);
+    assert(retrans + 2 == get_context_stat(ts.context[0], CTX_STAT_UDP_RETRANS_PACKETS));
+    assert(t2u_rb_empty(&context->closes_));
+
+    test_sim_close_(&ts);
+    printf("close retrans ok\n");
+}
+
+/* data never answered is resent the rule's retries times, then the session goes */
+static void test_data_retries_()
+{
+    test_sim ts;
+    unsigned long long retrans;
+    int i;
+
+    test_sim_open_(&ts);
+
+    /* differ from the context's 500ms and 3 */
+    set_rule_option(ts.rule[0], RULE_UDP_TIMEOUT, 200);
+    set_rule_option(ts.rule[0], RULE_UDP_RETRIES, 2);
+    test_sim_connect_(&ts);
+    test_sim_step_(&ts, 100);
+
+    /* responses of the server side are lost */
+    set_context_option(ts.context[1], CTX_UDP_DEBUG_PACKET_LOSS, 10000);
+    retrans = get_context_stat(ts.context[0], CTX_STAT_UDP_RETRANS_PACKETS);
+
+    i = send(ts.client, "ping", 4, 0);
+    assert(4 == i);
+    test_sim_step_(&ts, 1);
+
+    /* resent at 200ms and 400ms */
+    test_sim_step_(&ts, 450);
+    assert(retrans + 2 == get_context_stat(ts.context[0], CTX_STAT_UDP_RETRANS_PACKETS));
+    assert(!t2u_rb_empty(&((t2u_rule *)ts.rule[0])->sessions_));
+
+    /* no third resend, the session is torn down */
+    test_sim_step_(&ts, 200);
+    assert(retrans + 2 == get_context_stat(ts.context[0], CTX_STAT_UDP_RETRANS_PACKETS));
+    assert(t2u_rb_empty(&((t2u_rule *)ts.rule[0])->sessions_));
+
+    test_sim_close_(&ts);
+    printf("data retries ok\n");
+}
+
+static void test_addr_(struct sockaddr_in *addr, const char *ip, unsigned short port)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = inet_addr(ip);
+    addr->sin_port = htons(port);
+}
+
+/* a message of the session as the udp socket of the context gets it from addr */
+static void test_sim_inject_(forward_context c, const struct sockaddr_in *from, uint16_t oper,
+    uint64_t handle, uint32_t seq, const char *payload, size_t len)
+{
+    char buff[sizeof(t2u_message_data) + 64];
+    t2u_message_data *mdata = (t2u_message_data *)(void *)buff;
+
+    assert(len <= 64);
+    mdata->magic_ = htonl(T2U_MESS_MAGIC);
+    mdata->version_ = htons(1);
+    mdata->oper_ = htons(oper);
+    mdata->handle_ = hton64(handle);
+    mdata->seq_ = htonl(seq);
+    memcpy(mdata->payload, payload, len);
+
+    t2u_context_process_udp((t2u_context *)c, from, buff, (int)(sizeof(t2u_message_data) + len));
+}
+
+/* the peer of a session moves only when the new address answers with its peer id */
+static void test_peer_rebind_()
+{
+    test_sim ts;
+    t2u_context *context;
+    t2u_session *session;
+    t2u_peer *other;
+    t2u_peer *later;
+    struct sockaddr_in old_addr;
+    struct sockaddr_in new_addr;
+    struct sockaddr_in other_addr;
+    struct sockaddr_in later_addr;
+    unsigned long long rebinds;
+    unsigned long long sent;
+    unsigned long long answers;
+    uint64_t handle;
+    uint64_t id;
+    uint64_t wire;
+    uint32_t window;
+    char buff[16];
+    int got = 0;
+    int i;
+
+    test_sim_open_(&ts);
+    test_sim_connect_(&ts);
+
+    i = send(ts.client, "ping", 4, 0);
+    assert(4 == i);
+    for (i = 0; i < 1000 && got < 4; i++)
+    {
+        test_sim_step_(&ts, 1);
+        test_sim_recv_(ts.server, buff, sizeof(buff), &got);
+    }
+    assert(4 == got);
+    test_sim_step_(&ts, 100);
+
+    /* the server side session as a multi peer context has it, the sim link has no addresses */
+    context = (t2u_context *)ts.context[1];
+    session = t2u_session_tree_first(&((t2u_rule *)ts.rule[1])->sessions_);
+    assert(NULL != session);
+    test_addr_(&old_addr, "10.0.0.1", 1000);
+    test_addr_(&new_addr, "10.0.0.2", 2000);
+    test_addr_(&other_addr, "10.0.0.3", 3000);
+    test_addr_(&later_addr, "10.0.0.4", 4000);
+    id = ((t2u_context *)ts.context[0])->peer_id_;
+    assert(0 != id);
+    session->peer_ = t2u_peer_ref(t2u_peer_get(context, &old_addr, id));
+    handle = session->handle_;
+    window = (uint32_t)t2u_rule_slide_window(session->rule_);
+    rebinds = get_context_stat(ts.context[1], CTX_STAT_PEER_REBINDS);
+    sent = get_context_stat(ts.context[1], CTX_STAT_UDP_SENT_PACKETS);
+    answers = get_context_stat(ts.context[0], CTX_STAT_UDP_SENT_PACKETS);
+
+    /* replayed data, delivered before, is dropped without a word */
+    test_sim_inject_(ts.context[1], &other_addr, data_request, handle, session->recv_seq_, "ping", 4);
+    assert(t2u_peer_match(session->peer_, &old_addr));
+
+    /* so is data beyond the window */
+    test_sim_inject_(ts.context[1], &other_addr, data_request, handle, session->recv_seq_ + window + 1, "ping", 4);
+    assert(t2u_peer_match(session->peer_, &old_addr));
+    assert(sent == get_context_stat(ts.context[1], CTX_STAT_UDP_SENT_PACKETS));
+
+    /* guessed data in the window only earns a rebind request, the peer stays */
+    test_sim_inject_(ts.context[1], &other_addr, data_request, handle, session->recv_seq_ + 1, "evil", 4);
+    assert(t2u_peer_match(session->peer_, &old_addr));
+    assert(sent + 1 == get_context_stat(ts.context[1], CTX_STAT_UDP_SENT_PACKETS));
+
+    /* the sim link takes the request to the client, its answer has no new address */
+    test_sim_step_(&ts, 10);
+    assert(answers + 1 == get_context_stat(ts.context[0], CTX_STAT_UDP_SENT_PACKETS));
+    assert(t2u_peer_match(session->peer_, &old_addr));
+
+    /* a rebind response with another id */
+    wire = hton64(id + 1);
+    test_sim_inject_(ts.context[1], &other_addr, rebind_response, handle, 0, (char *)&wire, sizeof(wire));
+    assert(t2u_peer_match(session->peer_, &old_addr));
+    assert(rebinds == get_context_stat(ts.context[1], CTX_STAT_PEER_REBINDS));
+
+    /* peer b, another client, closes the handle of this one */
+    other = t2u_peer_ref(t2u_peer_get(context, &other_addr, id + 1));
+    test_sim_inject_(ts.context[1], &other_addr, close_request, handle, 0, NULL, 0);
+    assert(session == find_session_in_context(context, handle, 1));
+    assert(t2u_peer_match(session->peer_, &old_addr));
+    assert(rebinds == get_context_stat(ts.context[1], CTX_STAT_PEER_REBINDS));
+
+    /* the right id from the new address moves the peer */
+    wire = hton64(id);
+    test_sim_inject_(ts.context[1], &new_addr, rebind_response, handle, 0, (char *)&wire, sizeof(wire));
+    assert(t2u_peer_match(session->peer_, &new_addr));
+    assert(rebinds + 1 == get_context_stat(ts.context[1], CTX_STAT_PEER_REBINDS));
+
+    /* data from there is delivered now, not the forged one */
+    test_sim_inject_(ts.context[1], &new_addr, data_request, handle, session->recv_seq_ + 1, "pong", 4);
+
+    /* data from the address just left is dropped, the peer stays */
+    test_sim_inject_(ts.context[1], &old_addr, data_request, handle, session->recv_seq_ + 1, "late", 4);
+    assert(t2u_peer_match(session->peer_, &new_addr));
+
+    got = 0;
+    for (i = 0; i < 100; i++)
+    {
+        test_sim_step_(&ts, 1);
+        test_sim_recv_(ts.server, buff + got, sizeof(buff) - got, &got);
+    }
+    assert(4 == got);
+    assert(0 == memcmp(buff, "pong", 4));
+    assert(t2u_peer_match(session->peer_, &new_addr));
+    assert(rebinds + 1 == get_context_stat(ts.context[1], CTX_STAT_PEER_REBINDS));
+
+    /* a later session of the same client proved its address, a close from there is handled */
+    later = t2u_peer_ref(t2u_peer_get(context, &later_addr, id));
+    test_sim_inject_(ts.context[1], &later_addr, close_request, handle, 0, NULL, 0);
+    assert(NULL == find_session_in_context(context, handle, 1));
+    assert(rebinds + 1 == get_context_stat(ts.context[1], CTX_STAT_PEER_REBINDS));
+
+    t2u_peer_put(context, later);
+    t2u_peer_put(context, other);
+    test_sim_close_(&ts);
+    printf("peer rebind ok\n");
+}
+
+
 int main()
 {
     set_log_callback(test_log);
 
+    test_rbtree_();
+    test_slab_();
+    test_half_close_();
+    test_close_retrans_();
+    test_data_retries_();
+    test_peer_rebind_();
+
 #ifdef _MSC_VER
     WSADATA wsaData;
     WSAStartup(MAKEWORD(1, 2), &wsaData);